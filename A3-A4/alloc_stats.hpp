@@ -0,0 +1,179 @@
+#pragma once
+
+// Heap and resident-memory telemetry for the phase breakdown. Off unless MPC_ALLOC is set in
+// the environment; then the global operator new and delete below count every allocation in
+// the process, pool threads included, and track the live heap and its high-water mark.
+// current_rss_bytes() and peak_rss_bytes() read the resident size from the kernel.
+//
+// The counts are cumulative, so a steady state can be checked by differencing two snapshots:
+//
+//   AllocCounts before = alloc_stats().counts();
+//   run_query();
+//   assert((alloc_stats().counts() - before).allocations == 0);
+//
+// The replacement operators are defined in this header, so a program must include it in one
+// translation unit only, as the programs here (one .cpp each) do. libstdc++ routes the array,
+// nothrow and sized forms through the four replaced here.
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+struct AllocCounts {
+    uint64_t allocations = 0, frees = 0;
+    uint64_t bytes = 0;  // Requested by the allocations.
+
+    AllocCounts operator-(const AllocCounts& other) const {
+        return {allocations - other.allocations, frees - other.frees, bytes - other.bytes};
+    }
+
+    AllocCounts& operator+=(const AllocCounts& other) {
+        allocations += other.allocations;
+        frees += other.frees;
+        bytes += other.bytes;
+        return *this;
+    }
+};
+
+class AllocStats {
+public:
+    AllocStats() : enabled(std::getenv("MPC_ALLOC") != nullptr) {}
+
+    bool on() const { return enabled.load(std::memory_order_relaxed); }
+
+    // For tests that count without the environment variable. Blocks freed after the switch
+    // that were allocated before it make the live size run low.
+    void enable() { enabled.store(true, std::memory_order_relaxed); }
+
+    AllocCounts counts() const {
+        return {allocations.load(std::memory_order_relaxed), frees.load(std::memory_order_relaxed),
+                bytes.load(std::memory_order_relaxed)};
+    }
+
+    // Heap bytes allocated and not yet freed, as the allocator sized the blocks.
+    int64_t live_bytes() const { return live.load(std::memory_order_relaxed); }
+
+    // The high-water mark of live_bytes() is kept per scope: begin_peak() restarts it at the
+    // current live size and returns the enclosing scope's mark, which end_peak() takes back
+    // after reading this scope's peak. Scopes that overlap without nesting share the mark.
+    int64_t begin_peak() { return peak.exchange(live_bytes(), std::memory_order_relaxed); }
+
+    int64_t end_peak(int64_t enclosing) {
+        int64_t scope_peak = peak.load(std::memory_order_relaxed);
+        raise_peak(enclosing);
+        return scope_peak;
+    }
+
+    void on_alloc(void* ptr, size_t size) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(size, std::memory_order_relaxed);
+        int64_t block = block_size(ptr);
+        raise_peak(live.fetch_add(block, std::memory_order_relaxed) + block);
+    }
+
+    void on_free(void* ptr) {
+        frees.fetch_add(1, std::memory_order_relaxed);
+        live.fetch_sub(block_size(ptr), std::memory_order_relaxed);
+    }
+
+private:
+    static int64_t block_size(void* ptr) {
+#ifdef __linux__
+        return (int64_t)malloc_usable_size(ptr);
+#else
+        return 0;  // No portable way to size a freed block, so the live heap is not tracked.
+#endif
+    }
+
+    void raise_peak(int64_t value) {
+        int64_t seen = peak.load(std::memory_order_relaxed);
+        while (value > seen && !peak.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    std::atomic<bool> enabled;
+    std::atomic<uint64_t> allocations{0}, frees{0}, bytes{0};
+    std::atomic<int64_t> live{0}, peak{0};
+};
+
+inline AllocStats& alloc_stats() {
+    static AllocStats stats;
+    return stats;
+}
+
+// Resident set size now, from /proc/self/statm; 0 where it cannot be read. Reads with a stack
+// buffer, so sampling does not allocate.
+inline uint64_t current_rss_bytes() {
+#ifdef __linux__
+    int fd = ::open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    char buffer[128];
+    ssize_t length = ::read(fd, buffer, sizeof(buffer) - 1);
+    ::close(fd);
+    if (length <= 0) return 0;
+    buffer[length] = '\0';
+    // Fields: total program size, then resident pages.
+    char* end = nullptr;
+    std::strtoull(buffer, &end, 10);
+    uint64_t pages = std::strtoull(end, nullptr, 10);
+    return pages * (uint64_t)sysconf(_SC_PAGESIZE);
+#else
+    return 0;
+#endif
+}
+
+// The process's peak resident set size so far.
+inline uint64_t peak_rss_bytes() {
+#ifdef __linux__
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    return (uint64_t)usage.ru_maxrss * 1024;  // ru_maxrss is in kilobytes.
+#else
+    return 0;
+#endif
+}
+
+void* operator new(size_t size) {
+    void* ptr = std::malloc(size ? size : 1);
+    if (!ptr) throw std::bad_alloc();
+    if (alloc_stats().on()) alloc_stats().on_alloc(ptr, size);
+    return ptr;
+}
+
+void* operator new(size_t size, std::align_val_t align) {
+    size_t alignment = (size_t)align;
+    // aligned_alloc wants a multiple of the alignment.
+    void* ptr = std::aligned_alloc(alignment, size ? (size + alignment - 1) / alignment * alignment : alignment);
+    if (!ptr) throw std::bad_alloc();
+    if (alloc_stats().on()) alloc_stats().on_alloc(ptr, size);
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+    if (!ptr) return;
+    if (alloc_stats().on()) alloc_stats().on_free(ptr);
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    if (!ptr) return;
+    if (alloc_stats().on()) alloc_stats().on_free(ptr);
+    std::free(ptr);
+}
+
+// The sized forms are what -fsized-deallocation calls; the tracker looks the size up itself.
+void operator delete(void* ptr, size_t) noexcept {
+    operator delete(ptr);
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t align) noexcept {
+    operator delete(ptr, align);
+}
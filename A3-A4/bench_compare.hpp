@@ -0,0 +1,388 @@
+#pragma once
+
+// Regression checks between two benchmark result files, for bench_driver's comparison mode.
+// Both of the formats here are read: bench_driver's (one entry per configuration, each value
+// with the samples of its repetitions) and bench_kernels' (one entry per benchmark and size,
+// with its timing samples). Every value in them is a cost, so larger is worse.
+//
+// A metric has regressed when the median of its current samples exceeds the baseline's by
+// more than the threshold, and the slowdown is significant: by a one-sided Mann-Whitney U
+// test (exact without ties for up to 20 samples a side, the normal approximation otherwise),
+// or by a bootstrap confidence interval of the ratio of the medians that lies above 1.
+// Values without spread on either side, such as byte counts, need no test. A metric with fewer
+// than two samples on a side cannot be tested and is reported but never fails the check. The
+// threshold also guards against the false positives that come with testing many metrics.
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Just enough JSON for the result files: no escapes beyond \" and \\, and no unicode.
+struct JsonValue {
+    enum class Type { Null, Bool, Number, String, Array, Object };
+    Type type = Type::Null;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::vector<JsonValue> items;
+    std::vector<std::pair<std::string, JsonValue>> members;
+
+    const JsonValue* find(const std::string& key) const {
+        for (const auto& [name, value] : members) {
+            if (name == key) return &value;
+        }
+        return nullptr;
+    }
+};
+
+class JsonParser {
+public:
+    explicit JsonParser(const std::string& text) : text(text) {}
+
+    JsonValue parse() {
+        JsonValue value = parse_value();
+        skip_space();
+        if (pos != text.size()) fail("trailing characters");
+        return value;
+    }
+
+private:
+    [[noreturn]] void fail(const char* what) const {
+        throw std::runtime_error(std::string("Malformed JSON (") + what + ") at offset " + std::to_string(pos));
+    }
+
+    void skip_space() {
+        while (pos < text.size() && std::isspace((unsigned char)text[pos])) pos++;
+    }
+
+    bool consume(char c) {
+        skip_space();
+        if (pos < text.size() && text[pos] == c) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    void expect(char c) {
+        if (!consume(c)) fail("unexpected character");
+    }
+
+    std::string parse_string() {
+        expect('"');
+        std::string out;
+        while (pos < text.size() && text[pos] != '"') {
+            if (text[pos] == '\\' && pos + 1 < text.size()) pos++;
+            out += text[pos++];
+        }
+        if (pos == text.size()) fail("unterminated string");
+        pos++;
+        return out;
+    }
+
+    JsonValue parse_value() {
+        skip_space();
+        if (pos == text.size()) fail("unexpected end");
+        JsonValue value;
+        char c = text[pos];
+        if (c == '{') {
+            value.type = JsonValue::Type::Object;
+            pos++;
+            if (consume('}')) return value;
+            do {
+                skip_space();
+                std::string key = parse_string();
+                expect(':');
+                value.members.emplace_back(std::move(key), parse_value());
+            } while (consume(','));
+            expect('}');
+        } else if (c == '[') {
+            value.type = JsonValue::Type::Array;
+            pos++;
+            if (consume(']')) return value;
+            do {
+                value.items.push_back(parse_value());
+            } while (consume(','));
+            expect(']');
+        } else if (c == '"') {
+            value.type = JsonValue::Type::String;
+            value.string = parse_string();
+        } else if (text.compare(pos, 4, "true") == 0 || text.compare(pos, 5, "false") == 0) {
+            value.type = JsonValue::Type::Bool;
+            value.boolean = c == 't';
+            pos += value.boolean ? 4 : 5;
+        } else if (text.compare(pos, 4, "null") == 0) {
+            pos += 4;
+        } else {
+            const char* start = text.c_str() + pos;
+            char* end = nullptr;
+            value.type = JsonValue::Type::Number;
+            value.number = std::strtod(start, &end);
+            if (end == start) fail("unexpected character");
+            pos += end - start;
+        }
+        return value;
+    }
+
+    const std::string& text;
+    size_t pos = 0;
+};
+
+// One value of a result file and its samples.
+struct BenchMetric {
+    std::string name;
+    std::vector<double> samples;
+};
+
+// The samples of a summary; the mean alone when the file predates samples.
+inline std::vector<double> summary_samples(const JsonValue& summary) {
+    std::vector<double> samples;
+    if (const JsonValue* list = summary.find("samples")) {
+        for (const JsonValue& item : list->items) samples.push_back(item.number);
+    } else if (const JsonValue* mean = summary.find("mean")) {
+        samples.push_back(mean->number);
+    }
+    return samples;
+}
+
+// Reads the metrics of a bench_driver or bench_kernels result file. Names identify a metric
+// across files: the configuration and party for bench_driver's, benchmark and size for
+// bench_kernels'.
+inline std::vector<BenchMetric> load_bench_metrics(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) throw std::runtime_error("Cannot open " + path);
+    std::stringstream text;
+    text << in.rdbuf();
+    JsonValue root = JsonParser(text.str()).parse();
+
+    std::vector<BenchMetric> metrics;
+    if (const JsonValue* benchmarks = root.find("benchmarks")) {
+        for (const JsonValue& b : benchmarks->items) {
+            const JsonValue* name = b.find("name");
+            const JsonValue* size = b.find("size");
+            if (!name || !size) continue;
+            char label[160];
+            std::snprintf(label, sizeof(label), "%s size=%.0f", name->string.c_str(), size->number);
+            metrics.push_back({label, summary_samples(b)});
+        }
+        return metrics;
+    }
+    const JsonValue* configs = root.find("configs");
+    if (!configs) throw std::runtime_error(path + " is neither a bench_driver nor a bench_kernels result file");
+    for (const JsonValue& config : configs->items) {
+        const JsonValue* ok = config.find("ok");
+        const JsonValue* params = config.find("params");
+        if (!ok || !ok->boolean || !params) continue;
+        std::string label;
+        if (const JsonValue* engine = params->find("engine")) label = engine->string;
+        for (const auto& [name, value] : params->members) {
+            if (value.type != JsonValue::Type::Number) continue;
+            char field[64];
+            std::snprintf(field, sizeof(field), " %s=%.0f", name.c_str(), value.number);
+            label += field;
+        }
+        for (const char* key : {"cleartext_ns_per_query", "overhead"}) {
+            if (const JsonValue* summary = config.find(key)) metrics.push_back({label + " " + key, summary_samples(*summary)});
+        }
+        const JsonValue* parties = config.find("parties");
+        if (!parties) continue;
+        for (const auto& [party, entry] : parties->members) {
+            if (const JsonValue* phases = entry.find("phases")) {
+                for (const auto& [phase, summary] : phases->members) {
+                    metrics.push_back({label + " " + party + " " + phase + "_ns", summary_samples(summary)});
+                }
+            }
+            if (const JsonValue* links = entry.find("links")) {
+                for (const auto& [link, values] : links->members) {
+                    for (const auto& [kind, summary] : values.members) {
+                        metrics.push_back({label + " " + party + " " + link + " " + kind, summary_samples(summary)});
+                    }
+                }
+            }
+        }
+    }
+    return metrics;
+}
+
+inline double sample_median(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    size_t mid = values.size() / 2;
+    return values.size() % 2 ? values[mid] : (values[mid - 1] + values[mid]) / 2;
+}
+
+// One-sided Mann-Whitney U test: the probability, with both samples from one distribution, of
+// `larger` beating `smaller` at least as often as it does here. Ties count half.
+inline double mann_whitney_p(const std::vector<double>& larger, const std::vector<double>& smaller) {
+    size_t m = larger.size(), n = smaller.size();
+    double u = 0;
+    for (double x : larger) {
+        for (double y : smaller) u += x > y ? 1.0 : x == y ? 0.5 : 0.0;
+    }
+    std::vector<double> all(larger);
+    all.insert(all.end(), smaller.begin(), smaller.end());
+    std::sort(all.begin(), all.end());
+    double tie_term = 0;
+    bool ties = false;
+    for (size_t i = 0, j; i < all.size(); i = j) {
+        for (j = i; j < all.size() && all[j] == all[i]; j++) {
+        }
+        double t = (double)(j - i);
+        tie_term += t * t * t - t;
+        ties = ties || j - i > 1;
+    }
+
+    if (!ties && m <= 20 && n <= 20) {
+        // count[a][b][k]: orderings of a values of `larger` and b of `smaller` with U = k. The
+        // largest value is one of `larger`, beating all b, or one of `smaller`.
+        size_t max_u = m * n;
+        auto at = [&](size_t a, size_t b, size_t k) { return (a * (n + 1) + b) * (max_u + 1) + k; };
+        std::vector<double> count((m + 1) * (n + 1) * (max_u + 1), 0.0);
+        for (size_t a = 0; a <= m; a++) {
+            for (size_t b = 0; b <= n; b++) {
+                if (a == 0 || b == 0) {
+                    count[at(a, b, 0)] = 1;
+                    continue;
+                }
+                for (size_t k = 0; k <= a * b; k++) {
+                    count[at(a, b, k)] = (k >= b ? count[at(a - 1, b, k - b)] : 0.0) + count[at(a, b - 1, k)];
+                }
+            }
+        }
+        double tail = 0, total = 0;
+        for (size_t k = 0; k <= max_u; k++) {
+            total += count[at(m, n, k)];
+            if ((double)k >= u) tail += count[at(m, n, k)];
+        }
+        return tail / total;
+    }
+    double total = (double)(m + n);
+    double variance = m * n / 12.0 * ((total + 1) - tie_term / (total * (total - 1)));
+    if (variance <= 0) return 1.0;
+    double z = (u - m * n / 2.0 - 0.5) / std::sqrt(variance);
+    return 0.5 * std::erfc(z / std::sqrt(2.0));
+}
+
+// Percentile bootstrap of median(current) / median(baseline): the `alpha` and 1 - `alpha`
+// quantiles of the ratio over resamples of both. Seeded, so reruns agree.
+inline std::pair<double, double> bootstrap_ratio_interval(const std::vector<double>& baseline,
+                                                          const std::vector<double>& current, double alpha,
+                                                          size_t resamples = 2000) {
+    std::mt19937_64 rng(1);
+    std::vector<double> ratios, b(baseline.size()), c(current.size());
+    for (size_t r = 0; r < resamples; r++) {
+        for (double& v : b) v = baseline[rng() % baseline.size()];
+        for (double& v : c) v = current[rng() % current.size()];
+        double base = sample_median(b);
+        ratios.push_back(base > 0 ? sample_median(c) / base : std::numeric_limits<double>::infinity());
+    }
+    std::sort(ratios.begin(), ratios.end());
+    auto quantile = [&](double q) { return ratios[std::min(ratios.size() - 1, (size_t)(q * ratios.size()))]; };
+    return {quantile(alpha), quantile(1 - alpha)};
+}
+
+enum class CompareTest { MannWhitney, Bootstrap };
+
+struct CompareOptions {
+    double threshold = 0.10;  // Largest tolerated slowdown of the median, as a fraction.
+    double alpha = 0.05;      // Significance level of the one-sided tests.
+    CompareTest test = CompareTest::MannWhitney;
+};
+
+enum class CompareStatus { Unchanged, Regressed, Improved, Untested, Missing };
+
+struct MetricComparison {
+    std::string name;
+    CompareStatus status = CompareStatus::Unchanged;
+    double baseline_median = 0, current_median = 0, ratio = 1;
+    double p_value = 1;  // Of the one-sided test in the direction of the change.
+    std::pair<double, double> interval{1, 1};
+};
+
+inline MetricComparison compare_metric(const BenchMetric& baseline, const BenchMetric& current,
+                                       const CompareOptions& options) {
+    MetricComparison result;
+    result.name = baseline.name;
+    if (baseline.samples.empty() || current.samples.empty()) {
+        result.status = CompareStatus::Missing;
+        return result;
+    }
+    result.baseline_median = sample_median(baseline.samples);
+    result.current_median = sample_median(current.samples);
+    if (result.baseline_median > 0) {
+        result.ratio = result.current_median / result.baseline_median;
+    } else {
+        result.ratio = result.current_median > 0 ? std::numeric_limits<double>::infinity() : 1.0;
+    }
+    bool slower = result.ratio > 1 + options.threshold;
+    bool faster = result.ratio < 1 - options.threshold;
+    if (baseline.samples.size() < 2 || current.samples.size() < 2) {
+        if (slower || faster) result.status = CompareStatus::Untested;
+        return result;
+    }
+    auto [base_min, base_max] = std::minmax_element(baseline.samples.begin(), baseline.samples.end());
+    auto [cur_min, cur_max] = std::minmax_element(current.samples.begin(), current.samples.end());
+    bool exact = *base_min == *base_max && *cur_min == *cur_max;
+    result.interval = {result.ratio, result.ratio};
+    result.p_value = exact ? 0.0 : 1.0;
+    if (!exact) {
+        result.interval = bootstrap_ratio_interval(baseline.samples, current.samples, options.alpha);
+        result.p_value = result.ratio >= 1 ? mann_whitney_p(current.samples, baseline.samples)
+                                           : mann_whitney_p(baseline.samples, current.samples);
+    }
+    bool significant = exact;
+    if (!exact && options.test == CompareTest::MannWhitney) significant = result.p_value < options.alpha;
+    if (!exact && options.test == CompareTest::Bootstrap) {
+        significant = result.ratio >= 1 ? result.interval.first > 1 : result.interval.second < 1;
+    }
+    if (significant && slower) result.status = CompareStatus::Regressed;
+    if (significant && faster) result.status = CompareStatus::Improved;
+    return result;
+}
+
+// Compares every metric of `baseline` with the one of the same name in `current`, printing
+// the metrics that moved beyond the threshold and a summary. Returns the number that regressed.
+inline size_t compare_bench_results(const std::string& baseline_path, const std::string& current_path,
+                                    const CompareOptions& options) {
+    std::vector<BenchMetric> baseline = load_bench_metrics(baseline_path);
+    std::vector<BenchMetric> current = load_bench_metrics(current_path);
+    std::printf("Comparing %s with the baseline %s: %s test, %.3g%% threshold, alpha %.3g\n", current_path.c_str(),
+                baseline_path.c_str(), options.test == CompareTest::MannWhitney ? "Mann-Whitney" : "bootstrap",
+                options.threshold * 100, options.alpha);
+
+    size_t counts[5] = {};
+    for (const BenchMetric& base : baseline) {
+        auto match = std::find_if(current.begin(), current.end(), [&](const BenchMetric& m) { return m.name == base.name; });
+        MetricComparison c = compare_metric(base, match == current.end() ? BenchMetric{base.name, {}} : *match, options);
+        counts[(size_t)c.status]++;
+        static const char* const labels[] = {"", "REGRESSED", "improved", "untested", "missing"};
+        if (c.status == CompareStatus::Missing) {
+            std::printf("  %-9s %s\n", labels[(size_t)c.status], c.name.c_str());
+        } else if (c.status != CompareStatus::Unchanged) {
+            std::printf("  %-9s %s: %.6g -> %.6g (%+.1f%%), p = %.3g, ratio in [%.3f, %.3f]\n", labels[(size_t)c.status],
+                        c.name.c_str(), c.baseline_median, c.current_median, (c.ratio - 1) * 100, c.p_value,
+                        c.interval.first, c.interval.second);
+        }
+    }
+    size_t added = 0;
+    for (const BenchMetric& cur : current) {
+        auto match = std::find_if(baseline.begin(), baseline.end(), [&](const BenchMetric& m) { return m.name == cur.name; });
+        if (match == baseline.end()) added++;
+    }
+    std::printf("%zu metrics: %zu regressed, %zu improved, %zu unchanged, %zu untested (fewer than 2 samples), "
+                "%zu missing from the current results, %zu new\n",
+                baseline.size(), counts[(size_t)CompareStatus::Regressed], counts[(size_t)CompareStatus::Improved],
+                counts[(size_t)CompareStatus::Unchanged], counts[(size_t)CompareStatus::Untested],
+                counts[(size_t)CompareStatus::Missing], added);
+    return counts[(size_t)CompareStatus::Regressed];
+}
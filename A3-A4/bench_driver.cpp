@@ -0,0 +1,574 @@
+// Benchmark driver for the whole protocol (runs locally).
+//
+// Sweeps a grid of parameters. For every combination it generates data and queries with
+// gen_queries, then runs P2, P1 and P0 as local processes: the warm-up runs are discarded,
+// and after every repetition it reads back the phases_p*.json and traffic_p*.json the parties
+// wrote. For every party and phase it reports the mean time per query over the repetitions,
+// with its standard deviation and the half-width of its 95% confidence interval (Student's
+// t), and the bytes and rounds per query on every link. It also times the cleartext update
+// (cleartext.hpp) on the same data and queries, and reports P0's query time over it as the
+// protocol's overhead factor.
+//
+// The results go to <out>.csv, one row per value, and <out>.json, one entry per combination,
+// with the value of every repetition.
+// The parties connect to the hosts p1 and p2 and keep their files in /app/data, as in the
+// containers, so locally both names must resolve to this machine (e.g. "127.0.0.1 p1 p2" in
+// /etc/hosts) and /app/data must be writable. The party logs of the last run are left there.
+//
+// Usage: bench_driver [--m=<list>] [--n=<list>] [--k=<list>] [--q=<list>] [--pack_bits=<list>]
+//                     [--ring_bits=<list>] [--engine=<list of bgi|halftree>] [--reps=<count>]
+//                     [--warmup=<count>] [--bin=<dir>] [--out=<prefix>] [--timeout=<seconds>]
+//
+// Lists are comma-separated (e.g. --n=1000,10000,100000); parameters left out keep their
+// usual defaults. --bin is where p0, p1, p2 and gen_queries are (default: the current directory).
+//
+// With --baseline=<file>, the results are then compared with those of an earlier sweep (see
+// bench_compare.hpp), and the driver exits with status 2 if any value regressed by more than
+// --threshold percent (default 10) at significance --alpha (default 0.05), by a Mann-Whitney
+// test or, with --test=bootstrap, a bootstrap interval. --current=<file> compares an existing
+// file instead of running a sweep; it may also hold bench_kernels results:
+//
+//   bench_driver --baseline=kernels_main.json --current=kernels.json --threshold=5
+
+#include "bench_compare.hpp"
+#include "cleartext.hpp"
+#include "metrics.hpp"
+#include "params.hpp"
+
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+namespace {
+
+const std::string DATA_DIR = "/app/data";  // Where the parties read and write.
+constexpr size_t PARTY_COUNT = 3;
+constexpr std::array<const char*, PARTY_COUNT> PARTY_NAMES = {"P0", "P1", "P2"};
+const double MISSING = std::numeric_limits<double>::quiet_NaN();
+
+struct Options {
+    // One list of values per parameter of param_fields(), plus the DPF engine; an empty list
+    // leaves the parameter out.
+    std::vector<std::vector<std::string>> grid = std::vector<std::vector<std::string>>(param_fields().size());
+    std::vector<std::string> engines;
+    uint32_t reps = 5;
+    uint32_t warmup = 1;
+    std::string bin = ".";
+    std::string out = "bench_results";
+    uint32_t timeout = 600;
+    std::string baseline, current;  // Result files to compare; no sweep runs with `current`.
+    CompareOptions compare;
+};
+
+// Mean of the repetitions, their sample standard deviation, and the half-width of the 95%
+// confidence interval of the mean, and the repetitions themselves.
+struct Summary {
+    double mean = MISSING, stddev = MISSING, ci95 = MISSING;
+    size_t count = 0;
+    std::vector<double> samples;
+};
+
+// Two-sided 95% quantiles of Student's t for 1 to 30 degrees of freedom; the normal one after.
+double t_quantile_95(size_t df) {
+    static const double table[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                   2.201,  2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                                   2.080,  2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+    return df <= 30 ? table[df - 1] : 1.960;
+}
+
+Summary summarize(const std::vector<double>& values) {
+    Summary s;
+    double sum = 0;
+    for (double v : values) {
+        if (std::isnan(v)) continue;
+        sum += v;
+        s.samples.push_back(v);
+        s.count++;
+    }
+    if (s.count == 0) return s;
+    s.mean = sum / s.count;
+    if (s.count == 1) return s;
+    double squares = 0;
+    for (double v : values) {
+        if (!std::isnan(v)) squares += (v - s.mean) * (v - s.mean);
+    }
+    s.stddev = std::sqrt(squares / (s.count - 1));
+    s.ci95 = t_quantile_95(s.count - 1) * s.stddev / std::sqrt((double)s.count);
+    return s;
+}
+
+std::vector<std::string> split_list(const std::string& text) {
+    std::vector<std::string> items;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+std::string read_file(const std::string& path) {
+    std::ifstream in(path);
+    std::stringstream text;
+    text << in.rdbuf();
+    return text.str();
+}
+
+// The number stored under the keys of `path` in one of the files the parties write, each key
+// searched for after the previous one; NaN if a key is missing. This is enough for those files,
+// whose keys are unique within each object along the way.
+double json_number(const std::string& text, std::initializer_list<std::string> path) {
+    size_t pos = 0;
+    for (const std::string& key : path) {
+        pos = text.find("\"" + key + "\":", pos);
+        if (pos == std::string::npos) return MISSING;
+        pos += key.size() + 3;
+    }
+    const char* start = text.c_str() + pos;
+    char* end = nullptr;
+    double value = std::strtod(start, &end);
+    return end == start ? MISSING : value;
+}
+
+// Starts `program` with `args`, its output going to `log`; returns its pid, or -1.
+pid_t spawn(const std::string& program, const std::vector<std::string>& args, const std::string& log) {
+    std::vector<char*> argv;
+    argv.push_back(const_cast<char*>(program.c_str()));
+    for (const std::string& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+    pid_t pid = -1;
+    if (posix_spawn(&pid, program.c_str(), &actions, nullptr, argv.data(), environ) != 0) pid = -1;
+    posix_spawn_file_actions_destroy(&actions);
+    return pid;
+}
+
+// Waits for all of `pids`; true if every one exits with status 0 within `timeout` seconds.
+// Stragglers are killed.
+bool wait_all(std::vector<pid_t> pids, uint32_t timeout) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout);
+    bool ok = true;
+    size_t running = pids.size();
+    while (running > 0) {
+        for (pid_t& pid : pids) {
+            if (pid <= 0) continue;
+            int status = 0;
+            if (waitpid(pid, &status, WNOHANG) != pid) continue;
+            ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            pid = 0;
+            running--;
+        }
+        if (running == 0) break;
+        if (std::chrono::steady_clock::now() > deadline) {
+            for (pid_t pid : pids) {
+                if (pid > 0) {
+                    kill(pid, SIGKILL);
+                    waitpid(pid, nullptr, 0);
+                }
+            }
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return ok;
+}
+
+bool generate(const Options& options, const std::vector<std::string>& args) {
+    std::vector<std::string> gen_args = {DATA_DIR};
+    gen_args.insert(gen_args.end(), args.begin(), args.end());
+    pid_t pid = spawn(options.bin + "/gen_queries", gen_args, DATA_DIR + "/bench_gen.log");
+    return pid > 0 && wait_all({pid}, options.timeout);
+}
+
+// One run of the protocol. P2 must listen before P1 connects, and P1 before P0 does; the
+// parties do not retry, so they are started a moment apart, as docker-compose does.
+bool run_protocol(const Options& options) {
+    for (const char* prefix : {"phases_p", "traffic_p"}) {
+        for (size_t party = 0; party < PARTY_COUNT; party++) {
+            std::remove((DATA_DIR + "/" + prefix + std::to_string(party) + ".json").c_str());
+        }
+    }
+    std::vector<pid_t> pids;
+    for (int party : {2, 1, 0}) {
+        std::string name = "p" + std::to_string(party);
+        pid_t pid = spawn(options.bin + "/" + name, {}, DATA_DIR + "/bench_" + name + ".log");
+        if (pid <= 0) {
+            wait_all(pids, 0);
+            return false;
+        }
+        pids.push_back(pid);
+        if (party > 0) std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    }
+    return wait_all(pids, options.timeout);
+}
+
+// Values of one repetition; NaN where a party did not report them.
+struct RunResult {
+    std::array<std::array<double, PHASE_COUNT>, PARTY_COUNT> phase_ns;
+    std::array<std::array<double, LINK_COUNT>, PARTY_COUNT> bytes_sent, bytes_received, rounds;
+};
+
+RunResult read_results() {
+    RunResult result;
+    for (size_t party = 0; party < PARTY_COUNT; party++) {
+        std::string phases = read_file(DATA_DIR + "/phases_p" + std::to_string(party) + ".json");
+        for (size_t phase = 0; phase < PHASE_COUNT; phase++) {
+            result.phase_ns[party][phase] = json_number(phases, {"phases", PHASE_NAMES[phase], "mean"});
+        }
+        std::string traffic = read_file(DATA_DIR + "/traffic_p" + std::to_string(party) + ".json");
+        double queries = json_number(traffic, {"queries"});
+        for (size_t link = 0; link < LINK_COUNT; link++) {
+            auto per_query = [&](const char* field) {
+                return json_number(traffic, {"links", LINK_NAMES[link], "queries", field}) / queries;
+            };
+            result.bytes_sent[party][link] = per_query("bytes_sent");
+            result.bytes_received[party][link] = per_query("bytes_received");
+            result.rounds[party][link] = per_query("rounds");
+        }
+    }
+    return result;
+}
+
+// Nanoseconds per query of the cleartext update, repeated over the query list until it has
+// run for at least 20 ms so that small configurations are above the clock's resolution.
+double time_cleartext(const ShareMat& U, const ShareMat& V, const std::vector<std::pair<uint32_t, uint32_t>>& queries) {
+    ShareMat U_copy = U, V_copy = V;
+    size_t rounds = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::duration elapsed{};
+    do {
+        apply_cleartext_updates(U_copy, V_copy, queries);
+        rounds++;
+        elapsed = std::chrono::steady_clock::now() - start;
+    } while (elapsed < std::chrono::milliseconds(20));
+    return std::chrono::duration<double, std::nano>(elapsed).count() / (rounds * queries.size());
+}
+
+struct ConfigResult {
+    ProtocolParams params;
+    std::string engine;
+    bool ok = false;
+    size_t reps = 0;
+    std::array<std::array<Summary, PHASE_COUNT>, PARTY_COUNT> phases;
+    std::array<std::array<Summary, LINK_COUNT>, PARTY_COUNT> bytes_sent, bytes_received, rounds;
+    Summary cleartext_ns, overhead;
+};
+
+ConfigResult run_config(const Options& options, const std::vector<std::string>& gen_args, const std::string& engine) {
+    ConfigResult config;
+    config.engine = engine;
+    if (!generate(options, gen_args)) {
+        std::fprintf(stderr, "  gen_queries failed; see %s/bench_gen.log\n", DATA_DIR.c_str());
+        return config;
+    }
+    read_params_file(DATA_DIR + "/params.txt", config.params);
+    const ProtocolParams& p = config.params;
+    if (p.q == 0) {
+        std::fprintf(stderr, "  q=0 leaves no queries to time; set q to at least 1\n");
+        return config;
+    }
+
+    ShareMat U = recombine_shares(load_matrix_shares(DATA_DIR + "/U0.txt", p.m, p.k),
+                                  load_matrix_shares(DATA_DIR + "/U1.txt", p.m, p.k));
+    ShareMat V = recombine_shares(load_matrix_shares(DATA_DIR + "/V0.txt", p.n, p.k),
+                                  load_matrix_shares(DATA_DIR + "/V1.txt", p.n, p.k));
+    auto queries = load_cleartext_queries(DATA_DIR + "/queries_cleartext.txt", p.q);
+
+    std::vector<RunResult> runs;
+    std::vector<double> cleartext;
+    for (uint32_t rep = 0; rep < options.warmup + options.reps; rep++) {
+        bool warmup = rep < options.warmup;
+        std::printf("  %s %u/%u ... ", warmup ? "warm-up" : "repetition", warmup ? rep + 1 : rep - options.warmup + 1,
+                    warmup ? options.warmup : options.reps);
+        std::fflush(stdout);
+        if (!run_protocol(options)) {
+            std::printf("failed; see %s/bench_p*.log\n", DATA_DIR.c_str());
+            return config;
+        }
+        double cleartext_ns = time_cleartext(U, V, queries);
+        if (warmup) {
+            std::printf("done\n");
+            continue;
+        }
+        runs.push_back(read_results());
+        if (std::isnan(runs.back().phase_ns[0][(size_t)Phase::Query])) {
+            std::printf("no results from P0; see %s/bench_p0.log\n", DATA_DIR.c_str());
+            return config;
+        }
+        cleartext.push_back(cleartext_ns);
+        std::printf("%.3f ms per query\n", runs.back().phase_ns[0][(size_t)Phase::Query] / 1e6);
+    }
+
+    auto collect = [&](auto&& value) {
+        std::vector<double> values;
+        for (const RunResult& run : runs) values.push_back(value(run));
+        return summarize(values);
+    };
+    for (size_t party = 0; party < PARTY_COUNT; party++) {
+        for (size_t phase = 0; phase < PHASE_COUNT; phase++) {
+            config.phases[party][phase] = collect([&](const RunResult& r) { return r.phase_ns[party][phase]; });
+        }
+        for (size_t link = 0; link < LINK_COUNT; link++) {
+            config.bytes_sent[party][link] = collect([&](const RunResult& r) { return r.bytes_sent[party][link]; });
+            config.bytes_received[party][link] = collect([&](const RunResult& r) { return r.bytes_received[party][link]; });
+            config.rounds[party][link] = collect([&](const RunResult& r) { return r.rounds[party][link]; });
+        }
+    }
+    config.cleartext_ns = summarize(cleartext);
+    // The factor of each repetition, against that repetition's cleartext time.
+    std::vector<double> factors;
+    for (size_t rep = 0; rep < runs.size(); rep++) {
+        factors.push_back(runs[rep].phase_ns[0][(size_t)Phase::Query] / cleartext[rep]);
+    }
+    config.overhead = summarize(factors);
+    config.reps = runs.size();
+    config.ok = true;
+    return config;
+}
+
+void write_csv_row(FILE* out, const ConfigResult& config, const char* party, const char* kind, const char* name,
+                   const Summary& s) {
+    if (s.count == 0) return;
+    for (const auto& f : param_fields()) std::fprintf(out, "%u,", config.params.*f.field);
+    std::fprintf(out, "%s,%s,%s,%s,%.10g,%.10g,%.10g,%zu\n", config.engine.c_str(), party, kind, name, s.mean,
+                 std::isnan(s.stddev) ? 0.0 : s.stddev, std::isnan(s.ci95) ? 0.0 : s.ci95, s.count);
+}
+
+bool write_csv(const std::string& path, const std::vector<ConfigResult>& configs) {
+    FILE* out = std::fopen(path.c_str(), "w");
+    if (!out) return false;
+    for (const auto& f : param_fields()) std::fprintf(out, "%s,", f.name);
+    std::fprintf(out, "engine,party,kind,name,mean,stddev,ci95,reps\n");
+    for (const ConfigResult& config : configs) {
+        if (!config.ok) continue;
+        for (size_t party = 0; party < PARTY_COUNT; party++) {
+            for (size_t phase = 0; phase < PHASE_COUNT; phase++) {
+                write_csv_row(out, config, PARTY_NAMES[party], "phase_ns", PHASE_NAMES[phase], config.phases[party][phase]);
+            }
+            for (size_t link = 0; link < LINK_COUNT; link++) {
+                write_csv_row(out, config, PARTY_NAMES[party], "bytes_sent_per_query", LINK_NAMES[link],
+                              config.bytes_sent[party][link]);
+                write_csv_row(out, config, PARTY_NAMES[party], "bytes_received_per_query", LINK_NAMES[link],
+                              config.bytes_received[party][link]);
+                write_csv_row(out, config, PARTY_NAMES[party], "rounds_per_query", LINK_NAMES[link],
+                              config.rounds[party][link]);
+            }
+        }
+        write_csv_row(out, config, "", "cleartext_ns", "query", config.cleartext_ns);
+        write_csv_row(out, config, "P0", "overhead", "query", config.overhead);
+    }
+    return std::fclose(out) == 0;
+}
+
+void write_json_summary(FILE* out, const Summary& s) {
+    auto number = [](double v) { return std::isnan(v) ? 0.0 : v; };
+    std::fprintf(out, "{\"mean\": %.10g, \"stddev\": %.10g, \"ci95\": %.10g, \"reps\": %zu, \"samples\": [", number(s.mean),
+                 number(s.stddev), number(s.ci95), s.count);
+    for (size_t idx = 0; idx < s.samples.size(); idx++) std::fprintf(out, "%s%.10g", idx ? ", " : "", s.samples[idx]);
+    std::fprintf(out, "]}");
+}
+
+bool write_json(const std::string& path, const std::vector<ConfigResult>& configs) {
+    FILE* out = std::fopen(path.c_str(), "w");
+    if (!out) return false;
+    std::fprintf(out, "{\n  \"unit\": \"ns\",\n  \"configs\": [");
+    const char* config_separator = "\n";
+    for (const ConfigResult& config : configs) {
+        std::fprintf(out, "%s    {\"params\": {", config_separator);
+        for (const auto& f : param_fields()) std::fprintf(out, "\"%s\": %u, ", f.name, config.params.*f.field);
+        std::fprintf(out, "\"engine\": \"%s\"},\n     \"ok\": %s", config.engine.c_str(), config.ok ? "true" : "false");
+        config_separator = ",\n";
+        if (!config.ok) {
+            std::fprintf(out, "}");
+            continue;
+        }
+        std::fprintf(out, ",\n     \"cleartext_ns_per_query\": ");
+        write_json_summary(out, config.cleartext_ns);
+        std::fprintf(out, ",\n     \"overhead\": ");
+        write_json_summary(out, config.overhead);
+        std::fprintf(out, ",\n     \"parties\": {");
+        for (size_t party = 0; party < PARTY_COUNT; party++) {
+            std::fprintf(out, "%s\n      \"%s\": {\"phases\": {", party ? "," : "", PARTY_NAMES[party]);
+            const char* separator = "";
+            for (size_t phase = 0; phase < PHASE_COUNT; phase++) {
+                if (config.phases[party][phase].count == 0) continue;
+                std::fprintf(out, "%s\n        \"%s\": ", separator, PHASE_NAMES[phase]);
+                write_json_summary(out, config.phases[party][phase]);
+                separator = ",";
+            }
+            std::fprintf(out, "},\n       \"links\": {");
+            separator = "";
+            for (size_t link = 0; link < LINK_COUNT; link++) {
+                if (config.rounds[party][link].count == 0) continue;
+                std::fprintf(out, "%s\n        \"%s\": {\"bytes_sent_per_query\": ", separator, LINK_NAMES[link]);
+                write_json_summary(out, config.bytes_sent[party][link]);
+                std::fprintf(out, ", \"bytes_received_per_query\": ");
+                write_json_summary(out, config.bytes_received[party][link]);
+                std::fprintf(out, ", \"rounds_per_query\": ");
+                write_json_summary(out, config.rounds[party][link]);
+                std::fprintf(out, "}");
+                separator = ",";
+            }
+            std::fprintf(out, "}}");
+        }
+        std::fprintf(out, "}}");
+    }
+    std::fprintf(out, "\n  ]\n}\n");
+    return std::fclose(out) == 0;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (arg.rfind("--", 0) != 0 || eq == std::string::npos) {
+            std::fprintf(stderr,
+                         "Usage: %s [--m=<list>] [--n=<list>] [--k=<list>] [--q=<list>] [--pack_bits=<list>] "
+                         "[--ring_bits=<list>] [--engine=<list>] [--reps=<count>] [--warmup=<count>] [--bin=<dir>] "
+                         "[--out=<prefix>] [--timeout=<seconds>] [--baseline=<file>] [--current=<file>] "
+                         "[--threshold=<percent>] [--alpha=<level>] [--test=<mannwhitney|bootstrap>]\n",
+                         argv[0]);
+            return 1;
+        }
+        std::string name = arg.substr(2, eq - 2), value = arg.substr(eq + 1);
+        bool known = true;
+        try {
+            if (name == "engine") options.engines = split_list(value);
+            else if (name == "reps") options.reps = parse_param_value(name, value);
+            else if (name == "warmup") options.warmup = parse_param_value(name, value);
+            else if (name == "timeout") options.timeout = parse_param_value(name, value);
+            else if (name == "bin") options.bin = value;
+            else if (name == "out") options.out = value;
+            else if (name == "baseline") options.baseline = value;
+            else if (name == "current") options.current = value;
+            else if (name == "threshold") options.compare.threshold = std::stod(value) / 100;
+            else if (name == "alpha") options.compare.alpha = std::stod(value);
+            else if (name == "test" && (value == "mannwhitney" || value == "bootstrap")) {
+                options.compare.test = value == "bootstrap" ? CompareTest::Bootstrap : CompareTest::MannWhitney;
+            }
+            else {
+                known = false;
+                for (size_t f = 0; f < param_fields().size(); f++) {
+                    if (name != param_fields()[f].name) continue;
+                    options.grid[f] = split_list(value);
+                    for (const std::string& item : options.grid[f]) {
+                        // Results are averaged per query, so a run needs at least one.
+                        if (parse_param_value(name, item) == 0 && name == "q") {
+                            throw std::invalid_argument("--q values must be at least 1");
+                        }
+                    }
+                    known = true;
+                }
+            }
+        } catch (const std::exception& e) {
+            std::fprintf(stderr, "%s\n", e.what());
+            return 1;
+        }
+        if (!known) {
+            std::fprintf(stderr, "Unknown option: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+    if (options.reps == 0) {
+        std::fprintf(stderr, "--reps must be at least 1\n");
+        return 1;
+    }
+    if (!(options.compare.threshold >= 0) || !(options.compare.alpha > 0 && options.compare.alpha < 1)) {
+        std::fprintf(stderr, "--threshold must not be negative and --alpha must be between 0 and 1\n");
+        return 1;
+    }
+    if (!options.current.empty()) {
+        if (options.baseline.empty()) {
+            std::fprintf(stderr, "--current needs a --baseline to compare with\n");
+            return 1;
+        }
+        try {
+            return compare_bench_results(options.baseline, options.current, options.compare) > 0 ? 2 : 0;
+        } catch (const std::exception& e) {
+            std::fprintf(stderr, "%s\n", e.what());
+            return 1;
+        }
+    }
+    if (options.engines.empty()) options.engines.push_back("bgi");
+
+    // Every combination of the lists, the last parameter varying fastest.
+    std::vector<std::vector<std::string>> combinations = {{}};
+    for (size_t f = 0; f < param_fields().size(); f++) {
+        if (options.grid[f].empty()) continue;
+        std::vector<std::vector<std::string>> extended;
+        for (const auto& combination : combinations) {
+            for (const std::string& value : options.grid[f]) {
+                extended.push_back(combination);
+                extended.back().push_back(std::string("--") + param_fields()[f].name + "=" + value);
+            }
+        }
+        combinations = std::move(extended);
+    }
+
+    std::vector<ConfigResult> configs;
+    size_t total = combinations.size() * options.engines.size(), index = 0;
+    for (const std::string& engine : options.engines) {
+        for (const auto& combination : combinations) {
+            std::vector<std::string> gen_args = {engine};
+            gen_args.insert(gen_args.end(), combination.begin(), combination.end());
+            std::string label = engine;
+            for (const std::string& arg : combination) label += " " + arg;
+            std::printf("[%zu/%zu] %s\n", ++index, total, label.c_str());
+            try {
+                configs.push_back(run_config(options, gen_args, engine));
+            } catch (const std::exception& e) {
+                std::fprintf(stderr, "  %s\n", e.what());
+                configs.emplace_back();
+                configs.back().engine = engine;
+            }
+            const ConfigResult& config = configs.back();
+            if (config.ok) {
+                std::printf("  P0 query: %.3f ms +- %.3f, cleartext %.1f ns, overhead %.0fx\n",
+                            config.phases[0][(size_t)Phase::Query].mean / 1e6,
+                            std::isnan(config.phases[0][(size_t)Phase::Query].ci95)
+                                ? 0.0
+                                : config.phases[0][(size_t)Phase::Query].ci95 / 1e6,
+                            config.cleartext_ns.mean, config.overhead.mean);
+            }
+        }
+    }
+
+    bool written = write_csv(options.out + ".csv", configs) && write_json(options.out + ".json", configs);
+    if (!written) {
+        std::fprintf(stderr, "Could not write %s.csv or %s.json\n", options.out.c_str(), options.out.c_str());
+        return 1;
+    }
+    std::printf("Wrote %s.csv and %s.json\n", options.out.c_str(), options.out.c_str());
+    for (const ConfigResult& config : configs) {
+        if (!config.ok) return 1;
+    }
+    if (options.baseline.empty()) return 0;
+    try {
+        return compare_bench_results(options.baseline, options.out + ".json", options.compare) > 0 ? 2 : 0;
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+}
@@ -0,0 +1,170 @@
+// Coroutine frame benchmark for the share transfers (runs locally).
+//
+// Replays the peer traffic of one query's multiplications over a loopback socket pair: k + 1
+// Beaver exchanges of two length-n vectors each way (the k lookups and <u, v>), then two
+// scalar-vector exchanges of a value and a length-k vector. The same traffic runs twice:
+// once through send_vectors()/recv_vectors() from common.hpp, and once through a layered
+// reimplementation that builds each vector transfer from a nested send_value()/recv_value()
+// plus a payload coroutine, as the transfers used to be. For both it reports heap
+// allocations per query (each awaitable frame that Asio cannot recycle is one) and time per
+// query; the allocations are counted by the hooks in alloc_stats.hpp.
+//
+// Usage: bench_frames [--n=<items>] [--k=<features>] [--queries=<count>]
+
+#include "common.hpp"
+
+#include <cstdio>
+
+namespace layered {
+
+awaitable<void> send_word(tcp::socket& sock, int64_t value) {
+    co_await boost::asio::async_write(sock, boost::asio::buffer(&value, sizeof(value)), use_awaitable);
+}
+
+awaitable<int64_t> recv_word(tcp::socket& sock) {
+    int64_t value;
+    co_await boost::asio::async_read(sock, boost::asio::buffer(&value, sizeof(value)), use_awaitable);
+    co_return value;
+}
+
+awaitable<void> send_payload(tcp::socket& sock, const int64_t* words, size_t n) {
+    co_await boost::asio::async_write(sock, boost::asio::buffer(words, n * sizeof(int64_t)), use_awaitable);
+}
+
+awaitable<void> recv_payload(tcp::socket& sock, int64_t* words, size_t n) {
+    co_await boost::asio::async_read(sock, boost::asio::buffer(words, n * sizeof(int64_t)), use_awaitable);
+}
+
+awaitable<void> send_value(tcp::socket& sock, int64_t value) {
+    co_await send_word(sock, value);
+}
+
+awaitable<int64_t> recv_value(tcp::socket& sock) {
+    co_return co_await recv_word(sock);
+}
+
+awaitable<void> send_vector(tcp::socket& sock, const ShareVec& vec) {
+    co_await send_value(sock, (int64_t)vec.size());
+    co_await send_payload(sock, vec.data(), vec.size());
+}
+
+awaitable<void> recv_vector(tcp::socket& sock, ShareVec& vec) {
+    vec.resize(co_await recv_value(sock));
+    co_await recv_payload(sock, vec.data(), vec.size());
+}
+
+}  // namespace layered
+
+struct Shape {
+    uint32_t n = 50;
+    uint32_t k = 3;
+    uint32_t queries = 1000;
+};
+
+// One side of the traffic. The side that goes first sends before it receives, as P0 does
+// in the multiplications.
+template <bool Layered>
+awaitable<void> run_party(tcp::socket& sock, Shape shape, bool goes_first) {
+    ShareVec x(shape.n, 1), y(shape.n, 2), peer_x, peer_y;
+    ShareVec v(shape.k, 3), peer_v;
+    for (uint32_t q = 0; q < shape.queries; ++q) {
+        for (uint32_t round = 0; round <= shape.k; ++round) {
+            for (int step = 0; step < 2; ++step) {
+                if ((step == 0) == goes_first) {
+                    if constexpr (Layered) {
+                        co_await layered::send_vector(sock, x);
+                        co_await layered::send_vector(sock, y);
+                    } else {
+                        co_await send_vectors<2>(sock, {x, y});
+                    }
+                } else {
+                    if constexpr (Layered) {
+                        co_await layered::recv_vector(sock, peer_x);
+                        co_await layered::recv_vector(sock, peer_y);
+                    } else {
+                        co_await recv_vectors(sock, std::array{&peer_x, &peer_y});
+                    }
+                }
+            }
+        }
+        for (int product = 0; product < 2; ++product) {
+            for (int step = 0; step < 2; ++step) {
+                if ((step == 0) == goes_first) {
+                    if constexpr (Layered) {
+                        co_await layered::send_value(sock, 7);
+                        co_await layered::send_vector(sock, v);
+                    } else {
+                        co_await send_value(sock, 7);
+                        co_await send_vector(sock, v);
+                    }
+                } else {
+                    if constexpr (Layered) {
+                        co_await layered::recv_value(sock);
+                        co_await layered::recv_vector(sock, peer_v);
+                    } else {
+                        co_await recv_value(sock);
+                        co_await recv_vector(sock, peer_v);
+                    }
+                }
+            }
+        }
+    }
+}
+
+template <bool Layered>
+void measure(const char* label, tcp::socket& a, tcp::socket& b, boost::asio::io_context& io_ctx, Shape shape) {
+    // One warm-up query so that buffers and Asio's per-thread caches are populated.
+    Shape warm = shape;
+    warm.queries = 1;
+    co_spawn(io_ctx, run_party<Layered>(a, warm, true), detached);
+    co_spawn(io_ctx, run_party<Layered>(b, warm, false), detached);
+    io_ctx.run();
+    io_ctx.restart();
+
+    AllocCounts before = alloc_stats().counts();
+    auto start = std::chrono::steady_clock::now();
+    co_spawn(io_ctx, run_party<Layered>(a, shape, true), detached);
+    co_spawn(io_ctx, run_party<Layered>(b, shape, false), detached);
+    io_ctx.run();
+    io_ctx.restart();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    uint64_t allocations = (alloc_stats().counts() - before).allocations;
+
+    std::printf("%-8s %10.1f allocations/query %10.2f us/query\n", label,
+                (double)allocations / shape.queries, seconds * 1e6 / shape.queries);
+}
+
+int main(int argc, char* argv[]) {
+    Shape shape;
+    alloc_stats().enable();
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (arg.rfind("--", 0) != 0 || eq == std::string::npos) {
+            std::fprintf(stderr, "Usage: %s [--n=<items>] [--k=<features>] [--queries=<count>]\n", argv[0]);
+            return 1;
+        }
+        std::string name = arg.substr(2, eq - 2);
+        uint32_t value = std::stoul(arg.substr(eq + 1));
+        if (name == "n") shape.n = value;
+        else if (name == "k") shape.k = value;
+        else if (name == "queries") shape.queries = value;
+        else {
+            std::fprintf(stderr, "Unknown option: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    boost::asio::io_context io_ctx(1);
+    tcp::acceptor acceptor(io_ctx, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    tcp::socket a(io_ctx), b(io_ctx);
+    a.connect(acceptor.local_endpoint());
+    acceptor.accept(b);
+    a.set_option(tcp::no_delay(true));
+    b.set_option(tcp::no_delay(true));
+
+    std::printf("n=%u k=%u queries=%u\n", shape.n, shape.k, shape.queries);
+    measure<true>("layered", a, b, io_ctx, shape);
+    measure<false>("flat", a, b, io_ctx, shape);
+    return 0;
+}
@@ -0,0 +1,401 @@
+// Microbenchmarks for the kernels under the protocol (runs locally).
+//
+// Times the fixed-key AES PRG, DPF key generation, point evaluation and full-domain
+// evaluation for both engines, the bitmap evaluation and one-hot row selection (after
+// checking them), the vec_* share kernels, key serialization, and the loaders
+// for matrix shares and queries, each over a range of sizes. It also times the SHA-256 DPF of
+// Assignment 2 (A2/dpf.hpp) with the same harness, as the reference those kernels
+// replaced. Every benchmark is calibrated to run for --min_time per sample, and takes
+// --samples samples. It reports the median and the fastest sample per operation, and the
+// items per second at the median (leaves for the full-domain evaluations, elements for the
+// vector kernels). --json writes every sample as well, for comparisons between builds.
+//
+// Usage: bench_kernels [--sizes=<log2 list>] [--filter=<substring>] [--samples=<count>]
+//                      [--min_time=<ms>] [--json=<file>]
+//
+// Build with
+//   g++ -std=c++20 -O2 -pthread bench_kernels.cpp -o bench_kernels -lboost_system -lcrypto
+
+#include "common.hpp"
+#include "params.hpp"
+
+#include "../A2/dpf.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <sstream>
+#include <thread>
+
+namespace {
+
+struct Options {
+    std::vector<uint32_t> log_sizes = {10, 14, 18};
+    std::string filter;
+    uint32_t samples = 10;
+    uint32_t min_time_ms = 20;
+    std::string json;
+};
+
+// Keeps the compiler from dropping a result nobody reads.
+template <class T>
+inline void keep(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct BenchResult {
+    std::string name;
+    uint64_t size;
+    double items;                   // Items one operation processes.
+    std::vector<double> samples_ns; // Nanoseconds per operation, one per sample.
+
+    double median() const {
+        std::vector<double> sorted = samples_ns;
+        std::sort(sorted.begin(), sorted.end());
+        size_t mid = sorted.size() / 2;
+        return sorted.size() % 2 ? sorted[mid] : (sorted[mid - 1] + sorted[mid]) / 2;
+    }
+    double fastest() const { return *std::min_element(samples_ns.begin(), samples_ns.end()); }
+};
+
+class Harness {
+public:
+    explicit Harness(Options opts) : options(std::move(opts)) {}
+
+    // Runs `op` often enough that a sample lasts --min_time, then takes --samples samples.
+    template <class Op>
+    void run(const std::string& name, uint64_t size, double items, Op&& op) {
+        if (!options.filter.empty() && name.find(options.filter) == std::string::npos) return;
+        using Clock = std::chrono::steady_clock;
+        auto time_ops = [&](uint64_t ops) {
+            auto start = Clock::now();
+            for (uint64_t i = 0; i < ops; i++) op();
+            return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        };
+        double target = options.min_time_ms * 1e6;
+        uint64_t ops = 1;
+        for (double elapsed = time_ops(ops); elapsed < target && ops < (uint64_t(1) << 40); elapsed = time_ops(ops)) {
+            double scale = elapsed > 0 ? target / elapsed : 2.0;
+            ops = std::max<uint64_t>(ops * 2, (uint64_t)(ops * std::min(scale * 1.2, 100.0)));
+        }
+        BenchResult result{name, size, items, {}};
+        for (uint32_t s = 0; s < options.samples; s++) result.samples_ns.push_back(time_ops(ops) / ops);
+        std::printf("%-28s %10llu %14.1f ns %14.1f ns %14.4g items/s\n", name.c_str(), (unsigned long long)size,
+                    result.median(), result.fastest(), items / result.median() * 1e9);
+        std::fflush(stdout);
+        results.push_back(std::move(result));
+    }
+
+    const Options& opts() const { return options; }
+
+    bool write_json(const std::string& path) const {
+        FILE* out = std::fopen(path.c_str(), "w");
+        if (!out) return false;
+        std::fprintf(out, "{\n  \"unit\": \"ns_per_op\",\n  \"prg\": \"%s\",\n  \"benchmarks\": [", prg_impl_name());
+        for (size_t idx = 0; idx < results.size(); idx++) {
+            const BenchResult& r = results[idx];
+            std::fprintf(out, "%s\n    {\"name\": \"%s\", \"size\": %llu, \"items\": %.0f, \"median\": %.3f, "
+                              "\"fastest\": %.3f, \"samples\": [",
+                         idx ? "," : "", r.name.c_str(), (unsigned long long)r.size, r.items, r.median(), r.fastest());
+            for (size_t s = 0; s < r.samples_ns.size(); s++) std::fprintf(out, "%s%.3f", s ? ", " : "", r.samples_ns[s]);
+            std::fprintf(out, "]}");
+        }
+        std::fprintf(out, "\n  ]\n}\n");
+        return std::fclose(out) == 0;
+    }
+
+private:
+    Options options;
+    std::vector<BenchResult> results;
+};
+
+const char* engine_name(DPFEngine engine) { return engine == DPFEngine::HalfTree ? "halftree" : "bgi"; }
+
+void bench_prg(Harness& h) {
+    u64 seed = random_uint64();
+    h.run("prg/single", 1, 1, [&] {
+        ChildSeed children = PRG(seed);
+        seed = children.s_left ^ children.s_right;
+        keep(seed);
+    });
+    for (size_t count : {64, 1024}) {
+        std::vector<u64> seeds(count), left(count), right(count);
+        std::vector<uint8_t> f_left(count), f_right(count);
+        for (u64& s : seeds) s = random_uint64();
+        h.run("prg/batch", count, (double)count, [&] {
+            prg_expand_batch(seeds.data(), count, left.data(), right.data(), f_left.data(), f_right.data());
+            keep(left.data());
+        });
+    }
+}
+
+void bench_dpf(Harness& h, DPFEngine engine) {
+    std::string prefix = std::string("dpf/") + engine_name(engine);
+    for (uint32_t log_size : h.opts().log_sizes) {
+        u64 domain = u64(1) << log_size;
+        u64 index = random_uint64() % domain;
+        h.run(prefix + "/gen", domain, 1, [&] {
+            auto keys = generateDPF(index, 1, domain, engine);
+            keep(keys.first.FCW);
+        });
+        auto [k0, k1] = generateDPF(index, 1, domain, engine);
+        u64 point = 0;
+        h.run(prefix + "/eval", domain, 1, [&] {
+            keep(evalDPF(k0, point, domain));
+            point = (point + 0x9e3779b97f4a7c15ULL) & (domain - 1);
+        });
+        h.run(prefix + "/evalfull", domain, (double)domain, [&] {
+            std::vector<int64_t> leaves = EvalFull(k0, domain);
+            keep(leaves.data());
+        });
+    }
+}
+
+// EvalFullBits() and SelectRowShare() are checked before they are timed: the two bitmaps
+// must XOR to e_index, and every selection kernel the CPU has must give the parties shares
+// that add up to row index. Column counts 3 and 11 cover the vector tails.
+void check_select(DPFEngine engine, u64 domain, DPFThreadPool& pool) {
+    std::string what = std::string(engine_name(engine)) + ", domain " + std::to_string(domain);
+    u64 index = random_uint64() % domain;
+    auto [k0, k1] = generateDPF(index, 1, domain, engine);
+    std::vector<u64> bits0 = EvalFullBits(k0, domain), bits1 = EvalFullBits(k1, domain);
+    if (EvalFullBits(k0, domain, pool) != bits0) throw std::runtime_error("EvalFullBits on the pool differs, " + what);
+    for (u64 w = 0; w < bits0.size(); w++) {
+        u64 expected = index >> 6 == w ? u64(1) << (index & 63) : 0;
+        if ((bits0[w] ^ bits1[w]) != expected) throw std::runtime_error("EvalFullBits is not a share of e_j, " + what);
+    }
+
+    using Kernel = void (*)(const u64*, const int64_t*, u64, uint32_t, int64_t*);
+    std::vector<std::pair<const char*, Kernel>> kernels = {{"portable", dpf_detail::select_rows_portable}};
+#ifdef DPF_HAVE_X86_SIMD
+    if (__builtin_cpu_supports("avx2")) kernels.push_back({"avx2", dpf_detail::select_rows_avx2});
+    if (__builtin_cpu_supports("avx512f")) kernels.push_back({"avx512", dpf_detail::select_rows_avx512});
+#endif
+    for (uint32_t cols : {3u, 8u, 11u}) {
+        std::vector<int64_t> matrix(domain * cols);
+        for (int64_t& value : matrix) value = (int64_t)random_uint64();
+        std::vector<int64_t> reference(cols), out(cols), share0(cols), share1(cols);
+        dpf_detail::select_rows_portable(bits0.data(), matrix.data(), domain, cols, reference.data());
+        for (auto [name, kernel] : kernels) {
+            kernel(bits0.data(), matrix.data(), domain, cols, out.data());
+            if (out != reference) {
+                throw std::runtime_error(std::string("select_rows_") + name + " differs from the portable kernel, " + what);
+            }
+        }
+        SelectRowShare(bits0, k0.sign, matrix.data(), domain, cols, share0.data());
+        SelectRowShare(bits1, k1.sign, matrix.data(), domain, cols, share1.data());
+        for (uint32_t c = 0; c < cols; c++) {
+            if ((u64)share0[c] + (u64)share1[c] != (u64)matrix[index * cols + c]) {
+                throw std::runtime_error("SelectRowShare does not reconstruct row j, " + what);
+            }
+        }
+    }
+}
+
+void bench_select(Harness& h, DPFEngine engine) {
+    std::string prefix = std::string("dpf/") + engine_name(engine);
+    DPFThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    for (u64 domain : {u64(1), u64(50), u64(1000)}) check_select(engine, domain, pool);
+    const uint32_t cols = 8;
+    for (uint32_t log_size : h.opts().log_sizes) {
+        u64 domain = u64(1) << log_size;
+        check_select(engine, domain, pool);
+        auto [k0, k1] = generateDPF(random_uint64() % domain, 1, domain, engine);
+        h.run(prefix + "/evalfull_bits", domain, (double)domain, [&] {
+            std::vector<u64> bits = EvalFullBits(k0, domain);
+            keep(bits.data());
+        });
+        std::vector<u64> bits = EvalFullBits(k0, domain);
+        std::vector<int64_t> matrix(domain * cols), out(cols);
+        for (int64_t& value : matrix) value = (int64_t)random_uint64();
+        h.run(prefix + "/select_row", domain, (double)domain, [&] {
+            SelectRowShare(bits, k0.sign, matrix.data(), domain, cols, out.data());
+            keep(out.data());
+        });
+    }
+}
+
+void bench_vec(Harness& h) {
+    for (size_t length : {size_t(64), size_t(4096), size_t(1) << 18}) {
+        ShareVec a(length), b(length), out(length);
+        for (size_t i = 0; i < length; i++) {
+            a[i] = (int64_t)random_uint64();
+            b[i] = (int64_t)random_uint64();
+        }
+        int64_t scalar = (int64_t)random_uint64();
+        h.run("vec/add", length, (double)length, [&] {
+            vec_add(a, b, out);
+            keep(out.data());
+        });
+        h.run("vec/sub", length, (double)length, [&] {
+            vec_sub(a, b, out);
+            keep(out.data());
+        });
+        h.run("vec/scalar_mul", length, (double)length, [&] {
+            vec_scalar_mul(a, scalar, out);
+            keep(out.data());
+        });
+        h.run("vec/scalar_mul_add", length, (double)length, [&] {
+            vec_scalar_mul_add(out, a, scalar);
+            keep(out.data());
+        });
+        h.run("vec/dot_product", length, (double)length, [&] { keep(vec_dot_product(a, b)); });
+    }
+}
+
+void bench_serialization(Harness& h) {
+    for (uint32_t log_size : h.opts().log_sizes) {
+        u64 domain = u64(1) << log_size;
+        auto [k0, k1] = generateDPF(random_uint64() % domain, 1, domain);
+        std::ostringstream written;
+        write_key(written, k0);
+        std::string bytes = written.str();
+        h.run("key/write", domain, 1, [&] {
+            std::ostringstream out;
+            write_key(out, k0);
+            keep(out.tellp());
+        });
+        h.run("key/read", domain, 1, [&] {
+            std::istringstream in(bytes);
+            DPFKey key = read_key(in);
+            keep(key.FCW);
+        });
+    }
+}
+
+// The loaders read files, so the files are written to the temporary directory first; the
+// times are for files in the page cache.
+void bench_loaders(Harness& h) {
+    std::filesystem::path dir = std::filesystem::temp_directory_path();
+    const uint32_t k = 8;
+    for (uint32_t rows : {1000u, 100000u}) {
+        std::string path = (dir / "bench_kernels_matrix.txt").string();
+        {
+            std::ofstream out(path);
+            for (uint32_t i = 0; i < rows; i++) {
+                for (uint32_t f = 0; f < k; f++) out << (uint32_t)random_uint64() << (f + 1 < k ? " " : "\n");
+            }
+        }
+        h.run("io/load_matrix_shares", rows, (double)rows * k, [&] {
+            ShareMat m = load_matrix_shares(path, rows, k);
+            keep(m.data());
+        });
+        std::filesystem::remove(path);
+    }
+    const u64 domain = u64(1) << 14;
+    for (uint32_t count : {100u, 1000u}) {
+        std::string path = (dir / "bench_kernels_queries.bin").string();
+        {
+            std::ofstream out(path, std::ios::binary);
+            write_query_file_header(out, 0);
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t user = i;
+                int64_t share = (int64_t)random_uint64();
+                out.write(reinterpret_cast<const char*>(&user), sizeof(user));
+                out.write(reinterpret_cast<const char*>(&share), sizeof(share));
+                write_key(out, generateDPF(random_uint64() % domain, 0, domain).first);
+            }
+        }
+        h.run("io/read_queries", count, (double)count, [&] {
+            std::vector<Query> queries = read_queries(path);
+            keep(queries.data());
+        });
+        std::filesystem::remove(path);
+    }
+}
+
+// Assignment 2's DPF: 128-bit seeds expanded with SHA-256, XOR-shared outputs, recursive
+// full-domain evaluation.
+void bench_a2(Harness& h) {
+    a2::Seed seed = ((a2::Seed)random_uint64() << 64) | random_uint64();
+    h.run("a2/prg", 1, 1, [&] {
+        a2::PRGOutput out = a2::prg_expand(seed);
+        seed = out.s_left ^ out.s_right;
+        keep(out.t_left);
+    });
+    for (uint32_t log_size : h.opts().log_sizes) {
+        u64 domain = u64(1) << log_size;
+        u64 location = random_uint64() % domain;
+        h.run("a2/gen", domain, 1, [&] {
+            auto keys = a2::generateDPF(location, 1, (int)log_size);
+            keep(keys.first.final_correction_word);
+        });
+        auto keys = a2::generateDPF(location, 1, (int)log_size);
+        h.run("a2/evalfull", domain, (double)domain, [&] {
+            std::vector<u64> leaves = a2::EvalFull(keys.first, domain);
+            keep(leaves.data());
+        });
+    }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (arg.rfind("--", 0) != 0 || eq == std::string::npos) {
+            std::fprintf(stderr,
+                         "Usage: %s [--sizes=<log2 list>] [--filter=<substring>] [--samples=<count>] "
+                         "[--min_time=<ms>] [--json=<file>]\n",
+                         argv[0]);
+            return 1;
+        }
+        std::string name = arg.substr(2, eq - 2), value = arg.substr(eq + 1);
+        try {
+            if (name == "sizes") {
+                options.log_sizes.clear();
+                std::stringstream list(value);
+                std::string item;
+                while (std::getline(list, item, ',')) {
+                    uint32_t log_size = parse_param_value(name, item);
+                    if (log_size < 1 || log_size > 30) throw std::invalid_argument("Sizes are log2 values from 1 to 30");
+                    options.log_sizes.push_back(log_size);
+                }
+            } else if (name == "filter") {
+                options.filter = value;
+            } else if (name == "samples") {
+                options.samples = std::max(1u, parse_param_value(name, value));
+            } else if (name == "min_time") {
+                options.min_time_ms = parse_param_value(name, value);
+            } else if (name == "json") {
+                options.json = value;
+            } else {
+                std::fprintf(stderr, "Unknown option: %s\n", arg.c_str());
+                return 1;
+            }
+        } catch (const std::exception& e) {
+            std::fprintf(stderr, "%s\n", e.what());
+            return 1;
+        }
+    }
+
+    std::printf("PRG: %s, %u samples of at least %u ms\n", prg_impl_name(), options.samples, options.min_time_ms);
+    std::printf("%-28s %10s %17s %17s %20s\n", "benchmark", "size", "median", "fastest", "throughput");
+    Harness harness(options);
+    bench_prg(harness);
+    bench_dpf(harness, DPFEngine::BGI);
+    bench_dpf(harness, DPFEngine::HalfTree);
+    try {
+        bench_select(harness, DPFEngine::BGI);
+        bench_select(harness, DPFEngine::HalfTree);
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    bench_vec(harness);
+    bench_serialization(harness);
+    bench_loaders(harness);
+    bench_a2(harness);
+
+    if (!options.json.empty()) {
+        if (!harness.write_json(options.json)) {
+            std::fprintf(stderr, "Could not write %s\n", options.json.c_str());
+            return 1;
+        }
+        std::printf("Wrote %s\n", options.json.c_str());
+    }
+    return 0;
+}
@@ -1,5 +1,5 @@
-#include "utils.hpp"
-#include "constants.hpp"
+#include "cleartext.hpp"
+#include "params.hpp"
 #include <iostream>
 #include <vector>
 #include <fstream>
@@ -10,163 +10,36 @@
 #include <cstdint>
 #include <cstdlib>
 
-// Helper to load cleartext queries (i, j) from file
-std::vector<std::pair<uint32_t, uint32_t>> load_cleartext_queries(const std::string& filename, uint32_t expected_q) {
-    std::ifstream in(filename);
-    if (!in) {
-        // Try to extract from binary queries if cleartext doesn't exist
-        throw std::runtime_error("Cannot open " + filename + ". Note: queries_cleartext.txt may need to be generated.");
-    }
-    std::vector<std::pair<uint32_t, uint32_t>> queries;
-    uint32_t i_idx, j_idx;
-    uint32_t count = 0;
-    while (count < expected_q && (in >> i_idx >> j_idx)) {
-        queries.emplace_back(i_idx, j_idx);
-        count++;
-    }
-    if (queries.size() != expected_q) {
-        throw std::runtime_error("Query count mismatch in " + filename + ": expected " + 
-                                 std::to_string(expected_q) + ", got " + std::to_string(queries.size()));
-    }
-    return queries;
-}
-
-// Helper to extract cleartext queries from binary query files
-std::vector<std::pair<uint32_t, uint32_t>> extract_queries_from_binary(const std::string& p0_file, 
-                                                                        const std::string& p1_file, 
-                                                                        uint32_t expected_q) {
-    std::ifstream q0_in(p0_file, std::ios::binary);
-    std::ifstream q1_in(p1_file, std::ios::binary);
-    
-    if (!q0_in || !q1_in) {
-        throw std::runtime_error("Cannot open binary query files: " + p0_file + " or " + p1_file);
-    }
-    
-    std::vector<std::pair<uint32_t, uint32_t>> queries;
-    
-    for (uint32_t i = 0; i < expected_q; ++i) {
-        uint32_t user_idx;
-        int64_t j0, j1;
-        DPFKey k0, k1;
-        
-        // Read from P0's file
-        q0_in.read(reinterpret_cast<char*>(&user_idx), sizeof(user_idx));
-        q0_in.read(reinterpret_cast<char*>(&j0), sizeof(j0));
-        k0 = read_key(q0_in);
-        
-        // Read from P1's file
-        q1_in.read(reinterpret_cast<char*>(&user_idx), sizeof(user_idx));
-        q1_in.read(reinterpret_cast<char*>(&j1), sizeof(j1));
-        k1 = read_key(q1_in);
-        
-        // Reconstruct item index: j = j0 + j1
-        int64_t j_recon = j0 + j1;
-        uint32_t item_idx;
-        if (j_recon >= 0) {
-            item_idx = j_recon;
-        } else {
-            // Handle negative values (though this shouldn't happen for valid indices)
-            item_idx = 0;
-        }
-        
-        queries.emplace_back(user_idx, item_idx);
-    }
-    
-    return queries;
-}
-
-// Recombines shares to get cleartext matrix
-ShareMat recombine_shares(const ShareMat& M0, const ShareMat& M1) {
-    if (M0.size() != M1.size() || (M0.size() > 0 && M0[0].size() != M1[0].size())) {
-        throw std::runtime_error("Matrix dimension mismatch in recombine_shares");
-    }
-    
-    int rows = M0.size();
-    int cols = rows > 0 ? M0[0].size() : 0;
-    ShareMat M(rows, ShareVec(cols));
-    
-    for (int i = 0; i < rows; ++i) {
-        for (int j = 0; j < cols; ++j) {
-            M[i][j] = M0[i][j] + M1[i][j];
-        }
-    }
-    return M;
-}
-
-// Cleartext dot product
-int64_t dot_product(const ShareVec& u, const ShareVec& v) {
-    if (u.size() != v.size()) {
-        throw std::runtime_error("Vector size mismatch in dot_product");
-    }
-    int64_t dot = 0;
-    for (size_t i = 0; i < u.size(); ++i) {
-        dot += u[i] * v[i];
-    }
-    return dot;
-}
-
-// Apply cleartext updates according to the protocol
-void apply_cleartext_updates(ShareMat& U, ShareMat& V, 
-                             const std::vector<std::pair<uint32_t, uint32_t>>& queries) {
-    for (const auto& query : queries) {
-        uint32_t i_idx = query.first;  // user index
-        uint32_t j_idx = query.second; // item index
-        
-        if (i_idx >= U.size() || j_idx >= V.size()) {
-            throw std::runtime_error("Query index out of bounds: i=" + std::to_string(i_idx) + 
-                                     ", j=" + std::to_string(j_idx));
-        }
-        
-        ShareVec ui = U[i_idx];
-        ShareVec vj = V[j_idx];
-        
-        // --- A1: User Update (in cleartext) ---
-        // delta = 1 - <u_i, v_j>
-        int64_t dot = dot_product(ui, vj);
-        int64_t delta = 1 - dot;
-        
-        // update_term = v_j * delta
-        ShareVec user_update_term(vj.size());
-        for (size_t f = 0; f < vj.size(); ++f) {
-            user_update_term[f] = vj[f] * delta;
-        }
-        
-        // u_i <- u_i + update_term
-        for (size_t f = 0; f < ui.size(); ++f) {
-            U[i_idx][f] += user_update_term[f];
-        }
-        
-        // --- A3: Item Update (in cleartext) ---
-        // M = u_i * (1 - <u_i, v_j>)
-        // Both updates are computed in parallel based on original vectors
-        ShareVec item_update_term_M(ui.size());
-        for (size_t f = 0; f < ui.size(); ++f) {
-            item_update_term_M[f] = ui[f] * delta;
-        }
-        
-        // v_j <- v_j + M
-        for (size_t f = 0; f < vj.size(); ++f) {
-            V[j_idx][f] += item_update_term_M[f];
-        }
-    }
-}
-
 // Convert int64_t matrix to uint32_t matrix (matching MPC output format)
 std::vector<std::vector<uint32_t>> convert_to_uint32_matrix(const ShareMat& M) {
     std::vector<std::vector<uint32_t>> result(M.size());
     for (size_t i = 0; i < M.size(); ++i) {
         result[i].resize(M[i].size());
         for (size_t j = 0; j < M[i].size(); ++j) {
-            // Cast through int32_t first to preserve sign interpretation, then to uint32_t
-            result[i][j] = static_cast<uint32_t>(static_cast<int32_t>(M[i][j]));
+            result[i][j] = Z2_32(M[i][j]).value;
         }
     }
     return result;
 }
 
 int main(int argc, char* argv[]) {
-    // Use hardcoded constants from constants.hpp
-    uint32_t m = M, n = N, k = K, q = Q;
+    // Try data/ directory first, then current directory
+    std::string dataDir = "";
+    std::ifstream test_init_file("data/U0.txt");
+    if (test_init_file) {
+        dataDir = "data/";
+        test_init_file.close();
+    }
+
+    // Parameters from the command line, MPC_*, the params.txt written by gen_queries, or constants.hpp
+    ProtocolParams params;
+    try {
+        params = load_params(argc, argv, dataDir.empty() ? "." : dataDir);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    uint32_t m = params.m, n = params.n, k = params.k, q = params.q;
     
     std::cout << "========================================" << std::endl;
     std::cout << "MPC Correctness Verification" << std::endl;
@@ -177,14 +50,6 @@ int main(int argc, char* argv[]) {
     try {
         // --- 1. Load Initial Shares and Recombine ---
         std::cout << "Loading initial shares..." << std::endl;
-        // Try data/ directory first, then current directory
-        std::string dataDir = "";
-        std::ifstream test_init_file("data/U0.txt");
-        if (test_init_file) {
-            dataDir = "data/";
-            test_init_file.close();
-        }
-        
         ShareMat U0 = load_matrix_shares(dataDir + "U0.txt", m, k);
         ShareMat U1 = load_matrix_shares(dataDir + "U1.txt", m, k);
         ShareMat V0 = load_matrix_shares(dataDir + "V0.txt", n, k);
@@ -206,7 +71,7 @@ int main(int argc, char* argv[]) {
         } catch (const std::exception& e) {
             // If cleartext doesn't exist, try to extract from binary files
             std::cout << "queries_cleartext.txt not found, extracting from binary query files..." << std::endl;
-            queries = extract_queries_from_binary(dataDir + "queries_p0.bin", dataDir + "queries_p1.bin", q);
+            queries = extract_queries_from_binary(dataDir + "queries_p0.bin", dataDir + "queries_p1.bin", q, params.pack_bits);
             std::cout << "Extracted " << queries.size() << " queries from binary files." << std::endl;
         }
         
@@ -0,0 +1,157 @@
+#pragma once
+
+// The cleartext reference for the protocol: the queries in the clear and the updates they
+// make to the recombined U and V. check_correctness compares the parties' output with it,
+// and bench_driver times it as the baseline for the protocol's overhead.
+
+#include "utils.hpp"
+
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Helper to load cleartext queries (i, j) from file
+inline std::vector<std::pair<uint32_t, uint32_t>> load_cleartext_queries(const std::string& filename, uint32_t expected_q) {
+    std::ifstream in(filename);
+    if (!in) {
+        // Try to extract from binary queries if cleartext doesn't exist
+        throw std::runtime_error("Cannot open " + filename + ". Note: queries_cleartext.txt may need to be generated.");
+    }
+    std::vector<std::pair<uint32_t, uint32_t>> queries;
+    uint32_t i_idx, j_idx;
+    uint32_t count = 0;
+    while (count < expected_q && (in >> i_idx >> j_idx)) {
+        queries.emplace_back(i_idx, j_idx);
+        count++;
+    }
+    if (queries.size() != expected_q) {
+        throw std::runtime_error("Query count mismatch in " + filename + ": expected " + 
+                                 std::to_string(expected_q) + ", got " + std::to_string(queries.size()));
+    }
+    return queries;
+}
+
+// Helper to extract cleartext queries from binary query files
+inline std::vector<std::pair<uint32_t, uint32_t>> extract_queries_from_binary(const std::string& p0_file, 
+                                                                               const std::string& p1_file, 
+                                                                               uint32_t expected_q,
+                                                                               uint32_t pack_bits) {
+    std::ifstream q0_in(p0_file, std::ios::binary);
+    std::ifstream q1_in(p1_file, std::ios::binary);
+    
+    if (!q0_in || !q1_in) {
+        throw std::runtime_error("Cannot open binary query files: " + p0_file + " or " + p1_file);
+    }
+    read_query_file_header(q0_in, p0_file, pack_bits);
+    read_query_file_header(q1_in, p1_file, pack_bits);
+    
+    std::vector<std::pair<uint32_t, uint32_t>> queries;
+    
+    for (uint32_t i = 0; i < expected_q; ++i) {
+        uint32_t user_idx;
+        int64_t j0, j1;
+        
+        // Read from P0's file (the key itself is skipped)
+        q0_in.read(reinterpret_cast<char*>(&user_idx), sizeof(user_idx));
+        q0_in.read(reinterpret_cast<char*>(&j0), sizeof(j0));
+        if (pack_bits > 0) read_packed_key(q0_in); else read_key(q0_in);
+        
+        // Read from P1's file
+        q1_in.read(reinterpret_cast<char*>(&user_idx), sizeof(user_idx));
+        q1_in.read(reinterpret_cast<char*>(&j1), sizeof(j1));
+        if (pack_bits > 0) read_packed_key(q1_in); else read_key(q1_in);
+        
+        // Reconstruct item index: j = j0 + j1
+        int64_t j_recon = j0 + j1;
+        uint32_t item_idx;
+        if (j_recon >= 0) {
+            item_idx = j_recon;
+        } else {
+            // Handle negative values (though this shouldn't happen for valid indices)
+            item_idx = 0;
+        }
+        
+        queries.emplace_back(user_idx, item_idx);
+    }
+    
+    return queries;
+}
+
+// Recombines shares to get cleartext matrix
+inline ShareMat recombine_shares(const ShareMat& M0, const ShareMat& M1) {
+    if (M0.size() != M1.size() || (M0.size() > 0 && M0[0].size() != M1[0].size())) {
+        throw std::runtime_error("Matrix dimension mismatch in recombine_shares");
+    }
+    
+    int rows = M0.size();
+    int cols = rows > 0 ? M0[0].size() : 0;
+    ShareMat M(rows, ShareVec(cols));
+    
+    for (int i = 0; i < rows; ++i) {
+        for (int j = 0; j < cols; ++j) {
+            M[i][j] = M0[i][j] + M1[i][j];
+        }
+    }
+    return M;
+}
+
+// Cleartext dot product
+inline int64_t dot_product(const ShareVec& u, const ShareVec& v) {
+    if (u.size() != v.size()) {
+        throw std::runtime_error("Vector size mismatch in dot_product");
+    }
+    Z2_64 dot;
+    for (size_t i = 0; i < u.size(); ++i) {
+        dot += Z2_64(u[i]) * Z2_64(v[i]);
+    }
+    return dot.to_signed();
+}
+
+// Apply cleartext updates according to the protocol
+inline void apply_cleartext_updates(ShareMat& U, ShareMat& V, 
+                                    const std::vector<std::pair<uint32_t, uint32_t>>& queries) {
+    for (const auto& query : queries) {
+        uint32_t i_idx = query.first;  // user index
+        uint32_t j_idx = query.second; // item index
+        
+        if (i_idx >= U.size() || j_idx >= V.size()) {
+            throw std::runtime_error("Query index out of bounds: i=" + std::to_string(i_idx) + 
+                                     ", j=" + std::to_string(j_idx));
+        }
+        
+        ShareVec ui = U[i_idx];
+        ShareVec vj = V[j_idx];
+        
+        // --- A1: User Update (in cleartext) ---
+        // delta = 1 - <u_i, v_j>
+        int64_t dot = dot_product(ui, vj);
+        Z2_64 delta = Z2_64(1) - Z2_64(dot);
+        
+        // update_term = v_j * delta
+        ShareVec user_update_term(vj.size());
+        for (size_t f = 0; f < vj.size(); ++f) {
+            user_update_term[f] = (Z2_64(vj[f]) * delta).to_signed();
+        }
+        
+        // u_i <- u_i + update_term
+        for (size_t f = 0; f < ui.size(); ++f) {
+            U[i_idx][f] = (Z2_64(U[i_idx][f]) + Z2_64(user_update_term[f])).to_signed();
+        }
+        
+        // --- A3: Item Update (in cleartext) ---
+        // M = u_i * (1 - <u_i, v_j>)
+        // Both updates are computed in parallel based on original vectors
+        ShareVec item_update_term_M(ui.size());
+        for (size_t f = 0; f < ui.size(); ++f) {
+            item_update_term_M[f] = (Z2_64(ui[f]) * delta).to_signed();
+        }
+        
+        // v_j <- v_j + M
+        for (size_t f = 0; f < vj.size(); ++f) {
+            V[j_idx][f] = (Z2_64(V[j_idx][f]) + Z2_64(item_update_term_M[f])).to_signed();
+        }
+    }
+}
@@ -1,5 +1,14 @@
 #pragma once
 
+#include "dpf.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "metrics_server.hpp"
+#include "prg.hpp"
+#include "ring.hpp"
+#include "simd.hpp"
+#include "share_expr.hpp"
+
 #include <utility>
 #include <iostream>
 #include <vector>
@@ -9,6 +18,20 @@
 #include <fstream>
 #include <chrono>
 #include <numeric>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <span>
+#include <stdexcept>
 
 #include <boost/asio.hpp>
 #include <boost/asio/awaitable.hpp>
@@ -18,6 +41,12 @@
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/this_coro.hpp>
 
+// prg.hpp has already checked for x86-64 with GCC/Clang target attributes and pulled in
+// <immintrin.h>; the vector kernels below use the same toolchain support.
+#ifdef PRG_HAVE_X86_AES
+#define DPF_HAVE_X86_SIMD 1
+#endif
+
 using boost::asio::awaitable;
 using boost::asio::co_spawn;
 using boost::asio::detached;
@@ -25,255 +54,1213 @@ using boost::asio::use_awaitable;
 using boost::asio::ip::tcp;
 namespace this_coro = boost::asio::this_coro;
 
-using u64 = uint64_t;
-using ShareVec = std::vector<int64_t>;
-using ShareMat = std::vector<ShareVec>;
+// Nodes handed to prg_expand_batch() per call by dpf_expand_level().
+constexpr size_t DPF_EXPAND_BATCH = 64;
 
-struct ChildSeed {
-    u64 s_left, s_right;
-    bool f_left, f_right;
-};
+// Half-tree version of dpf_expand_level(): one hash per node, and the control bits are the
+// low bits of the seeds, so `flags` is not read.
+inline void halftree_expand_level(u64 scw, const u64* seeds, size_t count, u64* child_seeds, uint8_t* child_flags) {
+    u64 h[DPF_EXPAND_BATCH];
+    for (size_t base = 0; base < count; base += DPF_EXPAND_BATCH) {
+        size_t width = std::min(DPF_EXPAND_BATCH, count - base);
+        prg_hash_batch(seeds + base, width, h);
+        for (size_t n = 0; n < width; n++) {
+            u64 s = seeds[base + n];
+            u64 left = h[n] ^ ((0 - (s & 1)) & scw);
+            size_t c = 2 * (base + n);
+            child_seeds[c] = left;
+            child_seeds[c + 1] = left ^ s;
+            child_flags[c] = left & 1;
+            child_flags[c + 1] = (left ^ s) & 1;
+        }
+    }
+}
+
+// Expands seeds/flags[0, count) of one tree level into child_seeds/child_flags[0, 2*count),
+// the children of node n landing at 2n and 2n+1. The PRG runs over whole batches of nodes
+// and the correction word is applied with masks instead of branches. The outputs must not
+// overlap the inputs.
+inline void dpf_expand_level(DPFEngine engine, const CorrectionWord& cw, const u64* seeds, const uint8_t* flags,
+                             size_t count, u64* child_seeds, uint8_t* child_flags) {
+    if (engine == DPFEngine::HalfTree) {
+        halftree_expand_level(cw.scw, seeds, count, child_seeds, child_flags);
+        return;
+    }
+    u64 left[DPF_EXPAND_BATCH], right[DPF_EXPAND_BATCH];
+    uint8_t f_left[DPF_EXPAND_BATCH], f_right[DPF_EXPAND_BATCH];
+    const uint8_t fcw_0 = cw.fcw_0, fcw_1 = cw.fcw_1;
+    for (size_t base = 0; base < count; base += DPF_EXPAND_BATCH) {
+        size_t width = std::min(DPF_EXPAND_BATCH, count - base);
+        prg_expand_batch(seeds + base, width, left, right, f_left, f_right);
+        for (size_t n = 0; n < width; n++) {
+            uint8_t f = flags[base + n];
+            u64 mask = 0 - (u64)f;
+            size_t c = 2 * (base + n);
+            child_seeds[c] = left[n] ^ (mask & cw.scw);
+            child_seeds[c + 1] = right[n] ^ (mask & cw.scw);
+            child_flags[c] = f_left[n] ^ (f & fcw_0);
+            child_flags[c + 1] = f_right[n] ^ (f & fcw_1);
+        }
+    }
+}
+
+// Leaves are produced in blocks of 2^DPF_LEAF_BLOCK_BITS, so full-domain evaluation
+// only ever holds one block of outputs instead of an N-length vector.
+constexpr int DPF_LEAF_BLOCK_BITS = 8;
+constexpr size_t DPF_LEAF_BLOCK = size_t(1) << DPF_LEAF_BLOCK_BITS;
+
+// Expands the subtree rooted at (seed, flag) on `level`, whose first leaf is `first_leaf`,
+// and hands the leaf nodes that fall in [lo, hi) to leaves(first_index, seeds, flags, count)
+// one block at a time, left to right. Nodes whose leaves all lie outside [lo, hi) are
+// never expanded, which also prunes the unused right side of the tree when N is not a
+// power of two.
+template <typename LeafSink>
+void eval_subtree_nodes(const DPFKey& key, int level, int depth, u64 seed, bool flag,
+                        u64 first_leaf, u64 lo, u64 hi, LeafSink& leaves) {
+    int remaining = depth - level;
+    u64 last_leaf = first_leaf + (u64(1) << remaining);
+    if (first_leaf >= hi || last_leaf <= lo) return;
+
+    if (remaining <= DPF_LEAF_BLOCK_BITS) {
+        u64 seed_buf[2][DPF_LEAF_BLOCK];
+        uint8_t flag_buf[2][DPF_LEAF_BLOCK];
+        // Leaf window of this block that is inside [lo, hi).
+        u64 want_lo = std::max(lo, first_leaf) - first_leaf;
+        u64 want_hi = std::min(hi, last_leaf) - first_leaf;
+        int cur = 0;
+        seed_buf[cur][0] = seed;
+        flag_buf[cur][0] = flag;
+        for (int i = level; i < depth; i++) {
+            // Only the parents of the window are expanded.
+            int below = depth - i;
+            u64 first = want_lo >> below, last = ((want_hi - 1) >> below) + 1;
+            dpf_expand_level(key.engine, key.cws[i], seed_buf[cur] + first, flag_buf[cur] + first, last - first,
+                             seed_buf[cur ^ 1] + 2 * first, flag_buf[cur ^ 1] + 2 * first);
+            cur ^= 1;
+        }
+        leaves(first_leaf + want_lo, seed_buf[cur] + want_lo, flag_buf[cur] + want_lo, want_hi - want_lo);
+        return;
+    }
+
+    u64 child_seeds[2];
+    uint8_t child_flags[2], parent_flag = flag;
+    dpf_expand_level(key.engine, key.cws[level], &seed, &parent_flag, 1, child_seeds, child_flags);
+    u64 mid = first_leaf + (u64(1) << (remaining - 1));
+    eval_subtree_nodes(key, level + 1, depth, child_seeds[0], child_flags[0], first_leaf, lo, hi, leaves);
+    eval_subtree_nodes(key, level + 1, depth, child_seeds[1], child_flags[1], mid, lo, hi, leaves);
+}
+
+// eval_subtree_nodes() with the leaves converted to outputs and handed to
+// sink(first_index, values, count).
+template <typename Sink>
+void eval_subtree_stream(const DPFKey& key, int level, int depth, u64 seed, bool flag,
+                         u64 first_leaf, u64 lo, u64 hi, Sink& sink) {
+    auto leaves = [&](u64 first, const u64* seeds, const uint8_t* flags, size_t count) {
+        int64_t values[DPF_LEAF_BLOCK];
+        for (size_t n = 0; n < count; n++) values[n] = dpf_leaf_value(key, seeds[n], flags[n]);
+        sink(first, values, count);
+    };
+    eval_subtree_nodes(key, level, depth, seed, flag, first_leaf, lo, hi, leaves);
+}
+
+// Full-domain evaluation without an N-length temporary: each block of leaf outputs is
+// passed to sink(first_index, values, count) as soon as it is produced.
+template <typename Sink>
+void EvalFullStream(const DPFKey& k, u64 domain_size, Sink&& sink) {
+    if (domain_size == 0) return;
+    eval_subtree_stream(k, 0, dpf_depth(domain_size), k.s_root, k.f_root, 0, 0, domain_size, sink);
+}
+
+// Evaluates only the indices in [lo, hi), walking just the tree nodes that cover them.
+// The tree depth is taken from the key, so a shard does not need to know the full N.
+template <typename Sink>
+void EvalRangeStream(const DPFKey& k, u64 lo, u64 hi, Sink&& sink) {
+    int depth = k.cws.size();
+    hi = std::min(hi, u64(1) << depth);
+    if (lo >= hi) return;
+    eval_subtree_stream(k, 0, depth, k.s_root, k.f_root, 0, lo, hi, sink);
+}
+
+// Returns the outputs for [lo, hi); element 0 is index lo.
+inline std::vector<int64_t> EvalRange(const DPFKey& k, u64 lo, u64 hi) {
+    std::vector<int64_t> result(hi > lo ? hi - lo : 0);
+    EvalRangeStream(k, lo, hi, [&](u64 first, const int64_t* values, size_t count) {
+        std::copy(values, values + count, result.begin() + (first - lo));
+    });
+    return result;
+}
+
+// Adds the DPF outputs for [lo, hi) into rows [0, hi - lo) of a shard that holds only
+// those items.
+inline void EvalRangeAccumulate(const DPFKey& k, u64 lo, u64 hi, ShareMat& shard, uint32_t column) {
+    EvalRangeStream(k, lo, hi, [&](u64 first, const int64_t* values, size_t count) {
+        for (size_t n = 0; n < count; n++) {
+            int64_t& cell = shard[first - lo + n][column];
+            cell = (int64_t)((u64)cell + (u64)values[n]);
+        }
+    });
+}
+
+// Persistent worker threads for the DPF kernels. run() splits [0, num_tasks) into one
+// contiguous slice per participant (the workers plus the calling thread); a participant
+// that finishes its own slice steals the remaining tasks of the others.
+class DPFThreadPool {
+public:
+    explicit DPFThreadPool(unsigned num_threads) {
+        unsigned helpers = num_threads > 1 ? num_threads - 1 : 0;
+        for (unsigned w = 0; w < helpers; w++) {
+            workers.emplace_back([this, w] { worker_loop(w + 1); });
+        }
+    }
+
+    ~DPFThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : workers) t.join();
+    }
+
+    DPFThreadPool(const DPFThreadPool&) = delete;
+    DPFThreadPool& operator=(const DPFThreadPool&) = delete;
+
+    unsigned size() const { return workers.size() + 1; }
+
+    void run(size_t num_tasks, const std::function<void(size_t)>& fn) {
+        unsigned participants = size();
+        if (participants == 1 || num_tasks <= 1) {
+            for (size_t t = 0; t < num_tasks; t++) fn(t);
+            return;
+        }
+        slices = std::make_unique<Slice[]>(participants);
+        for (unsigned p = 0; p < participants; p++) {
+            slices[p].next.store(num_tasks * p / participants, std::memory_order_relaxed);
+            slices[p].end = num_tasks * (p + 1) / participants;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            job = &fn;
+            busy = participants - 1;
+            generation++;
+        }
+        wake.notify_all();
+        drain(0);
+        std::unique_lock<std::mutex> lock(mtx);
+        done.wait(lock, [this] { return busy == 0; });
+        job = nullptr;
+    }
+
+private:
+    struct alignas(64) Slice {
+        std::atomic<size_t> next{0};
+        size_t end = 0;
+    };
 
-struct CorrectionWord {
-    u64 scw;
-    bool fcw_0;
-    bool fcw_1;
+    void drain(unsigned self) {
+        unsigned participants = size();
+        for (unsigned i = 0; i < participants; i++) {
+            Slice& slice = slices[(self + i) % participants];
+            for (;;) {
+                size_t t = slice.next.fetch_add(1, std::memory_order_relaxed);
+                if (t >= slice.end) break;
+                (*job)(t);
+            }
+        }
+    }
+
+    void worker_loop(unsigned self) {
+        perf_counters().register_thread();
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+            drain(self);
+            std::lock_guard<std::mutex> lock(mtx);
+            if (--busy == 0) done.notify_one();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::unique_ptr<Slice[]> slices;
+    const std::function<void(size_t)>* job = nullptr;
+    std::mutex mtx;
+    std::condition_variable wake, done;
+    uint64_t generation = 0;
+    unsigned busy = 0;
+    bool stopping = false;
 };
 
-struct DPFKey {
+// Shared pool for the parties. Its size comes from DPF_THREADS, defaulting to the number
+// of hardware threads.
+inline DPFThreadPool& dpf_thread_pool() {
+    static DPFThreadPool pool([] {
+        const char* env = std::getenv("DPF_THREADS");
+        unsigned n = env ? std::strtoul(env, nullptr, 10) : std::thread::hardware_concurrency();
+        return n == 0 ? 1u : n;
+    }());
+    return pool;
+}
+
+// Below this many leaves a single thread beats the cost of waking the pool.
+constexpr u64 DPF_PARALLEL_MIN_DOMAIN = u64(1) << 14;
+
+// Runs eval_subtree_nodes() over leaves [0, num_leaves) of a depth-`depth` tree on the
+// pool. The top levels are expanded serially into a few subtrees per thread, and each
+// subtree is then walked by whichever worker claims it.
+template <typename LeafSink>
+void eval_nodes_parallel(const DPFKey& k, int depth, u64 num_leaves, LeafSink& leaves, DPFThreadPool& pool) {
+    // Four subtrees per thread leave the stealing something to balance.
+    int split = std::min<int>(depth - DPF_LEAF_BLOCK_BITS, (int)ceil(log2(pool.size())) + 2);
+    if (pool.size() == 1 || split <= 0) {
+        eval_subtree_nodes(k, 0, depth, k.s_root, k.f_root, 0, 0, num_leaves, leaves);
+        return;
+    }
+
+    std::optional<PhaseScope> top_phase(std::in_place, Phase::DpfTopLevels);
+    std::vector<u64> seeds(1, k.s_root), next_seeds;
+    std::vector<uint8_t> flags(1, k.f_root), next_flags;
+    for (int i = 0; i < split; i++) {
+        next_seeds.resize(2 * seeds.size());
+        next_flags.resize(2 * flags.size());
+        dpf_expand_level(k.engine, k.cws[i], seeds.data(), flags.data(), seeds.size(),
+                         next_seeds.data(), next_flags.data());
+        seeds.swap(next_seeds);
+        flags.swap(next_flags);
+    }
+
+    top_phase.reset();
+
+    PhaseScope subtree_phase(Phase::DpfSubtrees);
+    int subtree_bits = depth - split;
+    pool.run(seeds.size(), [&](size_t n) {
+        eval_subtree_nodes(k, split, depth, seeds[n], flags[n], u64(n) << subtree_bits, 0, num_leaves, leaves);
+    });
+}
+
+// Multi-threaded EvalFullStream on top of eval_nodes_parallel(). Every subtree covers a
+// disjoint leaf range, so the sink may be called concurrently but never twice for the same
+// index.
+template <typename Sink>
+void EvalFullParallel(const DPFKey& k, u64 domain_size, Sink&& sink, DPFThreadPool& pool) {
+    if (pool.size() == 1 || domain_size < DPF_PARALLEL_MIN_DOMAIN) {
+        EvalFullStream(k, domain_size, sink);
+        return;
+    }
+    auto leaves = [&](u64 first, const u64* seeds, const uint8_t* flags, size_t count) {
+        int64_t values[DPF_LEAF_BLOCK];
+        for (size_t n = 0; n < count; n++) values[n] = dpf_leaf_value(k, seeds[n], flags[n]);
+        sink(first, values, count);
+    };
+    eval_nodes_parallel(k, dpf_depth(domain_size), domain_size, leaves, pool);
+}
+
+// Adds the DPF output for every index i into mat[i][column] in a single pass.
+inline void EvalFullAccumulate(const DPFKey& k, u64 domain_size, ShareMat& mat, uint32_t column) {
+    EvalFullStream(k, domain_size, [&](u64 first, const int64_t* values, size_t count) {
+        for (size_t n = 0; n < count; n++) {
+            int64_t& cell = mat[first + n][column];
+            cell = (int64_t)((u64)cell + (u64)values[n]);
+        }
+    });
+}
+
+inline void EvalFullAccumulate(const DPFKey& k, u64 domain_size, ShareMat& mat, uint32_t column,
+                               DPFThreadPool& pool) {
+    EvalFullParallel(k, domain_size, [&](u64 first, const int64_t* values, size_t count) {
+        for (size_t n = 0; n < count; n++) {
+            int64_t& cell = mat[first + n][column];
+            cell = (int64_t)((u64)cell + (u64)values[n]);
+        }
+    }, pool);
+}
+
+inline std::vector<int64_t> EvalFull(const DPFKey& k, u64 domain_size) {
+    std::vector<int64_t> result(domain_size);
+    EvalFullStream(k, domain_size, [&](u64 first, const int64_t* values, size_t count) {
+        std::copy(values, values + count, result.begin() + first);
+    });
+    return result;
+}
+
+// Fixed-width counterparts of the vec_* helpers for a K-feature profile. The arithmetic
+// wraps mod 2^64 like the DPF outputs.
+template <size_t K>
+using Profile = std::array<int64_t, K>;
+
+template <size_t K>
+inline Profile<K> profile_add(const Profile<K>& a, const Profile<K>& b) {
+    Profile<K> result;
+    for (size_t f = 0; f < K; ++f) result[f] = (int64_t)((u64)a[f] + (u64)b[f]);
+    return result;
+}
+
+template <size_t K>
+inline Profile<K> profile_sub(const Profile<K>& a, const Profile<K>& b) {
+    Profile<K> result;
+    for (size_t f = 0; f < K; ++f) result[f] = (int64_t)((u64)a[f] - (u64)b[f]);
+    return result;
+}
+
+template <size_t K>
+inline Profile<K> profile_scalar_mul(const Profile<K>& a, int64_t scalar) {
+    Profile<K> result;
+    for (size_t f = 0; f < K; ++f) result[f] = (int64_t)((u64)a[f] * (u64)scalar);
+    return result;
+}
+
+template <size_t K>
+inline int64_t profile_dot_product(const Profile<K>& a, const Profile<K>& b) {
+    u64 result = 0;
+    for (size_t f = 0; f < K; ++f) result += (u64)a[f] * (u64)b[f];
+    return (int64_t)result;
+}
+
+// DPFKey with the depth fixed at compile time, so the correction words sit in an array
+// and every level bound below is a constant.
+template <int Depth>
+struct FixedDPFKey {
     u64 s_root;
     bool f_root;
-    std::vector<CorrectionWord> cws;
+    std::array<CorrectionWord, Depth> cws;
     int64_t FCW;
     int sign;
+    DPFEngine engine;
 };
 
-inline int8_t random_int8() {
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    static std::uniform_int_distribution<int16_t> dis(-128, 127);
-    return (int8_t)dis(gen);
+template <int Depth>
+inline FixedDPFKey<Depth> make_fixed_key(const DPFKey& k) {
+    if (k.cws.size() != Depth) throw std::invalid_argument("make_fixed_key: key depth does not match");
+    FixedDPFKey<Depth> key{k.s_root, k.f_root, {}, k.FCW, k.sign, k.engine};
+    std::copy(k.cws.begin(), k.cws.end(), key.cws.begin());
+    return key;
 }
 
-inline int32_t random_int32() {
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    static std::uniform_int_distribution<int32_t> dis(-128, 127);
-    return dis(gen);
-}
+// eval_subtree_nodes() for a fixed depth, over leaves [0, num_leaves). The recursion is
+// unrolled into one instantiation per level, and the last DPF_LEAF_BLOCK_BITS levels are
+// expanded by a fully unrolled sequence of dpf_expand_level() calls into stack buffers
+// sized for exactly that block.
+template <int Depth, int Level, typename LeafSink>
+void eval_fixed_subtree(const FixedDPFKey<Depth>& key, u64 seed, bool flag, u64 first_leaf, u64 num_leaves,
+                        LeafSink& leaves) {
+    constexpr int remaining = Depth - Level;
+    if (first_leaf >= num_leaves) return;
 
-inline uint8_t random_uint8() {
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    static std::uniform_int_distribution<uint8_t> dis;
-    return dis(gen);
+    if constexpr (remaining <= DPF_LEAF_BLOCK_BITS) {
+        constexpr u64 width = u64(1) << remaining;
+        u64 seed_buf[2][width];
+        uint8_t flag_buf[2][width];
+        u64 want = std::min(width, num_leaves - first_leaf);
+        seed_buf[0][0] = seed;
+        flag_buf[0][0] = flag;
+        [&]<int... I>(std::integer_sequence<int, I...>) {
+            (dpf_expand_level(key.engine, key.cws[Level + I], seed_buf[I & 1], flag_buf[I & 1],
+                              ((want - 1) >> (remaining - I)) + 1, seed_buf[(I & 1) ^ 1], flag_buf[(I & 1) ^ 1]), ...);
+        }(std::make_integer_sequence<int, remaining>{});
+        leaves(first_leaf, seed_buf[remaining & 1], flag_buf[remaining & 1], want);
+    } else {
+        u64 child_seeds[2];
+        uint8_t child_flags[2], parent_flag = flag;
+        dpf_expand_level(key.engine, key.cws[Level], &seed, &parent_flag, 1, child_seeds, child_flags);
+        u64 mid = first_leaf + (u64(1) << (remaining - 1));
+        eval_fixed_subtree<Depth, Level + 1>(key, child_seeds[0], child_flags[0], first_leaf, num_leaves, leaves);
+        eval_fixed_subtree<Depth, Level + 1>(key, child_seeds[1], child_flags[1], mid, num_leaves, leaves);
+    }
 }
 
-inline uint32_t random_uint32() {
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    static std::uniform_int_distribution<uint32_t> dis;
-    return dis(gen);
+// EvalFull() for a key whose depth is known at compile time (Depth == dpf_depth(domain_size)).
+template <int Depth>
+std::vector<int64_t> EvalFull(const DPFKey& k, u64 domain_size) {
+    FixedDPFKey<Depth> key = make_fixed_key<Depth>(k);
+    std::vector<int64_t> result(domain_size);
+    auto leaves = [&](u64 first, const u64* seeds, const uint8_t* flags, size_t count) {
+        for (size_t n = 0; n < count; n++) {
+            u64 value = seeds[n] + ((u64)key.FCW & (0 - (u64)flags[n]));
+            result[first + n] = (int64_t)(key.sign > 0 ? value : 0 - value);
+        }
+    };
+    if (domain_size > 0) eval_fixed_subtree<Depth, 0>(key, key.s_root, key.f_root, 0, domain_size, leaves);
+    return result;
 }
 
-inline ChildSeed PRG(u64 seed) {
-    std::mt19937 engine(seed);
-    ChildSeed child;
-    child.s_left = (uint8_t)engine();
-    child.s_right = (uint8_t)engine();
-    child.f_left = (engine() % 2 == 1);
-    child.f_right = (engine() % 2 == 1);
-    return child;
+// Adds sign * (s_i + t_i * fcw[f]) into mat[i][f] for every item i and feature f: one tree
+// walk serves all K features, since they share the key and differ only in the FCW.
+template <int Depth, size_t K>
+void EvalProfileAccumulate(const DPFKey& k, const Profile<K>& fcw, u64 domain_size, ShareMat& mat) {
+    FixedDPFKey<Depth> key = make_fixed_key<Depth>(k);
+    Profile<K> signed_fcw = profile_scalar_mul(fcw, key.sign);
+    auto leaves = [&](u64 first, const u64* seeds, const uint8_t* flags, size_t count) {
+        for (size_t n = 0; n < count; n++) {
+            u64 base = key.sign > 0 ? seeds[n] : 0 - seeds[n];
+            u64 mask = 0 - (u64)flags[n];
+            int64_t* row = mat[first + n].data();
+            for (size_t f = 0; f < K; ++f) row[f] = (int64_t)((u64)row[f] + base + ((u64)signed_fcw[f] & mask));
+        }
+    };
+    if (domain_size > 0) eval_fixed_subtree<Depth, 0>(key, key.s_root, key.f_root, 0, domain_size, leaves);
 }
 
-inline std::mt19937& get_prg_engine() {
-    static std::random_device rd;
-    static std::mt19937 engine(rd());
-    return engine;
+// Depths the runtime dispatcher instantiates. Deeper trees are past DPF_PARALLEL_MIN_DOMAIN
+// and go to the thread pool instead.
+constexpr int DPF_FIXED_MAX_DEPTH = 14;
+
+template <size_t K, int... D>
+bool eval_profile_fixed(int depth, const DPFKey& k, std::span<const int64_t> fcw, u64 domain_size, ShareMat& mat,
+                        std::integer_sequence<int, D...>) {
+    Profile<K> profile;
+    std::copy_n(fcw.begin(), K, profile.begin());
+    return ((depth == D + 1 && (EvalProfileAccumulate<D + 1, K>(k, profile, domain_size, mat), true)) || ...);
 }
 
-inline std::pair<DPFKey, DPFKey> generateDPF(u64 index, int64_t value, u64 domain_size) {
-    int depth = (domain_size == 0) ? 0 : ceil(log2(domain_size));
-    if (depth == 0) { depth = 1; domain_size = 2; }
+// Runtime entry point for EvalProfileAccumulate(): fcw[f] is the final correction word of
+// feature f. Common (depth, K) pairs run the specialised code; anything else, and domains
+// large enough for the pool, takes the generic walk. The generic walk's scratch comes from
+// `scratch`, e.g. a QueryArena.
+inline void EvalFullAccumulateProfile(const DPFKey& k, std::span<const int64_t> fcw, u64 domain_size, ShareMat& mat,
+                                      DPFThreadPool& pool,
+                                      std::pmr::memory_resource* scratch = std::pmr::get_default_resource()) {
+    if (domain_size == 0) return;
+    int depth = dpf_depth(domain_size);
+    if (depth <= DPF_FIXED_MAX_DEPTH && (pool.size() == 1 || domain_size < DPF_PARALLEL_MIN_DOMAIN)) {
+        constexpr auto depths = std::make_integer_sequence<int, DPF_FIXED_MAX_DEPTH>{};
+        bool done = false;
+        switch (fcw.size()) {
+            case 1: done = eval_profile_fixed<1>(depth, k, fcw, domain_size, mat, depths); break;
+            case 2: done = eval_profile_fixed<2>(depth, k, fcw, domain_size, mat, depths); break;
+            case 3: done = eval_profile_fixed<3>(depth, k, fcw, domain_size, mat, depths); break;
+            case 4: done = eval_profile_fixed<4>(depth, k, fcw, domain_size, mat, depths); break;
+            case 8: done = eval_profile_fixed<8>(depth, k, fcw, domain_size, mat, depths); break;
+            default: break;
+        }
+        if (done) return;
+    }
 
-    DPFKey k0, k1;
+    size_t features = fcw.size();
+    std::pmr::vector<u64> signed_fcw(features, scratch);
+    for (size_t f = 0; f < features; ++f) signed_fcw[f] = k.sign > 0 ? (u64)fcw[f] : 0 - (u64)fcw[f];
+    auto leaves = [&](u64 first, const u64* seeds, const uint8_t* flags, size_t count) {
+        for (size_t n = 0; n < count; n++) {
+            u64 base = k.sign > 0 ? seeds[n] : 0 - seeds[n];
+            u64 mask = 0 - (u64)flags[n];
+            int64_t* row = mat[first + n].data();
+            for (size_t f = 0; f < features; ++f) row[f] = (int64_t)((u64)row[f] + base + (signed_fcw[f] & mask));
+        }
+    };
+    if (pool.size() == 1 || domain_size < DPF_PARALLEL_MIN_DOMAIN) {
+        eval_subtree_nodes(k, 0, depth, k.s_root, k.f_root, 0, 0, domain_size, leaves);
+    } else {
+        eval_nodes_parallel(k, depth, domain_size, leaves, pool);
+    }
+}
 
-    u64 s0_curr = random_uint8();
-    u64 s1_curr = random_uint8();
-    bool f0_curr = 0;
-    bool f1_curr = 1;
+// Leaf control bits only, packed 64 per word: bit i % 64 of word i / 64 is t_i. The two
+// parties' bitmaps are XOR shares of e_index, so a one-hot selection needs n / 8 bytes
+// instead of 8n.
+inline std::vector<u64> EvalFullBits(const DPFKey& k, u64 domain_size) {
+    std::vector<u64> bits((domain_size + 63) / 64);
+    if (domain_size == 0) return bits;
+    auto leaves = [&](u64 first, const u64*, const uint8_t* flags, size_t count) {
+        for (size_t n = 0; n < count; n++) bits[(first + n) >> 6] |= u64(flags[n] & 1) << ((first + n) & 63);
+    };
+    eval_subtree_nodes(k, 0, dpf_depth(domain_size), k.s_root, k.f_root, 0, 0, domain_size, leaves);
+    return bits;
+}
 
-    k0.s_root = s0_curr;
-    k1.s_root = s1_curr;
-    k0.f_root = f0_curr;
-    k1.f_root = f1_curr;
+// Subtrees handed to the workers span at least DPF_LEAF_BLOCK leaves, so no two threads
+// ever write the same bitmap word.
+inline std::vector<u64> EvalFullBits(const DPFKey& k, u64 domain_size, DPFThreadPool& pool) {
+    if (pool.size() == 1 || domain_size < DPF_PARALLEL_MIN_DOMAIN) return EvalFullBits(k, domain_size);
+    std::vector<u64> bits((domain_size + 63) / 64);
+    auto leaves = [&](u64 first, const u64*, const uint8_t* flags, size_t count) {
+        for (size_t n = 0; n < count; n++) bits[(first + n) >> 6] |= u64(flags[n] & 1) << ((first + n) & 63);
+    };
+    eval_nodes_parallel(k, dpf_depth(domain_size), domain_size, leaves, pool);
+    return bits;
+}
 
-    for(int i=0;i<depth;i++) {
-        ChildSeed c0 = PRG(s0_curr);
-        ChildSeed c1 = PRG(s1_curr);
-        bool path_bit = (index >> (depth - 1 - i)) & 1;
-        bool f0_next, f1_next;
-        CorrectionWord cw;
+namespace dpf_detail {
 
-        if (path_bit == 0) {
-            cw.scw = c0.s_right ^ c1.s_right;
-            cw.fcw_1 = c0.f_right ^ c1.f_right;
-            cw.fcw_0 = c0.f_left ^ c1.f_left ^ 1;
-            s0_curr = c0.s_left; s1_curr = c1.s_left;
-            f0_next = c0.f_left; f1_next = c1.f_left;
-        } else {
-            cw.scw = c0.s_left ^ c1.s_left;
-            cw.fcw_0 = c0.f_left ^ c1.f_left;
-            cw.fcw_1 = c0.f_right ^ c1.f_right ^ 1;
-            s0_curr = c0.s_right; s1_curr = c1.s_right;
-            f0_next = c0.f_right; f1_next = c1.f_right;
-        }
-        if (f0_curr) {
-            s0_curr ^= cw.scw;
-            f0_next ^= (path_bit == 0) ? cw.fcw_0 : cw.fcw_1;
+inline void select_rows_portable(const u64* bits, const int64_t* matrix, u64 rows, uint32_t cols, int64_t* out) {
+    std::fill(out, out + cols, 0);
+    for (u64 i = 0; i < rows; i++) {
+        u64 mask = 0 - ((bits[i >> 6] >> (i & 63)) & 1);
+        const int64_t* row = matrix + i * cols;
+        for (uint32_t c = 0; c < cols; c++) out[c] = (int64_t)((u64)out[c] + ((u64)row[c] & mask));
+    }
+}
+
+#ifdef DPF_HAVE_X86_SIMD
+// Eight columns per register; each row is added under a lane mask that is all-zero when its
+// bit is clear, so there are no data-dependent branches.
+__attribute__((target("avx512f")))
+inline void select_rows_avx512(const u64* bits, const int64_t* matrix, u64 rows, uint32_t cols, int64_t* out) {
+    for (uint32_t c = 0; c < cols; c += 8) {
+        __mmask8 lanes = cols - c >= 8 ? 0xFF : (__mmask8)((1u << (cols - c)) - 1);
+        __m512i acc = _mm512_setzero_si512();
+        for (u64 i = 0; i < rows; i++) {
+            __mmask8 take = lanes & (__mmask8)(0 - ((bits[i >> 6] >> (i & 63)) & 1));
+            __m512i row = _mm512_maskz_loadu_epi64(take, matrix + i * cols + c);
+            acc = _mm512_add_epi64(acc, row);
         }
-        if (f1_curr) {
-            s1_curr ^= cw.scw;
-            f1_next ^= (path_bit == 0) ? cw.fcw_0 : cw.fcw_1;
+        _mm512_mask_storeu_epi64(out + c, lanes, acc);
+    }
+}
+
+// Four columns per register. AVX2 has no mask registers, so each row is ANDed with its bit
+// spread over the lanes, and the column tail goes through maskload/maskstore.
+__attribute__((target("avx2")))
+inline void select_rows_avx2(const u64* bits, const int64_t* matrix, u64 rows, uint32_t cols, int64_t* out) {
+    for (uint32_t c = 0; c < cols; c += 4) {
+        __m256i lanes = _mm256_cmpgt_epi64(_mm256_set1_epi64x(cols - c), _mm256_set_epi64x(3, 2, 1, 0));
+        __m256i acc = _mm256_setzero_si256();
+        for (u64 i = 0; i < rows; i++) {
+            __m256i take = _mm256_set1_epi64x((long long)(0 - ((bits[i >> 6] >> (i & 63)) & 1)));
+            __m256i row = _mm256_maskload_epi64(reinterpret_cast<const long long*>(matrix + i * cols + c), lanes);
+            acc = _mm256_add_epi64(acc, _mm256_and_si256(row, take));
         }
-        f0_curr = f0_next; f1_curr = f1_next;
-        k0.cws.push_back(cw); k1.cws.push_back(cw);
+        _mm256_maskstore_epi64(reinterpret_cast<long long*>(out + c), lanes, acc);
     }
+}
+#endif
 
-    int64_t s0_final = (int64_t)s0_curr;
-    int64_t s1_final = (int64_t)s1_curr;
-    int64_t R = random_int8();
+}  // namespace dpf_detail
 
-    k0.sign = f0_curr * 1 + (1-f0_curr) * (-1);
-    k1.sign = f1_curr * 1 + (1-f1_curr) * (-1);
+// Dot product of a selection bitmap with a row-major rows x cols matrix that both parties
+// hold in the clear: out = sign * sum_i t_i * matrix[i]. With each party's EvalFullBits()
+// bitmap and its key's sign, the two outputs are additive shares of matrix[index]. A
+// secret-shared matrix still needs a multiplication per row (see the rotation lookup).
+inline void SelectRowShare(const std::vector<u64>& bits, int sign, const int64_t* matrix, u64 rows, uint32_t cols,
+                           int64_t* out) {
+#ifdef DPF_HAVE_X86_SIMD
+    static const bool use_avx512 = __builtin_cpu_supports("avx512f");
+    static const bool use_avx2 = __builtin_cpu_supports("avx2");
+    if (use_avx512) {
+        dpf_detail::select_rows_avx512(bits.data(), matrix, rows, cols, out);
+    } else if (use_avx2) {
+        dpf_detail::select_rows_avx2(bits.data(), matrix, rows, cols, out);
+    } else {
+        dpf_detail::select_rows_portable(bits.data(), matrix, rows, cols, out);
+    }
+#else
+    dpf_detail::select_rows_portable(bits.data(), matrix, rows, cols, out);
+#endif
+    if (sign < 0) {
+        for (uint32_t c = 0; c < cols; c++) out[c] = (int64_t)(0 - (u64)out[c]);
+    }
+}
 
-    k0.FCW = R + k0.sign * s0_final;
-    k1.FCW = (value - R) + k1.sign * s1_final;
+// Leaf sink for the packed evaluators: converts each leaf seed into its block of elements
+// and hands the elements that fall in [lo, hi) to sink(first_index, values, count).
+template <typename Sink>
+auto packed_leaf_sink(const PackedDPFKey& k, u64 lo, u64 hi, Sink& sink) {
+    return [&k, lo, hi, &sink](u64 first_leaf, const u64* seeds, const uint8_t* flags, size_t count) {
+        size_t width = size_t(1) << k.pack_bits;
+        size_t chunk = DPF_LEAF_BLOCK / width;
+        u64 words[DPF_LEAF_BLOCK];
+        int64_t values[DPF_LEAF_BLOCK];
+        for (size_t c = 0; c < count; c += chunk) {
+            size_t m = std::min(chunk, count - c);
+            prg_convert_batch(seeds + c, m, width, words);
+            for (size_t n = 0; n < m; n++) packed_leaf_values(k, words + n * width, flags[c + n], values + n * width);
+            u64 first = (first_leaf + c) << k.pack_bits;
+            u64 from = std::max(first, lo), to = std::min(first + m * width, hi);
+            if (from < to) sink(from, values + (from - first), to - from);
+        }
+    };
+}
+
+// Packed counterpart of EvalRangeStream(): only the leaves whose blocks overlap [lo, hi)
+// are expanded and converted.
+template <typename Sink>
+void EvalPackedRangeStream(const PackedDPFKey& k, u64 lo, u64 hi, Sink&& sink) {
+    int depth = k.tree.cws.size();
+    hi = std::min(hi, u64(1) << (depth + k.pack_bits));
+    if (lo >= hi) return;
+    auto leaves = packed_leaf_sink(k, lo, hi, sink);
+    eval_subtree_nodes(k.tree, 0, depth, k.tree.s_root, k.tree.f_root, 0,
+                       lo >> k.pack_bits, ((hi - 1) >> k.pack_bits) + 1, leaves);
+}
 
-    return {k0, k1};
+template <typename Sink>
+void EvalPackedFullParallel(const PackedDPFKey& k, u64 domain_size, Sink&& sink, DPFThreadPool& pool) {
+    if (pool.size() == 1 || domain_size < DPF_PARALLEL_MIN_DOMAIN) {
+        EvalPackedRangeStream(k, 0, domain_size, sink);
+        return;
+    }
+    auto leaves = packed_leaf_sink(k, 0, domain_size, sink);
+    u64 num_leaves = ((domain_size - 1) >> k.pack_bits) + 1;
+    eval_nodes_parallel(k.tree, k.tree.cws.size(), num_leaves, leaves, pool);
 }
 
-inline int64_t evalDPF(const DPFKey& key, u64 index, u64 domain_size) {
-    int depth = (domain_size == 0) ? 0 : ceil(log2(domain_size));
-    if (depth == 0) { depth = 1; domain_size = 2; }
+inline void EvalPackedFullAccumulate(const PackedDPFKey& k, u64 domain_size, ShareMat& mat, uint32_t column,
+                                     DPFThreadPool& pool) {
+    EvalPackedFullParallel(k, domain_size, [&](u64 first, const int64_t* values, size_t count) {
+        for (size_t n = 0; n < count; n++) {
+            int64_t& cell = mat[first + n][column];
+            cell = (int64_t)((u64)cell + (u64)values[n]);
+        }
+    }, pool);
+}
 
-    u64 s_curr = key.s_root;
-    bool f_curr = key.f_root;
+// Packed counterpart of EvalFullAccumulateProfile(): fcw holds K rows of 2^pack_bits
+// final correction words, and each leaf seed is converted once for all features.
+inline void EvalPackedFullAccumulateProfile(const PackedDPFKey& k, std::span<const int64_t> fcw, u64 domain_size,
+                                            ShareMat& mat, DPFThreadPool& pool,
+                                            std::pmr::memory_resource* scratch = std::pmr::get_default_resource()) {
+    if (domain_size == 0) return;
+    size_t width = size_t(1) << k.pack_bits;
+    size_t features = fcw.size() / width;
+    std::pmr::vector<u64> signed_fcw(fcw.size(), scratch);
+    for (size_t idx = 0; idx < fcw.size(); ++idx) signed_fcw[idx] = k.tree.sign > 0 ? (u64)fcw[idx] : 0 - (u64)fcw[idx];
 
-    for(int i=0; i<depth; i++) {
-        ChildSeed ch = PRG(s_curr);
-        bool path_bit = (index >> (depth - 1 - i)) & 1;
-        bool f_next;
-        if(path_bit == 0){ s_curr = ch.s_left; f_next = ch.f_left; }
-        else { s_curr = ch.s_right; f_next = ch.f_right; }
-        if(f_curr){
-            s_curr ^= key.cws[i].scw;
-            f_next ^= (path_bit == 0) ? key.cws[i].fcw_0 : key.cws[i].fcw_1;
+    auto leaves = [&](u64 first_leaf, const u64* seeds, const uint8_t* flags, size_t count) {
+        size_t chunk = DPF_LEAF_BLOCK / width;
+        u64 words[DPF_LEAF_BLOCK];
+        for (size_t c = 0; c < count; c += chunk) {
+            size_t m = std::min(chunk, count - c);
+            prg_convert_batch(seeds + c, m, width, words);
+            for (size_t n = 0; n < m; n++) {
+                u64 mask = 0 - (u64)flags[c + n];
+                u64 item = (first_leaf + c + n) << k.pack_bits;
+                for (size_t slot = 0; slot < width && item + slot < domain_size; ++slot) {
+                    u64 word = words[n * width + slot];
+                    u64 base = k.tree.sign > 0 ? word : 0 - word;
+                    int64_t* row = mat[item + slot].data();
+                    for (size_t f = 0; f < features; ++f) {
+                        row[f] = (int64_t)((u64)row[f] + base + (signed_fcw[f * width + slot] & mask));
+                    }
+                }
+            }
         }
-        f_curr = f_next;
+    };
+    u64 num_leaves = ((domain_size - 1) >> k.pack_bits) + 1;
+    int depth = k.tree.cws.size();
+    if (pool.size() == 1 || domain_size < DPF_PARALLEL_MIN_DOMAIN) {
+        eval_subtree_nodes(k.tree, 0, depth, k.tree.s_root, k.tree.f_root, 0, 0, num_leaves, leaves);
+    } else {
+        eval_nodes_parallel(k.tree, depth, num_leaves, leaves, pool);
     }
+}
 
-    int64_t value = (int64_t)s_curr;
+inline std::vector<int64_t> EvalPackedFull(const PackedDPFKey& k, u64 domain_size) {
+    std::vector<int64_t> result(domain_size);
+    EvalPackedRangeStream(k, 0, domain_size, [&](u64 first, const int64_t* values, size_t count) {
+        std::copy(values, values + count, result.begin() + first);
+    });
+    return result;
+}
 
-    if(f_curr) {
-        value += key.FCW;
+// Non-owning view of a DPFKey for the batched evaluator. The FCW is held by value so that
+// several views can share one key's tree with different final correction words.
+struct DPFKeyView {
+    u64 s_root;
+    bool f_root;
+    const CorrectionWord* cws;
+    int depth;
+    int64_t FCW;
+    int sign;
+    DPFEngine engine;
+
+    DPFKeyView(const DPFKey& k)
+        : s_root(k.s_root), f_root(k.f_root), cws(k.cws.data()), depth((int)k.cws.size()), FCW(k.FCW), sign(k.sign),
+          engine(k.engine) {}
+};
+
+// Expands one level for a batch of keys. Nodes are stored node-major, entry n * num_keys + j
+// holding node n of key j, so one prg_expand_batch() call covers the level of every key and
+// the AES pipeline always has independent blocks in flight. scw/fcw_0/fcw_1 hold this
+// level's correction word for each key.
+inline void dpf_expand_level_batch(DPFEngine engine, const u64* scw, const uint8_t* fcw_0, const uint8_t* fcw_1,
+                                   size_t num_keys, const u64* seeds, const uint8_t* flags, size_t count,
+                                   u64* child_seeds, uint8_t* child_flags) {
+    u64 left[DPF_EXPAND_BATCH], right[DPF_EXPAND_BATCH];
+    uint8_t f_left[DPF_EXPAND_BATCH], f_right[DPF_EXPAND_BATCH];
+    size_t entries = count * num_keys;
+    if (engine == DPFEngine::HalfTree) {
+        for (size_t base = 0; base < entries; base += DPF_EXPAND_BATCH) {
+            size_t width = std::min(DPF_EXPAND_BATCH, entries - base);
+            prg_hash_batch(seeds + base, width, left);
+            size_t node = base / num_keys, j = base % num_keys;
+            for (size_t e = 0; e < width; e++, j++) {
+                if (j == num_keys) { j = 0; node++; }
+                u64 sd = seeds[base + e];
+                u64 l = left[e] ^ ((0 - (sd & 1)) & scw[j]);
+                size_t c = 2 * node * num_keys + j;
+                child_seeds[c] = l;
+                child_seeds[c + num_keys] = l ^ sd;
+                child_flags[c] = l & 1;
+                child_flags[c + num_keys] = (l ^ sd) & 1;
+            }
+        }
+        return;
+    }
+    for (size_t base = 0; base < entries; base += DPF_EXPAND_BATCH) {
+        size_t width = std::min(DPF_EXPAND_BATCH, entries - base);
+        prg_expand_batch(seeds + base, width, left, right, f_left, f_right);
+        size_t node = base / num_keys, j = base % num_keys;
+        for (size_t e = 0; e < width; e++, j++) {
+            if (j == num_keys) { j = 0; node++; }
+            uint8_t f = flags[base + e];
+            u64 mask = 0 - (u64)f;
+            size_t c = 2 * node * num_keys + j;
+            child_seeds[c] = left[e] ^ (mask & scw[j]);
+            child_seeds[c + num_keys] = right[e] ^ (mask & scw[j]);
+            child_flags[c] = f_left[e] ^ (f & fcw_0[j]);
+            child_flags[c + num_keys] = f_right[e] ^ (f & fcw_1[j]);
+        }
     }
+}
+
+// Working state of EvalFullBatch: the correction words of every key in structure-of-arrays
+// form (entry level * num_keys + j), plus the node buffers reused across leaf blocks.
+struct DPFBatchState {
+    std::span<const DPFKeyView> keys;
+    u64 domain_size;
+    int depth, block_level;
+    DPFEngine engine;
+    std::vector<u64> scw;
+    std::vector<uint8_t> fcw_0, fcw_1;
+    std::vector<u64> path_seeds, block_seeds[2];
+    std::vector<uint8_t> path_flags, block_flags[2];
+    std::span<int64_t* const> outputs;
+};
 
-    return value * key.sign;
+inline void eval_batch_block(DPFBatchState& st, const u64* seeds, const uint8_t* flags, u64 first_leaf) {
+    size_t B = st.keys.size();
+    size_t width = std::min<u64>(u64(1) << (st.depth - st.block_level), st.domain_size - first_leaf);
+    std::copy(seeds, seeds + B, st.block_seeds[0].begin());
+    std::copy(flags, flags + B, st.block_flags[0].begin());
+    int cur = 0;
+    for (int i = st.block_level; i < st.depth; i++) {
+        int below = st.depth - i;
+        size_t parents = ((width - 1) >> below) + 1;
+        dpf_expand_level_batch(st.engine, &st.scw[i * B], &st.fcw_0[i * B], &st.fcw_1[i * B], B,
+                               st.block_seeds[cur].data(), st.block_flags[cur].data(), parents,
+                               st.block_seeds[cur ^ 1].data(), st.block_flags[cur ^ 1].data());
+        cur ^= 1;
+    }
+    const u64* leaf_seeds = st.block_seeds[cur].data();
+    const uint8_t* leaf_flags = st.block_flags[cur].data();
+    for (size_t j = 0; j < B; j++) {
+        const DPFKeyView& k = st.keys[j];
+        int64_t* out = st.outputs[j] + first_leaf;
+        for (size_t n = 0; n < width; n++) {
+            u64 value = leaf_seeds[n * B + j] + (leaf_flags[n * B + j] ? (u64)k.FCW : 0);
+            out[n] = (int64_t)(k.sign > 0 ? value : 0 - value);
+        }
+    }
 }
 
-inline std::vector<int64_t> EvalFull(const DPFKey& k, u64 domain_size) {
-    std::vector<int64_t> result(domain_size);
-    for (u64 i=0; i<domain_size; i++) {
-        result[i] = evalDPF(k, i, domain_size);
+// Walks the top of the trees depth first. Children of a level-l node batch are written to
+// path slot l + 1 (lefts in [0, B), rights in [B, 2B)); deeper levels only write deeper
+// slots, so the rights are still intact when the left subtree is done.
+inline void eval_batch_subtree(DPFBatchState& st, int level, const u64* seeds, const uint8_t* flags, u64 first_leaf) {
+    if (first_leaf >= st.domain_size) return;
+    if (level == st.block_level) {
+        eval_batch_block(st, seeds, flags, first_leaf);
+        return;
     }
-    return result;
+    size_t B = st.keys.size();
+    u64* child_seeds = &st.path_seeds[(level + 1) * 2 * B];
+    uint8_t* child_flags = &st.path_flags[(level + 1) * 2 * B];
+    dpf_expand_level_batch(st.engine, &st.scw[level * B], &st.fcw_0[level * B], &st.fcw_1[level * B], B,
+                           seeds, flags, 1, child_seeds, child_flags);
+    u64 half = u64(1) << (st.depth - level - 1);
+    eval_batch_subtree(st, level + 1, child_seeds, child_flags, first_leaf);
+    eval_batch_subtree(st, level + 1, child_seeds + B, child_flags + B, first_leaf + half);
 }
 
-inline void write_key(std::ostream& out, const DPFKey& key) {
-    out.write(reinterpret_cast<const char*>(&key.s_root), sizeof(key.s_root));
-    out.write(reinterpret_cast<const char*>(&key.f_root), sizeof(key.f_root));
-    out.write(reinterpret_cast<const char*>(&key.FCW), sizeof(key.FCW));
-    out.write(reinterpret_cast<const char*>(&key.sign), sizeof(key.sign));
-    
-    size_t cw_size = key.cws.size();
-    out.write(reinterpret_cast<const char*>(&cw_size), sizeof(cw_size));
-    if (cw_size > 0) {
-        out.write(reinterpret_cast<const char*>(key.cws.data()), cw_size * sizeof(CorrectionWord));
-    }
-}
-
-inline DPFKey read_key(std::istream& in) {
-    DPFKey key;
-    in.read(reinterpret_cast<char*>(&key.s_root), sizeof(key.s_root));
-    in.read(reinterpret_cast<char*>(&key.f_root), sizeof(key.f_root));
-    in.read(reinterpret_cast<char*>(&key.FCW), sizeof(key.FCW));
-    in.read(reinterpret_cast<char*>(&key.sign), sizeof(key.sign));
-    
-    size_t cw_size;
-    in.read(reinterpret_cast<char*>(&cw_size), sizeof(cw_size));
-    key.cws.resize(cw_size);
-    if (cw_size > 0) {
-        in.read(reinterpret_cast<char*>(key.cws.data()), cw_size * sizeof(CorrectionWord));
+// Evaluates every key of a batch on [0, domain_size), writing key j's outputs to
+// outputs[j][0, domain_size). All keys must have the depth of domain_size and the same
+// engine. The trees are
+// walked in lockstep, so each PRG call expands the same node position of every key.
+inline void EvalFullBatch(std::span<const DPFKeyView> keys, u64 domain_size, std::span<int64_t* const> outputs) {
+    if (keys.empty() || domain_size == 0) return;
+    if (outputs.size() != keys.size()) {
+        throw std::invalid_argument("EvalFullBatch: one output buffer is needed per key");
     }
-    return key;
+    int depth = dpf_depth(domain_size);
+    for (const DPFKeyView& k : keys) {
+        if (k.depth != depth) throw std::invalid_argument("EvalFullBatch: key depth does not match domain size");
+        if (k.engine != keys[0].engine) throw std::invalid_argument("EvalFullBatch: keys use different DPF engines");
+    }
+
+    size_t B = keys.size();
+    DPFBatchState st;
+    st.keys = keys;
+    st.domain_size = domain_size;
+    st.depth = depth;
+    st.engine = keys[0].engine;
+    st.block_level = std::max(0, depth - DPF_LEAF_BLOCK_BITS);
+    st.outputs = outputs;
+    st.scw.resize(depth * B);
+    st.fcw_0.resize(depth * B);
+    st.fcw_1.resize(depth * B);
+    for (int i = 0; i < depth; i++) {
+        for (size_t j = 0; j < B; j++) {
+            st.scw[i * B + j] = keys[j].cws[i].scw;
+            st.fcw_0[i * B + j] = keys[j].cws[i].fcw_0;
+            st.fcw_1[i * B + j] = keys[j].cws[i].fcw_1;
+        }
+    }
+    st.path_seeds.resize((st.block_level + 1) * 2 * B);
+    st.path_flags.resize((st.block_level + 1) * 2 * B);
+    for (int c = 0; c < 2; c++) {
+        st.block_seeds[c].resize(DPF_LEAF_BLOCK * B);
+        st.block_flags[c].resize(DPF_LEAF_BLOCK * B);
+    }
+    for (size_t j = 0; j < B; j++) {
+        st.path_seeds[j] = keys[j].s_root;
+        st.path_flags[j] = keys[j].f_root;
+    }
+    eval_batch_subtree(st, 0, st.path_seeds.data(), st.path_flags.data(), 0);
+}
+
+// Share arithmetic wraps mod 2^64 and runs on the kernels in simd.hpp. The value-returning
+// forms allocate their result; the output-buffer forms only grow `out` when its capacity
+// is too small, and `out` may be one of the inputs.
+inline void vec_add(const ShareVec& a, const ShareVec& b, ShareVec& out) {
+    out.resize(a.size());
+    share_add(out.data(), a.data(), b.data(), a.size());
+}
+
+inline void vec_sub(const ShareVec& a, const ShareVec& b, ShareVec& out) {
+    out.resize(a.size());
+    share_sub(out.data(), a.data(), b.data(), a.size());
+}
+
+inline void vec_scalar_mul(const ShareVec& a, int64_t scalar, ShareVec& out) {
+    out.resize(a.size());
+    share_scalar_mul(out.data(), a.data(), scalar, a.size());
+}
+
+// acc += a * scalar
+inline void vec_scalar_mul_add(ShareVec& acc, const ShareVec& a, int64_t scalar) {
+    share_scalar_mul_add(acc.data(), a.data(), scalar, a.size());
 }
 
 inline ShareVec vec_add(const ShareVec& a, const ShareVec& b) {
-    ShareVec result(a.size());
-    for (size_t i = 0; i < a.size(); ++i) result[i] = a[i] + b[i];
+    ShareVec result;
+    vec_add(a, b, result);
     return result;
 }
 
 inline ShareVec vec_sub(const ShareVec& a, const ShareVec& b) {
-    ShareVec result(a.size());
-    for (size_t i = 0; i < a.size(); ++i) result[i] = a[i] - b[i];
+    ShareVec result;
+    vec_sub(a, b, result);
     return result;
 }
 
-inline int64_t vec_dot_product(const ShareVec& a, const ShareVec& b) {
-    int64_t result = 0;
-    for (size_t i = 0; i < a.size(); ++i) result += a[i] * b[i];
-    return result;
+inline int64_t vec_dot_product(std::span<const int64_t> a, std::span<const int64_t> b) {
+    return share_dot(a.data(), b.data(), a.size());
 }
 
 inline ShareVec vec_scalar_mul(const ShareVec& a, int64_t scalar) {
-    ShareVec result(a.size());
-    for (size_t i = 0; i < a.size(); ++i) result[i] = a[i] * scalar;
+    ShareVec result;
+    vec_scalar_mul(a, scalar, result);
     return result;
 }
 
+// Share vector whose storage comes from a QueryArena.
+using ArenaVec = std::pmr::vector<int64_t>;
+
+// Scratch memory for one query. Temporaries are bump-allocated from a buffer, and reset()
+// frees them all at once between queries. If a query needs more than the buffer holds, the
+// overflow goes to the global allocator and the next reset() grows the buffer to cover it.
+// Once the buffer fits the largest query, a query makes no calls to the global allocator.
+class QueryArena {
+public:
+    explicit QueryArena(size_t initial_bytes = size_t(1) << 16) : capacity(initial_bytes) { rebuild(); }
+
+    QueryArena(const QueryArena&) = delete;
+    QueryArena& operator=(const QueryArena&) = delete;
+
+    std::pmr::memory_resource* resource() { return &*arena; }
+
+    // Frees everything allocated since the last reset. No arena allocation may be live.
+    void reset() {
+        if (overflow.bytes == 0) {
+            arena->release();
+            return;
+        }
+        capacity += overflow.bytes;
+        rebuild();
+    }
+
+    size_t size() const { return capacity; }
+
+private:
+    // Upstream of the arena: forwards to the global allocator and counts what it hands out.
+    struct OverflowCounter : std::pmr::memory_resource {
+        size_t bytes = 0;
+        void* do_allocate(size_t n, size_t align) override {
+            bytes += n;
+            return std::pmr::new_delete_resource()->allocate(n, align);
+        }
+        void do_deallocate(void* p, size_t n, size_t align) override {
+            std::pmr::new_delete_resource()->deallocate(p, n, align);
+        }
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+    };
+
+    void rebuild() {
+        arena.reset();
+        overflow.bytes = 0;
+        storage = std::make_unique<std::byte[]>(capacity);
+        arena.emplace(storage.get(), capacity, &overflow);
+    }
+
+    size_t capacity;
+    std::unique_ptr<std::byte[]> storage;
+    OverflowCounter overflow;
+    std::optional<std::pmr::monotonic_buffer_resource> arena;
+};
+
+// Width of the share ring, and so of every word sent by send_value()/send_vector(). Both
+// ends of a link must agree on it: P0 and P1 switch to the configured width only after the
+// parameter handshake with P2, which is sent at the initial 64 bits.
+inline uint32_t& share_ring_bits() {
+    static uint32_t bits = 64;
+    return bits;
+}
+
+// Every transfer below is a single coroutine frame: none of them awaits another coroutine,
+// only Asio operations. Asio recycles just one awaitable frame per thread, so each level of
+// nesting would cost a heap allocation per transfer. Each vector goes out as its length
+// followed by its words, and send_vectors()/recv_vectors() move several vectors (e.g. a
+// multiplication's masked pair) in one frame and one write.
+
+// Every transfer also reports its bytes to traffic_metrics(), as one message on the link of
+// the socket. A send is traced at the time it was issued, a receive when it completed.
+inline void count_sent(tcp::socket& sock, size_t bytes, TraceRecorder::Clock::time_point issued) {
+    traffic_metrics().on_send(sock.native_handle(), bytes, issued);
+}
+inline void count_received(tcp::socket& sock, size_t bytes) { traffic_metrics().on_receive(sock.native_handle(), bytes); }
+
+// Words per write when narrowing to 32 bits. The staging buffer lives in the coroutine frame,
+// so concurrent transfers on one thread never share it; it is kept small because every
+// frame of send_vectors() carries it.
+constexpr size_t NARROW_CHUNK_WORDS = 256;
+
+// Sign-extends n 32-bit words read into the front of `words` to full words, from the back so
+// that nothing is overwritten before it is read.
+inline void widen_in_place(int64_t* words, size_t n) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(words);
+    for (size_t i = n; i-- > 0;) {
+        uint32_t word;
+        std::memcpy(&word, bytes + i * sizeof(uint32_t), sizeof(word));
+        words[i] = Z2_32::from_word(word).to_signed();
+    }
+}
+
 awaitable<void> send_value(tcp::socket& sock, int64_t value) {
-    auto buffer = boost::asio::buffer(&value, sizeof(value));
-    co_await boost::asio::async_write(sock, buffer, use_awaitable);
+    auto issued = TraceRecorder::Clock::now();
+    if (share_ring_bits() == 32) {
+        uint32_t word = Z2_32(value).value;
+        co_await boost::asio::async_write(sock, boost::asio::buffer(&word, sizeof(word)), use_awaitable);
+    } else {
+        co_await boost::asio::async_write(sock, boost::asio::buffer(&value, sizeof(value)), use_awaitable);
+    }
+    count_sent(sock, share_ring_bits() / 8, issued);
 }
 
 awaitable<int64_t> recv_value(tcp::socket& sock) {
-    int64_t value;
-    auto buffer = boost::asio::buffer(&value, sizeof(value));
-    co_await boost::asio::async_read(sock, buffer, use_awaitable);
+    int64_t value = 0;
+    if (share_ring_bits() == 32) {
+        co_await boost::asio::async_read(sock, boost::asio::buffer(&value, sizeof(uint32_t)), use_awaitable);
+        widen_in_place(&value, 1);
+    } else {
+        co_await boost::asio::async_read(sock, boost::asio::buffer(&value, sizeof(value)), use_awaitable);
+    }
+    count_received(sock, share_ring_bits() / 8);
     co_return value;
 }
 
-awaitable<void> send_vector(tcp::socket& sock, const std::vector<int64_t>& vec) {
-    int64_t size = vec.size();
-    co_await send_value(sock, size);
-    if (size > 0) {
-        auto buffer = boost::asio::buffer(vec.data(), size * sizeof(int64_t));
-        co_await boost::asio::async_write(sock, buffer, use_awaitable);
+template <size_t N>
+awaitable<void> send_vectors(tcp::socket& sock, std::array<std::span<const int64_t>, N> vecs) {
+    auto issued = TraceRecorder::Clock::now();
+    if (share_ring_bits() == 32) {
+        uint32_t staging[NARROW_CHUNK_WORDS];
+        size_t used = 0;
+        for (std::span<const int64_t> vec : vecs) {
+            for (size_t done = 0, total = vec.size() + 1; done < total;) {
+                if (used == NARROW_CHUNK_WORDS) {
+                    co_await boost::asio::async_write(sock, boost::asio::buffer(staging), use_awaitable);
+                    used = 0;
+                }
+                if (done == 0) {
+                    staging[used++] = Z2_32((int64_t)vec.size()).value;
+                    done = 1;
+                    continue;
+                }
+                size_t take = std::min(total - done, NARROW_CHUNK_WORDS - used);
+                ring_encode(vec.data() + done - 1, take, staging + used);
+                used += take;
+                done += take;
+            }
+        }
+        co_await boost::asio::async_write(sock, boost::asio::buffer(staging, used * sizeof(uint32_t)), use_awaitable);
+    } else {
+        std::array<int64_t, N> sizes;
+        std::array<boost::asio::const_buffer, 2 * N> buffers;
+        for (size_t v = 0; v < N; ++v) {
+            sizes[v] = vecs[v].size();
+            buffers[2 * v] = boost::asio::buffer(&sizes[v], sizeof(int64_t));
+            buffers[2 * v + 1] = boost::asio::buffer(vecs[v].data(), vecs[v].size() * sizeof(int64_t));
+        }
+        co_await boost::asio::async_write(sock, buffers, use_awaitable);
     }
+    size_t words = 0;
+    for (std::span<const int64_t> vec : vecs) words += vec.size() + 1;
+    count_sent(sock, words * (share_ring_bits() / 8), issued);
 }
 
-awaitable<std::vector<int64_t>> recv_vector(tcp::socket& sock) {
-    int64_t size = co_await recv_value(sock);
-    std::vector<int64_t> vec(size);
-    if (size > 0) {
-        auto buffer = boost::asio::buffer(vec.data(), size * sizeof(int64_t));
-        co_await boost::asio::async_read(sock, buffer, use_awaitable);
+// Receives into existing buffers, which only reallocate if they are too small. Any
+// allocator works, so the buffers can come from a QueryArena.
+template <typename Alloc, size_t N>
+awaitable<void> recv_vectors(tcp::socket& sock, std::array<std::vector<int64_t, Alloc>*, N> vecs) {
+    size_t word_bytes = share_ring_bits() / 8;
+    size_t words = 0;
+    for (std::vector<int64_t, Alloc>* vec : vecs) {
+        int64_t size = 0;
+        co_await boost::asio::async_read(sock, boost::asio::buffer(&size, word_bytes), use_awaitable);
+        if (word_bytes == sizeof(uint32_t)) widen_in_place(&size, 1);
+        vec->resize(size);
+        if (size > 0) {
+            co_await boost::asio::async_read(sock, boost::asio::buffer(vec->data(), size * word_bytes), use_awaitable);
+            if (word_bytes == sizeof(uint32_t)) widen_in_place(vec->data(), size);
+        }
+        words += size + 1;
     }
+    count_received(sock, words * word_bytes);
+}
+
+// The single-vector forms return the batched coroutine directly rather than awaiting it,
+// so they add no frame of their own.
+inline awaitable<void> send_vector(tcp::socket& sock, std::span<const int64_t> vec) {
+    return send_vectors<1>(sock, {vec});
+}
+
+template <typename Alloc>
+awaitable<void> recv_vector(tcp::socket& sock, std::vector<int64_t, Alloc>& vec) {
+    return recv_vectors<Alloc, 1>(sock, {&vec});
+}
+
+awaitable<std::vector<int64_t>> recv_vector(tcp::socket& sock) {
+    std::vector<int64_t> vec;
+    co_await recv_vector(sock, vec);
     co_return vec;
 }
 
+// Clock pings for aligning the parties' traces. Each ping is a raw 64-bit word each way,
+// whatever the ring width, so they can run before or after the parameter handshake. Both
+// ends must run the same number of pings; the client keeps the sample with the shortest
+// round trip, whose midpoint is closest to the moment the server read its clock.
+constexpr int CLOCK_SYNC_PINGS = 8;
+
+awaitable<void> clock_sync_client(tcp::socket& sock, Link link, const char* server) {
+    ClockSample best;
+    for (int ping = 0; ping < CLOCK_SYNC_PINGS; ++ping) {
+        ClockSample sample{LINK_NAMES[(size_t)link], server};
+        auto issued = TraceRecorder::Clock::now();
+        sample.client_send = TraceRecorder::nanos(issued);
+        co_await boost::asio::async_write(sock, boost::asio::buffer(&sample.client_send, sizeof(int64_t)), use_awaitable);
+        co_await boost::asio::async_read(sock, boost::asio::buffer(&sample.server_time, sizeof(int64_t)), use_awaitable);
+        sample.client_recv = TraceRecorder::nanos(TraceRecorder::Clock::now());
+        count_sent(sock, sizeof(int64_t), issued);
+        count_received(sock, sizeof(int64_t));
+        if (ping == 0 || sample.round_trip() < best.round_trip()) best = sample;
+    }
+    trace_recorder().add_clock_sample(best);
+}
+
+awaitable<void> clock_sync_server(tcp::socket& sock) {
+    for (int ping = 0; ping < CLOCK_SYNC_PINGS; ++ping) {
+        int64_t client_time;
+        co_await boost::asio::async_read(sock, boost::asio::buffer(&client_time, sizeof(int64_t)), use_awaitable);
+        count_received(sock, sizeof(int64_t));
+        auto issued = TraceRecorder::Clock::now();
+        int64_t server_time = TraceRecorder::nanos(issued);
+        co_await boost::asio::async_write(sock, boost::asio::buffer(&server_time, sizeof(int64_t)), use_awaitable);
+        count_sent(sock, sizeof(int64_t), issued);
+    }
+}
+
+// Says which counters MPC_PERF could open; call after register_thread() on the main thread.
+inline void log_perf_counters_status() {
+    if (!perf_counters().on()) return;
+    std::string opened, missing;
+    for (size_t e = 0; e < PERF_EVENT_COUNT; e++) {
+        std::string& list = perf_counters().available((PerfEvent)e) ? opened : missing;
+        list += list.empty() ? "" : ", ";
+        list += PERF_EVENT_NAMES[e];
+    }
+    LOG_INFO("Performance counters: %s", opened.empty() ? "none" : opened.c_str());
+    if (!missing.empty()) LOG_WARN("Performance counters not available here: %s", missing.c_str());
+}
+
+// Debug line with the allocations of the query that just ended, when MPC_ALLOC is set.
+inline void log_query_memory(size_t query_idx) {
+    if (!alloc_stats().on()) return;
+    const AllocCounts& allocs = phase_metrics().last_query_allocs();
+    LOG_DEBUG("Query %zu memory: %llu allocations, %llu frees, %llu B requested", query_idx,
+              (unsigned long long)allocs.allocations, (unsigned long long)allocs.frees,
+              (unsigned long long)allocs.bytes);
+}
+
+// Allocations per query over the run, and the heap and resident peaks.
+inline void log_run_memory(size_t num_queries) {
+    if (!alloc_stats().on()) return;
+    if (num_queries > 0) {
+        const AllocCounts& allocs = phase_metrics().run_allocs(Phase::Query);
+        LOG_INFO("Memory per query: %.1f allocations, %.1f B requested", (double)allocs.allocations / num_queries,
+                 (double)allocs.bytes / num_queries);
+    }
+    LOG_INFO("Peak heap in a query: %lld B; peak resident size: %llu B",
+             (long long)phase_metrics().peak_heap_bytes(Phase::Query), (unsigned long long)phase_metrics().run_peak_rss_bytes());
+}
+
+inline void log_traffic(const char* label, Link link, const TrafficCounters& c, bool debug) {
+    const char* format = "%s %s: sent %llu B in %llu messages, received %llu B in %llu messages, %llu rounds";
+    auto sent = (unsigned long long)c.bytes_sent, received = (unsigned long long)c.bytes_received;
+    auto messages_sent = (unsigned long long)c.messages_sent, messages_received = (unsigned long long)c.messages_received;
+    auto rounds = (unsigned long long)c.rounds;
+    if (debug) {
+        LOG_DEBUG(format, label, LINK_NAMES[(size_t)link], sent, messages_sent, received, messages_received, rounds);
+    } else {
+        LOG_INFO(format, label, LINK_NAMES[(size_t)link], sent, messages_sent, received, messages_received, rounds);
+    }
+}
+
+// Debug lines with the traffic of the query that just ended, one per link.
+inline void log_query_traffic(size_t query_idx) {
+    char label[48];
+    std::snprintf(label, sizeof(label), "Query %zu traffic", query_idx);
+    for (size_t link = 0; link < LINK_COUNT; link++) {
+        const TrafficCounters& counters = traffic_metrics().last_query()[link];
+        if (!counters.empty()) log_traffic(label, (Link)link, counters, true);
+    }
+}
+
+// Run totals per link, setup included, and the mean per query.
+inline void log_run_traffic(size_t num_queries) {
+    for (size_t link = 0; link < LINK_COUNT; link++) {
+        TrafficCounters total = traffic_metrics().run_total((Link)link);
+        if (total.empty()) continue;
+        log_traffic("Traffic", (Link)link, total, false);
+        if (num_queries > 0) {
+            TrafficCounters queries = traffic_metrics().query_total((Link)link);
+            LOG_INFO("Traffic %s per query: %.1f B sent, %.1f B received, %.1f rounds", LINK_NAMES[link],
+                     (double)queries.bytes_sent / num_queries, (double)queries.bytes_received / num_queries,
+                     (double)queries.rounds / num_queries);
+        }
+    }
+}
+
 awaitable<int64_t> exchange_value(tcp::socket& peer_sock, int64_t value, int ROLE) {
     int64_t other_value;
     if (ROLE == 0) {
@@ -290,20 +1277,26 @@ struct Query {
     uint32_t user_index;
     int64_t item_share;
     DPFKey dpf_key;
+    PackedDPFKey packed_key;  // Used instead of dpf_key when the queries carry packed keys.
 };
 
-inline std::vector<Query> read_queries(const std::string& filename) {
+inline std::vector<Query> read_queries(const std::string& filename, uint32_t pack_bits = 0) {
     std::ifstream in(filename, std::ios::binary);
     if (!in) {
         std::cerr << "Cannot open file for reading: " << filename << std::endl;
         exit(1);
     }
+    read_query_file_header(in, filename, pack_bits);
     std::vector<Query> queries;
     while (in.peek() != EOF) {
         Query q;
         in.read(reinterpret_cast<char*>(&q.user_index), sizeof(q.user_index));
         in.read(reinterpret_cast<char*>(&q.item_share), sizeof(q.item_share));
-        q.dpf_key = read_key(in);
+        if (pack_bits > 0) {
+            q.packed_key = read_packed_key(in);
+        } else {
+            q.dpf_key = read_key(in);
+        }
         if (in.gcount() > 0) {
              queries.push_back(q);
         }
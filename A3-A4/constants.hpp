@@ -1,9 +1,20 @@
 #pragma once
 
-// Hardcoded constants for the MPC protocol
-// Modify these values as needed
+#include <cstdint>
+
+// Default parameters for the MPC protocol
+// Each can be overridden at runtime; see params.hpp
 constexpr uint32_t M = 10;  // Number of users
 constexpr uint32_t N = 50;  // Number of items
 constexpr uint32_t K = 3;  // Number of features
 constexpr uint32_t Q = 10; // Number of queries
 
+// Item-update DPF packing: 2^DPF_PACK_BITS items per DPF leaf (0 = one item per leaf).
+// Default for the pack_bits parameter (see params.hpp); fixed when the queries are generated.
+constexpr uint32_t DPF_PACK_BITS = 0;
+constexpr uint32_t DPF_MAX_PACK_BITS = 4;  // Largest pack_bits the packed keys support.
+
+// Share ring Z_2^SHARE_RING_BITS (32 or 64). Default for the ring_bits parameter. It only
+// sets the wire format: with 32, shares go over the network as 32-bit words, but are still
+// held in 64-bit words in memory.
+constexpr uint32_t SHARE_RING_BITS = 64;
@@ -0,0 +1,416 @@
+#pragma once
+
+// The DPF core shared by the parties (common.hpp) and the local tools (utils.hpp): key types,
+// key generation for both engines and the packed keys, single-point evaluation, and the key
+// file format. Like prg.hpp it needs no Boost, so gen_queries and check_correctness build
+// without it. The full-domain evaluators live with their users: the parties' streaming and
+// multi-threaded ones in common.hpp, the simple per-index loop in utils.hpp.
+
+#include "constants.hpp"
+#include "prg.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+using u64 = uint64_t;
+using ShareVec = std::vector<int64_t>;
+using ShareMat = std::vector<ShareVec>;
+
+struct ChildSeed {
+    u64 s_left, s_right;
+    bool f_left, f_right;
+};
+
+struct CorrectionWord {
+    u64 scw;
+    bool fcw_0;
+    bool fcw_1;
+};
+
+// Tree construction a key was generated with. Both engines share the key layout and the
+// additive leaf conversion, so keys of either kind go through the same evaluators.
+enum class DPFEngine : uint8_t {
+    BGI = 0,       // Two PRG blocks per node, separate child control bits.
+    HalfTree = 1,  // One hash per node; right child = left child ^ parent, control bit = lsb.
+};
+
+struct DPFKey {
+    u64 s_root;
+    bool f_root;
+    std::vector<CorrectionWord> cws;
+    int64_t FCW;
+    int sign;
+    DPFEngine engine = DPFEngine::BGI;
+};
+
+// Early-termination DPF: the tree stops pack_bits levels above the items and each leaf
+// seed is converted into a block of 2^pack_bits ring elements, so N items need only
+// N / 2^pack_bits leaves. Every element of a block has its own final correction word.
+struct PackedDPFKey {
+    DPFKey tree;                      // Tree part; tree.FCW is unused.
+    uint32_t pack_bits = 0;
+    std::vector<int64_t> FCW;         // 2^pack_bits final correction words.
+    std::vector<int64_t> slot_share;  // Additive share of e_(index mod 2^pack_bits).
+};
+
+inline int8_t random_int8() {
+    static std::random_device rd;
+    static std::mt19937 gen(rd());
+    static std::uniform_int_distribution<int16_t> dis(-128, 127);
+    return (int8_t)dis(gen);
+}
+
+inline int32_t random_int32() {
+    static std::random_device rd;
+    static std::mt19937 gen(rd());
+    static std::uniform_int_distribution<int32_t> dis(-128, 127);
+    return dis(gen);
+}
+
+inline uint8_t random_uint8() {
+    static std::random_device rd;
+    static std::mt19937 gen(rd());
+    static std::uniform_int_distribution<uint8_t> dis;
+    return dis(gen);
+}
+
+inline uint32_t random_uint32() {
+    static std::random_device rd;
+    static std::mt19937 gen(rd());
+    static std::uniform_int_distribution<uint32_t> dis;
+    return dis(gen);
+}
+
+inline u64 random_uint64() {
+    static std::random_device rd;
+    static std::mt19937_64 gen(((u64)rd() << 32) | rd());
+    return gen();
+}
+
+// One-node expansion through the fixed-key AES PRG in prg.hpp.
+inline ChildSeed PRG(u64 seed) {
+    u64 left, right;
+    uint8_t f_left, f_right;
+    prg_expand_batch(&seed, 1, &left, &right, &f_left, &f_right);
+    return {left, right, f_left != 0, f_right != 0};
+}
+
+// Half-tree left child of `seed` on a level with correction word `scw`; the right child
+// is the returned value XOR `seed`.
+inline u64 halftree_left(u64 seed, u64 scw) {
+    u64 h;
+    prg_hash_batch(&seed, 1, &h);
+    return h ^ ((seed & 1) ? scw : 0);
+}
+
+inline std::mt19937& get_prg_engine() {
+    static std::random_device rd;
+    static std::mt19937 engine(rd());
+    return engine;
+}
+
+inline int dpf_depth(u64 domain_size) {
+    int depth = (domain_size == 0) ? 0 : ceil(log2(domain_size));
+    return depth == 0 ? 1 : depth;
+}
+
+inline int64_t dpf_leaf_value(const DPFKey& key, u64 seed, bool flag) {
+    u64 value = seed + (flag ? (u64)key.FCW : 0);
+    return (int64_t)(key.sign > 0 ? value : 0 - value);
+}
+
+// Sign and additive final correction word shared by both engines, from the two parties'
+// leaf seeds and control bits on the path to the target index.
+inline void set_final_correction(DPFKey& k0, DPFKey& k1, u64 s0, bool f0, u64 s1, bool f1, int64_t value) {
+    int64_t R = random_int8();
+
+    k0.sign = f0 * 1 + (1-f0) * (-1);
+    k1.sign = f1 * 1 + (1-f1) * (-1);
+
+    // Leaf seeds are full 64-bit words, so the final correction is computed mod 2^64.
+    u64 s0_signed = (k0.sign > 0) ? s0 : 0 - s0;
+    u64 s1_signed = (k1.sign > 0) ? s1 : 0 - s1;
+    k0.FCW = (int64_t)((u64)R + s0_signed);
+    k1.FCW = (int64_t)((u64)value - (u64)R + s1_signed);
+}
+
+// Half-tree key generation. The parties' seeds differ by a global offset delta (odd, so
+// their control bits differ) on the path and agree everywhere else. Each level needs one
+// hash per party: with h_b = H(s_b) and cw = h_0 ^ h_1 ^ (bit ? 0 : delta), the left
+// children differ by (bit ? 0 : delta) and the right children (left ^ parent) by the rest.
+inline std::pair<DPFKey, DPFKey> generateHalfTreeDPF(u64 index, int64_t value, int depth) {
+    DPFKey k0, k1;
+    k0.engine = k1.engine = DPFEngine::HalfTree;
+
+    u64 delta = random_uint64() | 1;
+    u64 s0_curr = random_uint64();
+    u64 s1_curr = s0_curr ^ delta;
+    k0.s_root = s0_curr;
+    k1.s_root = s1_curr;
+    k0.f_root = s0_curr & 1;
+    k1.f_root = s1_curr & 1;
+
+    for (int i = 0; i < depth; i++) {
+        bool path_bit = (index >> (depth - 1 - i)) & 1;
+        u64 h0, h1;
+        prg_hash_batch(&s0_curr, 1, &h0);
+        prg_hash_batch(&s1_curr, 1, &h1);
+        CorrectionWord cw;
+        cw.scw = h0 ^ h1 ^ (path_bit ? 0 : delta);
+        cw.fcw_0 = cw.fcw_1 = false;
+        u64 left0 = h0 ^ ((s0_curr & 1) ? cw.scw : 0);
+        u64 left1 = h1 ^ ((s1_curr & 1) ? cw.scw : 0);
+        s0_curr = path_bit ? left0 ^ s0_curr : left0;
+        s1_curr = path_bit ? left1 ^ s1_curr : left1;
+        k0.cws.push_back(cw); k1.cws.push_back(cw);
+    }
+
+    set_final_correction(k0, k1, s0_curr, s0_curr & 1, s1_curr, s1_curr & 1, value);
+    return {k0, k1};
+}
+
+inline std::pair<DPFKey, DPFKey> generateDPF(u64 index, int64_t value, u64 domain_size,
+                                             DPFEngine engine = DPFEngine::BGI) {
+    int depth = dpf_depth(domain_size);
+    if (engine == DPFEngine::HalfTree) return generateHalfTreeDPF(index, value, depth);
+
+    DPFKey k0, k1;
+
+    u64 s0_curr = random_uint64();
+    u64 s1_curr = random_uint64();
+    bool f0_curr = 0;
+    bool f1_curr = 1;
+
+    k0.s_root = s0_curr;
+    k1.s_root = s1_curr;
+    k0.f_root = f0_curr;
+    k1.f_root = f1_curr;
+
+    for(int i=0;i<depth;i++) {
+        ChildSeed c0 = PRG(s0_curr);
+        ChildSeed c1 = PRG(s1_curr);
+        bool path_bit = (index >> (depth - 1 - i)) & 1;
+        bool f0_next, f1_next;
+        CorrectionWord cw;
+
+        if (path_bit == 0) {
+            cw.scw = c0.s_right ^ c1.s_right;
+            cw.fcw_1 = c0.f_right ^ c1.f_right;
+            cw.fcw_0 = c0.f_left ^ c1.f_left ^ 1;
+            s0_curr = c0.s_left; s1_curr = c1.s_left;
+            f0_next = c0.f_left; f1_next = c1.f_left;
+        } else {
+            cw.scw = c0.s_left ^ c1.s_left;
+            cw.fcw_0 = c0.f_left ^ c1.f_left;
+            cw.fcw_1 = c0.f_right ^ c1.f_right ^ 1;
+            s0_curr = c0.s_right; s1_curr = c1.s_right;
+            f0_next = c0.f_right; f1_next = c1.f_right;
+        }
+        if (f0_curr) {
+            s0_curr ^= cw.scw;
+            f0_next ^= (path_bit == 0) ? cw.fcw_0 : cw.fcw_1;
+        }
+        if (f1_curr) {
+            s1_curr ^= cw.scw;
+            f1_next ^= (path_bit == 0) ? cw.fcw_0 : cw.fcw_1;
+        }
+        f0_curr = f0_next; f1_curr = f1_next;
+        k0.cws.push_back(cw); k1.cws.push_back(cw);
+    }
+
+    set_final_correction(k0, k1, s0_curr, f0_curr, s1_curr, f1_curr, value);
+    return {k0, k1};
+}
+
+// Walks from the root to leaf `index` of a depth-`depth` tree and returns its seed and
+// control bit.
+inline std::pair<u64, bool> dpf_walk(const DPFKey& key, u64 index, int depth) {
+    u64 s_curr = key.s_root;
+    bool f_curr = key.f_root;
+
+    if (key.engine == DPFEngine::HalfTree) {
+        for (int i = 0; i < depth; i++) {
+            bool path_bit = (index >> (depth - 1 - i)) & 1;
+            u64 left = halftree_left(s_curr, key.cws[i].scw);
+            s_curr = path_bit ? left ^ s_curr : left;
+        }
+        f_curr = s_curr & 1;
+    } else {
+        for (int i = 0; i < depth; i++) {
+            ChildSeed ch = PRG(s_curr);
+            bool path_bit = (index >> (depth - 1 - i)) & 1;
+            bool f_next;
+            if(path_bit == 0){ s_curr = ch.s_left; f_next = ch.f_left; }
+            else { s_curr = ch.s_right; f_next = ch.f_right; }
+            if(f_curr){
+                s_curr ^= key.cws[i].scw;
+                f_next ^= (path_bit == 0) ? key.cws[i].fcw_0 : key.cws[i].fcw_1;
+            }
+            f_curr = f_next;
+        }
+    }
+    return {s_curr, f_curr};
+}
+
+inline int64_t evalDPF(const DPFKey& key, u64 index, u64 domain_size) {
+    auto [seed, flag] = dpf_walk(key, index, dpf_depth(domain_size));
+    return dpf_leaf_value(key, seed, flag);
+}
+
+// Block of a packed leaf: element i is sign * (conv(seed)[i] + flag * FCW[i]), where
+// conv(seed) = words comes from prg_convert_batch().
+inline void packed_leaf_values(const PackedDPFKey& key, const u64* words, bool flag, int64_t* out) {
+    size_t width = size_t(1) << key.pack_bits;
+    u64 mask = 0 - (u64)flag;
+    for (size_t i = 0; i < width; i++) {
+        u64 value = words[i] + ((u64)key.FCW[i] & mask);
+        out[i] = (int64_t)(key.tree.sign > 0 ? value : 0 - value);
+    }
+}
+
+// Packed keys for value at `index`. The tree is an ordinary DPF of either engine over the
+// leaf index >> pack_bits; the final correction words then program `value` into slot
+// index mod 2^pack_bits of the target block and cancel every other element.
+inline std::pair<PackedDPFKey, PackedDPFKey> generatePackedDPF(u64 index, int64_t value, u64 domain_size,
+                                                               uint32_t pack_bits,
+                                                               DPFEngine engine = DPFEngine::BGI) {
+    if (pack_bits == 0 || pack_bits > DPF_MAX_PACK_BITS) {
+        throw std::invalid_argument("generatePackedDPF: pack_bits must be in [1, DPF_MAX_PACK_BITS]");
+    }
+    size_t width = size_t(1) << pack_bits;
+    u64 num_leaves = (domain_size + width - 1) >> pack_bits;
+    u64 leaf = index >> pack_bits;
+    size_t slot = index & (width - 1);
+
+    auto [t0, t1] = generateDPF(leaf, 0, num_leaves, engine);
+    int depth = dpf_depth(num_leaves);
+    auto [s0, f0] = dpf_walk(t0, leaf, depth);
+    auto [s1, f1] = dpf_walk(t1, leaf, depth);
+    t0.FCW = t1.FCW = 0;
+
+    PackedDPFKey k0{t0, pack_bits, ShareVec(width), ShareVec(width)};
+    PackedDPFKey k1{t1, pack_bits, ShareVec(width), ShareVec(width)};
+    std::vector<u64> c0(width), c1(width);
+    prg_convert_batch(&s0, 1, width, c0.data());
+    prg_convert_batch(&s1, 1, width, c1.data());
+    // The masks are uniform over the whole word: a narrower one would leave the slot's share
+    // distributed differently from the others and give away index mod 2^pack_bits.
+    for (size_t i = 0; i < width; i++) {
+        u64 R = random_uint64();
+        u64 c0_signed = (t0.sign > 0) ? c0[i] : 0 - c0[i];
+        u64 c1_signed = (t1.sign > 0) ? c1[i] : 0 - c1[i];
+        k0.FCW[i] = (int64_t)(R + c0_signed);
+        k1.FCW[i] = (int64_t)((i == slot ? (u64)value : 0) - R + c1_signed);
+        u64 mask = random_uint64();
+        k0.slot_share[i] = (int64_t)mask;
+        k1.slot_share[i] = (int64_t)((u64)(i == slot) - mask);
+    }
+    return {k0, k1};
+}
+
+inline int64_t evalPackedDPF(const PackedDPFKey& key, u64 index) {
+    size_t width = size_t(1) << key.pack_bits;
+    auto [seed, flag] = dpf_walk(key.tree, index >> key.pack_bits, key.tree.cws.size());
+    std::vector<u64> words(width);
+    std::vector<int64_t> values(width);
+    prg_convert_batch(&seed, 1, width, words.data());
+    packed_leaf_values(key, words.data(), flag, values.data());
+    return values[index & (width - 1)];
+}
+
+inline void write_key(std::ostream& out, const DPFKey& key) {
+    out.write(reinterpret_cast<const char*>(&key.s_root), sizeof(key.s_root));
+    out.write(reinterpret_cast<const char*>(&key.f_root), sizeof(key.f_root));
+    out.write(reinterpret_cast<const char*>(&key.FCW), sizeof(key.FCW));
+    out.write(reinterpret_cast<const char*>(&key.sign), sizeof(key.sign));
+    out.write(reinterpret_cast<const char*>(&key.engine), sizeof(key.engine));
+    
+    size_t cw_size = key.cws.size();
+    out.write(reinterpret_cast<const char*>(&cw_size), sizeof(cw_size));
+    if (cw_size > 0) {
+        out.write(reinterpret_cast<const char*>(key.cws.data()), cw_size * sizeof(CorrectionWord));
+    }
+}
+
+inline DPFKey read_key(std::istream& in) {
+    DPFKey key;
+    in.read(reinterpret_cast<char*>(&key.s_root), sizeof(key.s_root));
+    in.read(reinterpret_cast<char*>(&key.f_root), sizeof(key.f_root));
+    in.read(reinterpret_cast<char*>(&key.FCW), sizeof(key.FCW));
+    in.read(reinterpret_cast<char*>(&key.sign), sizeof(key.sign));
+    in.read(reinterpret_cast<char*>(&key.engine), sizeof(key.engine));
+    
+    size_t cw_size;
+    in.read(reinterpret_cast<char*>(&cw_size), sizeof(cw_size));
+    // A key in another layout reads as garbage here; stop before sizing anything from it.
+    bool engine_ok = key.engine == DPFEngine::BGI || key.engine == DPFEngine::HalfTree;
+    if (!in || !engine_ok || (key.sign != 1 && key.sign != -1) || cw_size > 64) {
+        throw std::runtime_error("read_key: malformed or truncated DPF key");
+    }
+    key.cws.resize(cw_size);
+    if (cw_size > 0) {
+        in.read(reinterpret_cast<char*>(key.cws.data()), cw_size * sizeof(CorrectionWord));
+    }
+    if (!in) throw std::runtime_error("read_key: truncated DPF key");
+    return key;
+}
+
+inline void write_packed_key(std::ostream& out, const PackedDPFKey& key) {
+    write_key(out, key.tree);
+    out.write(reinterpret_cast<const char*>(&key.pack_bits), sizeof(key.pack_bits));
+    size_t width = size_t(1) << key.pack_bits;
+    out.write(reinterpret_cast<const char*>(key.FCW.data()), width * sizeof(int64_t));
+    out.write(reinterpret_cast<const char*>(key.slot_share.data()), width * sizeof(int64_t));
+}
+
+inline PackedDPFKey read_packed_key(std::istream& in) {
+    PackedDPFKey key;
+    key.tree = read_key(in);
+    in.read(reinterpret_cast<char*>(&key.pack_bits), sizeof(key.pack_bits));
+    if (key.pack_bits == 0 || key.pack_bits > DPF_MAX_PACK_BITS) {
+        throw std::runtime_error("read_packed_key: invalid pack_bits");
+    }
+    size_t width = size_t(1) << key.pack_bits;
+    key.FCW.resize(width);
+    key.slot_share.resize(width);
+    in.read(reinterpret_cast<char*>(key.FCW.data()), width * sizeof(int64_t));
+    in.read(reinterpret_cast<char*>(key.slot_share.data()), width * sizeof(int64_t));
+    if (!in) throw std::runtime_error("read_packed_key: truncated DPF key");
+    return key;
+}
+
+// Query files (queries_p0.bin, queries_p1.bin) open with a magic word, the format version and
+// pack_bits, then hold one (user index, item share, key) record per query. Bump the version
+// whenever the key layout changes, so old files are refused instead of misread.
+constexpr char QUERY_FILE_MAGIC[4] = {'M', 'P', 'Q', 'K'};
+constexpr uint32_t QUERY_FILE_VERSION = 1;
+
+inline void write_query_file_header(std::ostream& out, uint32_t pack_bits) {
+    out.write(QUERY_FILE_MAGIC, sizeof(QUERY_FILE_MAGIC));
+    out.write(reinterpret_cast<const char*>(&QUERY_FILE_VERSION), sizeof(QUERY_FILE_VERSION));
+    out.write(reinterpret_cast<const char*>(&pack_bits), sizeof(pack_bits));
+}
+
+inline void read_query_file_header(std::istream& in, const std::string& name, uint32_t pack_bits) {
+    char magic[sizeof(QUERY_FILE_MAGIC)] = {};
+    uint32_t version = 0, file_pack_bits = 0;
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char*>(&version), sizeof(version));
+    in.read(reinterpret_cast<char*>(&file_pack_bits), sizeof(file_pack_bits));
+    if (!in || !std::equal(magic, magic + sizeof(magic), QUERY_FILE_MAGIC) || version != QUERY_FILE_VERSION) {
+        throw std::runtime_error(name + " is not a version " + std::to_string(QUERY_FILE_VERSION) +
+                                 " query file; regenerate it with gen_queries");
+    }
+    if (file_pack_bits != pack_bits) {
+        throw std::runtime_error(name + " holds keys for pack_bits=" + std::to_string(file_pack_bits) +
+                                 ", not " + std::to_string(pack_bits));
+    }
+}
@@ -1,5 +1,5 @@
 #include "utils.hpp"
-#include "constants.hpp"
+#include "params.hpp"
 #include <fstream>
 #include <iostream>
 #include <string>
@@ -7,16 +7,39 @@
 #include <random>
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <output_dir>" << std::endl;
+    // Parameters come from --m/--n/--k/--q/--pack_bits, MPC_* or constants.hpp, and are
+    // recorded in <output_dir>/params.txt for the other binaries.
+    std::vector<std::string> positional;
+    ProtocolParams params;
+    try {
+        params = load_params(argc, argv, "", &positional);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
         return 1;
     }
+    if (positional.size() != 1 && positional.size() != 2) {
+        std::cerr << "Usage: " << argv[0] << " <output_dir> [bgi|halftree] [--m=<users>] [--n=<items>] [--k=<features>]"
+                  << " [--q=<queries>] [--pack_bits=<0-4>] [--ring_bits=<32|64>]" << std::endl;
+        return 1;
+    }
+
+    DPFEngine dpf_engine = DPFEngine::BGI;
+    if (positional.size() == 2) {
+        std::string engine_name = positional[1];
+        if (engine_name == "halftree") {
+            dpf_engine = DPFEngine::HalfTree;
+        } else if (engine_name != "bgi") {
+            std::cerr << "Unknown DPF engine: " << engine_name << " (expected bgi or halftree)" << std::endl;
+            return 1;
+        }
+    }
 
-    uint32_t num_users = M;
-    uint32_t num_items = N;
-    uint32_t feature_dim = K;
-    uint32_t num_queries = Q;
-    std::string output_directory = argv[1];
+    uint32_t num_users = params.m;
+    uint32_t num_items = params.n;
+    uint32_t feature_dim = params.k;
+    uint32_t num_queries = params.q;
+    std::string output_directory = positional[0];
+    write_params_file(output_directory + "/params.txt", params);
 
     ShareMat user_matrix_p0(num_users, ShareVec(feature_dim));
     ShareMat user_matrix_p1(num_users, ShareVec(feature_dim));
@@ -51,7 +74,7 @@ int main(int argc, char* argv[]) {
         }
         for (const auto& matrix_row : matrix) {
             for (size_t col_idx = 0; col_idx < matrix_row.size(); ++col_idx) {
-                uint32_t output_value = static_cast<uint32_t>(static_cast<int32_t>(matrix_row[col_idx]));
+                uint32_t output_value = Z2_32(matrix_row[col_idx]).value;
                 output_stream << output_value;
                 if (col_idx < matrix_row.size() - 1) output_stream << " ";
             }
@@ -75,6 +98,8 @@ int main(int argc, char* argv[]) {
         std::cerr << "Error opening output files in " << output_directory << std::endl;
         exit(1);
     }
+    write_query_file_header(query_file_p0, params.pack_bits);
+    write_query_file_header(query_file_p1, params.pack_bits);
 
     std::mt19937& random_engine = get_prg_engine();
     std::uniform_int_distribution<uint32_t> user_distribution(0, num_users - 1);
@@ -90,17 +115,20 @@ int main(int argc, char* argv[]) {
         int64_t item_share_p0 = share_distribution(random_engine);
         int64_t item_share_p1 = (int64_t)selected_item - item_share_p0;
 
-        auto dpf_key_pair = generateDPF(selected_item, 0, num_items);
-        DPFKey dpf_key_p0 = dpf_key_pair.first;
-        DPFKey dpf_key_p1 = dpf_key_pair.second;
-        
         query_file_p0.write(reinterpret_cast<const char*>(&selected_user), sizeof(selected_user));
         query_file_p0.write(reinterpret_cast<const char*>(&item_share_p0), sizeof(item_share_p0));
-        write_key(query_file_p0, dpf_key_p0);
-
         query_file_p1.write(reinterpret_cast<const char*>(&selected_user), sizeof(selected_user));
         query_file_p1.write(reinterpret_cast<const char*>(&item_share_p1), sizeof(item_share_p1));
-        write_key(query_file_p1, dpf_key_p1);
+
+        if (params.pack_bits > 0) {
+            auto packed_key_pair = generatePackedDPF(selected_item, 0, num_items, params.pack_bits, dpf_engine);
+            write_packed_key(query_file_p0, packed_key_pair.first);
+            write_packed_key(query_file_p1, packed_key_pair.second);
+        } else {
+            auto dpf_key_pair = generateDPF(selected_item, 0, num_items, dpf_engine);
+            write_key(query_file_p0, dpf_key_pair.first);
+            write_key(query_file_p1, dpf_key_pair.second);
+        }
         
         cleartext_query_file << selected_user << " " << selected_item << "\n";
 
@@ -0,0 +1,159 @@
+#pragma once
+
+// Asynchronous logger for the parties. A call formats its message into a slot of a bounded
+// lock-free ring and returns; a background thread writes the slots out and flushes when the
+// ring runs dry, so no write or flush happens on the caller's thread. When the ring is full
+// a debug message is dropped and counted rather than stalling the hot path; info and above
+// wait for the writer to free a slot, so reports and results are never lost.
+//
+//   LOG_INFO("Loaded %zu queries.", count);   // printed as "<prefix>: Loaded 10 queries."
+//
+// Levels below MPC_LOG_LEVEL (0 = debug, 1 = info, 2 = warn, 3 = error; default 1) are
+// removed at compile time, arguments included. Build with -DMPC_LOG_LEVEL=0 for the
+// per-query debug lines. Warnings and errors go to stderr, everything else to stdout;
+// stdout is flushed before each stderr line, so the two keep the order of the calls.
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <thread>
+
+#ifndef MPC_LOG_LEVEL
+#define MPC_LOG_LEVEL 1
+#endif
+
+enum class LogLevel : int { Debug = 0, Info = 1, Warn = 2, Error = 3 };
+
+constexpr size_t LOG_RING_SLOTS = 1024;     // Power of two.
+constexpr size_t LOG_MESSAGE_BYTES = 240;   // Longer messages are truncated.
+
+class AsyncLogger {
+public:
+    AsyncLogger() : slots(std::make_unique<Slot[]>(LOG_RING_SLOTS)) {
+        for (size_t i = 0; i < LOG_RING_SLOTS; i++) slots[i].sequence.store(i, std::memory_order_relaxed);
+        writer = std::thread([this] { run(); });
+    }
+
+    // Drains what is queued, then stops the writer.
+    ~AsyncLogger() {
+        stopping.store(true, std::memory_order_release);
+        published.fetch_add(1, std::memory_order_release);
+        published.notify_one();
+        writer.join();
+    }
+
+    AsyncLogger(const AsyncLogger&) = delete;
+    AsyncLogger& operator=(const AsyncLogger&) = delete;
+
+    // Set once at startup, before the first message; the string must outlive the logger.
+    void set_prefix(const char* text) { prefix = text; }
+
+    void push(LogLevel level, const char* format, va_list args) {
+        // Bounded multi-producer queue: a slot whose sequence equals the ticket is free.
+        size_t ticket = tail.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &slots[ticket & (LOG_RING_SLOTS - 1)];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t lag = (intptr_t)sequence - (intptr_t)ticket;
+            if (lag == 0) {
+                if (tail.compare_exchange_weak(ticket, ticket + 1, std::memory_order_relaxed)) break;
+            } else if (lag < 0) {
+                if (level == LogLevel::Debug) {
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                // Full: the writer is busy with the queued slots, so give it the core.
+                std::this_thread::yield();
+                ticket = tail.load(std::memory_order_relaxed);
+            } else {
+                ticket = tail.load(std::memory_order_relaxed);
+            }
+        }
+        slot->level = level;
+        vsnprintf(slot->text, sizeof(slot->text), format, args);
+        slot->sequence.store(ticket + 1, std::memory_order_release);
+        published.fetch_add(1, std::memory_order_release);
+        published.notify_one();
+    }
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        LogLevel level;
+        char text[LOG_MESSAGE_BYTES];
+    };
+
+    // Writes every ready slot; returns whether there were any.
+    bool drain() {
+        bool wrote = false;
+        for (;;) {
+            Slot& slot = slots[head & (LOG_RING_SLOTS - 1)];
+            if (slot.sequence.load(std::memory_order_acquire) != head + 1) break;
+            FILE* stream = slot.level >= LogLevel::Warn ? stderr : stdout;
+            // stderr is unbuffered; flush the lines queued before this one so they print first.
+            if (stream == stderr) std::fflush(stdout);
+            if (prefix) std::fprintf(stream, "%s: %s\n", prefix, slot.text);
+            else std::fprintf(stream, "%s\n", slot.text);
+            slot.sequence.store(head + LOG_RING_SLOTS, std::memory_order_release);
+            head++;
+            wrote = true;
+        }
+        size_t lost = dropped.exchange(0, std::memory_order_relaxed);
+        if (lost > 0) {
+            std::fflush(stdout);
+            std::fprintf(stderr, "%s: [log] dropped %zu messages\n", prefix ? prefix : "log", lost);
+        }
+        if (wrote || lost > 0) {
+            std::fflush(stdout);
+            std::fflush(stderr);
+        }
+        return wrote;
+    }
+
+    // Sleeps on the publish counter: a push after it was read changes it, so the wait cannot
+    // miss a message.
+    void run() {
+        for (;;) {
+            size_t seen = published.load(std::memory_order_acquire);
+            bool stop = stopping.load(std::memory_order_acquire);
+            if (drain()) continue;
+            if (stop) return;
+            published.wait(seen, std::memory_order_acquire);
+        }
+    }
+
+    std::unique_ptr<Slot[]> slots;
+    alignas(64) std::atomic<size_t> tail{0};
+    alignas(64) size_t head = 0;
+    alignas(64) std::atomic<size_t> published{0};
+    std::atomic<size_t> dropped{0};
+    std::atomic<bool> stopping{false};
+    const char* prefix = nullptr;
+    std::thread writer;
+};
+
+inline AsyncLogger& logger() {
+    static AsyncLogger instance;
+    return instance;
+}
+
+__attribute__((format(printf, 2, 3)))
+inline void log_message(LogLevel level, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    logger().push(level, format, args);
+    va_end(args);
+}
+
+#define MPC_LOG_AT(level, ...)                                              \
+    do {                                                                    \
+        if constexpr ((int)(level) >= MPC_LOG_LEVEL) log_message(level, __VA_ARGS__); \
+    } while (0)
+
+#define LOG_DEBUG(...) MPC_LOG_AT(LogLevel::Debug, __VA_ARGS__)
+#define LOG_INFO(...) MPC_LOG_AT(LogLevel::Info, __VA_ARGS__)
+#define LOG_WARN(...) MPC_LOG_AT(LogLevel::Warn, __VA_ARGS__)
+#define LOG_ERROR(...) MPC_LOG_AT(LogLevel::Error, __VA_ARGS__)
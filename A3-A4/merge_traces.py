@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+"""
+Merges the traces of P0, P1 and P2 (data/trace_p*.json, written when the parties run with
+MPC_TRACE set) into one Chrome trace-event file for Perfetto (ui.perfetto.dev) or
+chrome://tracing.
+
+Each party stamps its events with its own clock. The client side of every link stores the
+ping with the shortest round trip from the clock pings at connection time; assuming the
+server read its clock halfway through that round trip, the server's clock is ahead of the
+client's by
+
+    offset = server_time - (client_send + client_recv) / 2
+
+The offsets chain the parties to a reference party (P2 when its trace is present), whose
+clock the merged timeline uses. Every send is then connected by a flow arrow to the receive
+with the same link and sequence number, so the timeline shows which party each round waits on.
+
+Usage: python merge_traces.py [--data=<dir>] [--out=<file>]
+"""
+
+import json
+import sys
+from collections import deque
+from pathlib import Path
+
+
+def load_traces(data_dir):
+    traces = {}
+    for path in sorted(Path(data_dir).glob("trace_p*.json")):
+        with open(path) as f:
+            trace = json.load(f)
+        traces[trace["otherData"]["party"]] = trace
+    return traces
+
+
+def clock_offsets(traces):
+    """Offset (ns) to add to each party's clock to get the reference party's clock"""
+    edges = {party: [] for party in traces}
+    for party, trace in traces.items():
+        for sample in trace["otherData"]["clock_sync"]:
+            server = sample["server"]
+            ahead = sample["server_time"] - (sample["client_send"] + sample["client_recv"]) / 2
+            round_trip = sample["client_recv"] - sample["client_send"]
+            print(f"  {party} -> {server} ({sample['link']}): server clock ahead by {ahead / 1e3:.1f} us, "
+                  f"round trip {round_trip / 1e3:.1f} us")
+            if server in edges:
+                edges[party].append((server, ahead))
+                edges[server].append((party, -ahead))
+
+    reference = "P2" if "P2" in traces else sorted(traces)[0]
+    # offset[p] = reference clock - p's clock, found by walking the links from the reference.
+    offsets = {reference: 0.0}
+    pending = deque([reference])
+    while pending:
+        party = pending.popleft()
+        for other, ahead in edges[party]:
+            if other not in offsets:
+                # other's clock = party's clock + ahead, so reference - other = offsets[party] - ahead.
+                offsets[other] = offsets[party] - ahead
+                pending.append(other)
+    for party in traces:
+        if party not in offsets:
+            print(f"  warning: no clock sample links {party} to {reference}; its clock is left as is")
+            offsets[party] = 0.0
+    return reference, offsets
+
+
+def merge(traces, offsets):
+    events = []
+    # Absolute time (reference clock, us) of each party's trace origin.
+    starts = {party: (trace["otherData"]["origin_ns"] + offsets[party]) / 1e3 for party, trace in traces.items()}
+    base = min(starts.values())
+    for party, trace in traces.items():
+        shift = starts[party] - base
+        for event in trace["traceEvents"]:
+            if "ts" in event:
+                event = dict(event, ts=round(event["ts"] + shift, 3))
+            events.append(event)
+
+    # Flow arrows from each send to the receive with the same link and sequence number.
+    sends, receives = {}, {}
+    for event in events:
+        if event.get("cat") != "transfer":
+            continue
+        key = (event["args"]["link"], event["args"]["seq"])
+        (sends if event["name"].startswith("send") else receives).setdefault(key, []).append(event)
+    flow_id = 0
+    for key, send_events in sends.items():
+        for send in send_events:
+            # The receive on the other end of the link.
+            match = [recv for recv in receives.get(key, []) if recv["pid"] != send["pid"]]
+            if len(match) != 1:
+                continue
+            recv = match[0]
+            flow_id += 1
+            name = f"{key[0]} {send['args']['bytes']} B"
+            events.append({"ph": "s", "id": flow_id, "cat": "message", "name": name,
+                           "pid": send["pid"], "tid": send["tid"], "ts": send["ts"]})
+            events.append({"ph": "f", "bp": "e", "id": flow_id, "cat": "message", "name": name,
+                           "pid": recv["pid"], "tid": recv["tid"], "ts": recv["ts"]})
+    return events, flow_id
+
+
+def main():
+    data_dir = "data"
+    out_path = None
+    for arg in sys.argv[1:]:
+        if arg.startswith("--data="):
+            data_dir = arg.split("=", 1)[1]
+        elif arg.startswith("--out="):
+            out_path = arg.split("=", 1)[1]
+        else:
+            print(__doc__)
+            return 1
+    out_path = out_path or str(Path(data_dir) / "trace_merged.json")
+
+    traces = load_traces(data_dir)
+    if not traces:
+        print(f"No trace_p*.json in {data_dir}; run the parties with MPC_TRACE=1")
+        return 1
+    print(f"Merging traces of {', '.join(sorted(traces))}")
+    reference, offsets = clock_offsets(traces)
+    for party in sorted(offsets):
+        print(f"  {party}: {offsets[party] / 1e3:+.1f} us to {reference}'s clock")
+
+    events, flows = merge(traces, offsets)
+    with open(out_path, "w") as f:
+        json.dump({"traceEvents": events, "displayTimeUnit": "ns"}, f)
+    print(f"Wrote {len(events)} events ({flows} messages) to {out_path}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
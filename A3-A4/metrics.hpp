@@ -0,0 +1,506 @@
+#pragma once
+
+// Per-phase latency breakdown. Each party times the phases of a query with PhaseScope and,
+// when the query ends, adds the time spent in every phase it entered to that phase's HDR
+// histogram. At the end of the run the histograms go to a JSON file with their percentiles:
+//
+//   {
+//     PhaseScope lookup(Phase::LookupRotation);
+//     co_await ...;                     // time up to the end of the block counts as lookup
+//   }
+//
+// The wait phases (WaitOnHelper, WaitOnPeer, WaitOnParties) are timed inside the phases that
+// do the transfers, so they overlap them: a phase's time includes the waits within it. The
+// coroutines of a party run on one thread, and so does all the recording.
+//
+// TrafficMetrics counts what the transfers in common.hpp move over each link, tagged with the
+// innermost phase that is not a wait phase, and reports it per query and per run. Phases and
+// transfers also go to the trace (trace.hpp) when tracing is on, and with MPC_PERF set every
+// phase also collects hardware counters (perf_counters.hpp), reported as means per query.
+// With MPC_ALLOC set, phases also count heap allocations and record the peaks of the live heap
+// and the resident size (alloc_stats.hpp).
+
+#include "alloc_stats.hpp"
+#include "perf_counters.hpp"
+#include "trace.hpp"
+
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+enum class Phase : int {
+    Setup,                // Outside any query: connections and the parameter handshake.
+    Query,                // The whole query.
+    // P0 and P1.
+    LookupRotation,       // Rotation offset exchange and the rotated selector.
+    ColumnInnerProducts,  // The k inner products <V[:, f], selector>.
+    UserDot,              // <u_i, v_j>.
+    ScalarVector,         // Both scalar-vector products.
+    OuterProduct,         // Update placed in its slot (packed keys only).
+    FcwExchange,          // Masked FCW exchange.
+    EvalFullAccumulate,   // Full-domain evaluation and the update of V.
+    DpfTopLevels,         // Serial expansion of the top of the tree before the pool takes over.
+    DpfSubtrees,          // The subtrees, walked and accumulated on the pool.
+    WaitOnHelper,         // Receiving material from P2.
+    WaitOnPeer,           // Exchanges with the other party.
+    // P2.
+    RotationMaterial,
+    DotProductMaterial,
+    ScalarVectorMaterial,
+    OuterProductMaterial,
+    WaitOnParties,        // Sending material to P0 and P1.
+    Count
+};
+
+constexpr size_t PHASE_COUNT = (size_t)Phase::Count;
+
+constexpr std::array<const char*, PHASE_COUNT> PHASE_NAMES = {
+    "setup", "query",
+    "lookup_rotation", "column_inner_products", "user_dot", "scalar_vector", "outer_product",
+    "fcw_exchange", "evalfull_accumulate", "dpf_top_levels", "dpf_subtrees", "wait_on_helper", "wait_on_peer",
+    "rotation_material", "dot_product_material", "scalar_vector_material", "outer_product_material",
+    "wait_on_parties",
+};
+
+inline const char* phase_name(Phase phase) { return PHASE_NAMES[(size_t)phase]; }
+
+constexpr bool is_wait_phase(Phase phase) {
+    return phase == Phase::WaitOnHelper || phase == Phase::WaitOnPeer || phase == Phase::WaitOnParties;
+}
+
+// HDR histogram of nanosecond values with three significant digits. Values below 2048 have
+// a bucket each; above that, every power of two is split into 1024 buckets, so a bucket is
+// at most 1/1024 of its values wide. Values past HDR_MAX_NANOS (about 68 s) are clamped.
+class HdrHistogram {
+public:
+    static constexpr unsigned SUB_BUCKET_BITS = 11;
+    static constexpr uint64_t SUB_BUCKET_COUNT = uint64_t(1) << SUB_BUCKET_BITS;
+    static constexpr uint64_t SUB_BUCKET_HALF = SUB_BUCKET_COUNT / 2;
+    static constexpr uint64_t HDR_MAX_NANOS = (uint64_t(1) << 36) - 1;
+
+    void record(uint64_t value) {
+        if (value > HDR_MAX_NANOS) value = HDR_MAX_NANOS;
+        // Allocated on first use, so phases a party never enters cost nothing.
+        if (counts.empty()) counts.assign(bucket_index(HDR_MAX_NANOS) + 1, 0);
+        counts[bucket_index(value)]++;
+        if (total == 0 || value < min_value) min_value = value;
+        if (value > max_value) max_value = value;
+        total++;
+        sum += value;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t min() const { return min_value; }
+    uint64_t max() const { return max_value; }
+    double mean() const { return total ? (double)sum / total : 0.0; }
+
+    // The smallest recorded value v (up to bucket width) with at least `percentile` percent
+    // of the values <= v.
+    uint64_t value_at_percentile(double percentile) const {
+        if (total == 0) return 0;
+        uint64_t rank = (uint64_t)(percentile / 100.0 * total + 0.5);
+        if (rank < 1) rank = 1;
+        if (rank > total) rank = total;
+        uint64_t seen = 0;
+        for (size_t idx = 0; idx < counts.size(); idx++) {
+            seen += counts[idx];
+            if (seen >= rank) {
+                uint64_t value = highest_in_bucket(idx);
+                return value < max_value ? value : max_value;
+            }
+        }
+        return max_value;
+    }
+
+private:
+    static size_t bucket_index(uint64_t value) {
+        if (value < SUB_BUCKET_COUNT) return value;
+        unsigned shift = std::bit_width(value) - SUB_BUCKET_BITS;
+        return shift * SUB_BUCKET_HALF + (value >> shift);
+    }
+
+    static uint64_t highest_in_bucket(size_t idx) {
+        if (idx < SUB_BUCKET_COUNT) return idx;
+        uint64_t shift = idx / SUB_BUCKET_HALF - 1;
+        uint64_t sub = idx - shift * SUB_BUCKET_HALF;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    std::vector<uint64_t> counts;
+    uint64_t total = 0, sum = 0;
+    uint64_t min_value = 0, max_value = 0;
+};
+
+class PhaseMetrics {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    void begin_query() {
+        query_nanos.fill(0);
+        query_counts = {};
+        query_allocs = {};
+        entered = 0;
+        current = Phase::Query;
+        trace_recorder().begin_query();
+        if (alloc_stats().on()) {
+            query_start_allocs = alloc_stats().counts();
+            query_enclosing_peak = alloc_stats().begin_peak();
+            sample_rss(Phase::Query);
+        }
+        if (perf_counters().on()) query_start_counts = perf_counters().read();
+        query_start = Clock::now();
+    }
+
+    void end_query() {
+        Clock::time_point query_end = Clock::now();
+        if (alloc_stats().on()) {
+            add_allocs(Phase::Query, query_start_allocs, alloc_stats().counts(),
+                       alloc_stats().end_peak(query_enclosing_peak));
+        }
+        add(Phase::Query, query_start, query_end);
+        if (perf_counters().on()) add_counts(Phase::Query, query_start_counts, perf_counters().read());
+        trace_recorder().span(phase_name(Phase::Query), query_start, query_end);
+        trace_recorder().end_query();
+        for (size_t idx = 0; idx < PHASE_COUNT; idx++) {
+            if (!(entered & (uint32_t(1) << idx))) continue;
+            histograms[idx].record(query_nanos[idx]);
+            for (size_t e = 0; e < PERF_EVENT_COUNT; e++) run_counts[idx][e] += query_counts[idx][e];
+            run_alloc_counts[idx] += query_allocs[idx];
+        }
+        current = Phase::Setup;
+    }
+
+    // The innermost phase that is not a wait phase; traffic is tagged with it.
+    Phase current_phase() const { return current; }
+
+    // Makes `phase` current unless it is a wait phase; returns the phase to restore.
+    Phase enter(Phase phase) {
+        Phase previous = current;
+        if (!is_wait_phase(phase)) current = phase;
+        return previous;
+    }
+
+    void leave(Phase previous) { current = previous; }
+
+    void add(Phase phase, Clock::time_point start, Clock::time_point end) {
+        size_t idx = (size_t)phase;
+        query_nanos[idx] += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        entered |= uint32_t(1) << idx;
+    }
+
+    void add_counts(Phase phase, const PerfValues& start, const PerfValues& end) {
+        for (size_t e = 0; e < PERF_EVENT_COUNT; e++) query_counts[(size_t)phase][e] += end[e] - start[e];
+    }
+
+    // Adds the allocations between two snapshots to `phase`, and raises its heap peak to
+    // `heap_peak` and its resident peak to the resident size now.
+    void add_allocs(Phase phase, const AllocCounts& start, const AllocCounts& end, int64_t heap_peak) {
+        size_t idx = (size_t)phase;
+        query_allocs[idx] += end - start;
+        if (heap_peak > peak_heap[idx]) peak_heap[idx] = heap_peak;
+        sample_rss(phase);
+    }
+
+    void sample_rss(Phase phase) {
+        uint64_t rss = current_rss_bytes();
+        if (rss > peak_rss[(size_t)phase]) peak_rss[(size_t)phase] = rss;
+    }
+
+    const HdrHistogram& histogram(Phase phase) const { return histograms[(size_t)phase]; }
+
+    // Allocations of the query that just ended, and of all queries so far.
+    const AllocCounts& last_query_allocs() const { return query_allocs[(size_t)Phase::Query]; }
+    const AllocCounts& run_allocs(Phase phase) const { return run_alloc_counts[(size_t)phase]; }
+    int64_t peak_heap_bytes(Phase phase) const { return peak_heap[(size_t)phase]; }
+
+    // The kernel updates the process's peak lazily, so the phase samples can exceed it.
+    uint64_t run_peak_rss_bytes() const {
+        uint64_t peak = peak_rss_bytes();
+        for (uint64_t rss : peak_rss) peak = rss > peak ? rss : peak;
+        return peak;
+    }
+
+    // Writes the phases that were recorded, in nanoseconds per query. Returns false if the
+    // file cannot be written.
+    bool write_json(const std::string& path, const char* party) const {
+        FILE* out = std::fopen(path.c_str(), "w");
+        if (!out) return false;
+        std::fprintf(out, "{\n  \"party\": \"%s\",\n  \"unit\": \"ns\",\n  \"queries\": %llu,\n",
+                     party, (unsigned long long)histogram(Phase::Query).count());
+        if (alloc_stats().on()) {
+            std::fprintf(out, "  \"peak_rss_bytes\": %llu,\n", (unsigned long long)run_peak_rss_bytes());
+        }
+        std::fprintf(out, "  \"phases\": {");
+        const char* separator = "\n";
+        for (size_t idx = 0; idx < PHASE_COUNT; idx++) {
+            const HdrHistogram& h = histograms[idx];
+            if (h.count() == 0) continue;
+            std::fprintf(out,
+                         "%s    \"%s\": {\"count\": %llu, \"min\": %llu, \"mean\": %.1f, \"p50\": %llu, "
+                         "\"p99\": %llu, \"p999\": %llu, \"max\": %llu",
+                         separator, PHASE_NAMES[idx], (unsigned long long)h.count(), (unsigned long long)h.min(),
+                         h.mean(), (unsigned long long)h.value_at_percentile(50.0),
+                         (unsigned long long)h.value_at_percentile(99.0),
+                         (unsigned long long)h.value_at_percentile(99.9), (unsigned long long)h.max());
+            if (perf_counters().on()) write_counters(out, idx);
+            if (alloc_stats().on()) write_memory(out, idx);
+            std::fprintf(out, "}");
+            separator = ",\n";
+        }
+        std::fprintf(out, "\n  }\n}\n");
+        return std::fclose(out) == 0;
+    }
+
+private:
+    // Appends the phase's counters, as means per query, to its JSON entry: unavailable
+    // counters are null, and ipc is given when cycles and instructions both are.
+    void write_counters(FILE* out, size_t idx) const {
+        double queries = (double)histograms[idx].count();
+        std::fprintf(out, ", \"counters\": {");
+        for (size_t e = 0; e < PERF_EVENT_COUNT; e++) {
+            if (perf_counters().available((PerfEvent)e)) {
+                std::fprintf(out, "%s\"%s\": %.1f", e ? ", " : "", PERF_EVENT_NAMES[e], run_counts[idx][e] / queries);
+            } else {
+                std::fprintf(out, "%s\"%s\": null", e ? ", " : "", PERF_EVENT_NAMES[e]);
+            }
+        }
+        if (perf_counters().available(PerfEvent::Cycles) && perf_counters().available(PerfEvent::Instructions)) {
+            uint64_t cycles = run_counts[idx][(size_t)PerfEvent::Cycles];
+            double ipc = cycles ? (double)run_counts[idx][(size_t)PerfEvent::Instructions] / cycles : 0.0;
+            std::fprintf(out, ", \"ipc\": %.3f", ipc);
+        }
+        std::fprintf(out, "}");
+    }
+
+    // Appends the phase's allocations and frees (means per query), the bytes they requested,
+    // and its peaks over the run.
+    void write_memory(FILE* out, size_t idx) const {
+        double queries = (double)histograms[idx].count();
+        const AllocCounts& allocs = run_alloc_counts[idx];
+        std::fprintf(out,
+                     ", \"memory\": {\"allocations\": %.1f, \"frees\": %.1f, \"bytes\": %.1f, "
+                     "\"peak_heap_bytes\": %lld, \"peak_rss_bytes\": %llu}",
+                     allocs.allocations / queries, allocs.frees / queries, allocs.bytes / queries,
+                     (long long)peak_heap[idx], (unsigned long long)peak_rss[idx]);
+    }
+
+    std::array<HdrHistogram, PHASE_COUNT> histograms;
+    std::array<uint64_t, PHASE_COUNT> query_nanos{};
+    std::array<PerfValues, PHASE_COUNT> query_counts{}, run_counts{};
+    PerfValues query_start_counts{};
+    std::array<AllocCounts, PHASE_COUNT> query_allocs{}, run_alloc_counts{};
+    std::array<int64_t, PHASE_COUNT> peak_heap{};
+    std::array<uint64_t, PHASE_COUNT> peak_rss{};
+    AllocCounts query_start_allocs;
+    int64_t query_enclosing_peak = 0;
+    uint32_t entered = 0;
+    Phase current = Phase::Setup;
+    Clock::time_point query_start;
+};
+
+inline PhaseMetrics& phase_metrics() {
+    static PhaseMetrics metrics;
+    return metrics;
+}
+
+// Adds the time from construction to destruction to `phase` of the current query.
+class PhaseScope {
+public:
+    explicit PhaseScope(Phase p) : phase(p), previous(phase_metrics().enter(p)) {
+        if (alloc_stats().on()) {
+            start_allocs = alloc_stats().counts();
+            enclosing_peak = alloc_stats().begin_peak();
+            phase_metrics().sample_rss(phase);
+        }
+        if (perf_counters().on()) start_counts = perf_counters().read();
+        start = PhaseMetrics::Clock::now();
+    }
+    ~PhaseScope() {
+        PhaseMetrics::Clock::time_point end = PhaseMetrics::Clock::now();
+        if (alloc_stats().on()) {
+            phase_metrics().add_allocs(phase, start_allocs, alloc_stats().counts(), alloc_stats().end_peak(enclosing_peak));
+        }
+        phase_metrics().add(phase, start, end);
+        if (perf_counters().on()) phase_metrics().add_counts(phase, start_counts, perf_counters().read());
+        trace_recorder().span(phase_name(phase), start, end);
+        phase_metrics().leave(previous);
+    }
+
+    PhaseScope(const PhaseScope&) = delete;
+    PhaseScope& operator=(const PhaseScope&) = delete;
+
+private:
+    Phase phase;
+    Phase previous;
+    PhaseMetrics::Clock::time_point start;
+    PerfValues start_counts{};
+    AllocCounts start_allocs;
+    int64_t enclosing_peak = 0;
+};
+
+enum class Link : int { P0_P1, P0_P2, P1_P2, Count };
+
+constexpr size_t LINK_COUNT = (size_t)Link::Count;
+
+constexpr std::array<const char*, LINK_COUNT> LINK_NAMES = {"p0_p1", "p0_p2", "p1_p2"};
+
+// Traffic seen from one end of a link. Bytes are what goes over the socket, length words
+// included. A message is one transfer call: a value, or a batch of vectors sent in one write.
+// A round is a flight of messages this end sends with no receive in between, counted anew
+// in each query; in an exchange both ends send a flight, so each end counts one round. When
+// one end sends the flights of two steps back to back they are one round at that end, so the
+// two ends of a link can count differently.
+struct TrafficCounters {
+    uint64_t bytes_sent = 0, bytes_received = 0;
+    uint64_t messages_sent = 0, messages_received = 0;
+    uint64_t rounds = 0;
+
+    TrafficCounters& operator+=(const TrafficCounters& other) {
+        bytes_sent += other.bytes_sent;
+        bytes_received += other.bytes_received;
+        messages_sent += other.messages_sent;
+        messages_received += other.messages_received;
+        rounds += other.rounds;
+        return *this;
+    }
+
+    bool empty() const { return messages_sent == 0 && messages_received == 0; }
+};
+
+class TrafficMetrics {
+public:
+    // Sockets are told apart by their native handle. Transfers on a socket that was never
+    // registered are not counted.
+    void register_link(int handle, Link link) {
+        handles[(size_t)link] = handle;
+    }
+
+    // The socket registered for `link`, or -1.
+    int handle(Link link) const { return handles[(size_t)link]; }
+
+    void on_send(int handle, size_t bytes, TraceRecorder::Clock::time_point issued) {
+        int link = find(handle);
+        if (link < 0) return;
+        TrafficCounters delta;
+        delta.bytes_sent = bytes;
+        delta.messages_sent = 1;
+        if (!sending[link]) {
+            delta.rounds = 1;
+            sending[link] = true;
+        }
+        add(link, delta);
+        trace_recorder().transfer(true, LINK_NAMES[link], bytes, sent_seq[link]++, issued);
+    }
+
+    void on_receive(int handle, size_t bytes) {
+        int link = find(handle);
+        if (link < 0) return;
+        TrafficCounters delta;
+        delta.bytes_received = bytes;
+        delta.messages_received = 1;
+        sending[link] = false;
+        add(link, delta);
+        trace_recorder().transfer(false, LINK_NAMES[link], bytes, received_seq[link]++, TraceRecorder::Clock::now());
+    }
+
+    void begin_query() {
+        query_totals = {};
+        sending.fill(false);
+    }
+
+    void end_query() { per_query.push_back(query_totals); }
+
+    const std::array<TrafficCounters, LINK_COUNT>& last_query() const { return query_totals; }
+
+    // Summed over the queries only, without the setup traffic.
+    TrafficCounters query_total(Link link) const {
+        TrafficCounters total;
+        for (const auto& query : per_query) total += query[(size_t)link];
+        return total;
+    }
+
+    TrafficCounters run_total(Link link) const {
+        TrafficCounters total;
+        for (const TrafficCounters& counters : by_phase[(size_t)link]) total += counters;
+        return total;
+    }
+
+    // Writes per link the run totals, the totals of the queries alone, the totals per phase,
+    // and the totals of every query.
+    bool write_json(const std::string& path, const char* party) const {
+        FILE* out = std::fopen(path.c_str(), "w");
+        if (!out) return false;
+        std::fprintf(out, "{\n  \"party\": \"%s\",\n  \"queries\": %zu,\n  \"links\": {", party, per_query.size());
+        const char* link_separator = "\n";
+        for (size_t link = 0; link < LINK_COUNT; link++) {
+            TrafficCounters total = run_total((Link)link);
+            if (total.empty()) continue;
+            std::fprintf(out, "%s    \"%s\": {\n      \"total\": ", link_separator, LINK_NAMES[link]);
+            write_counters(out, total);
+            std::fprintf(out, ",\n      \"queries\": ");
+            write_counters(out, query_total((Link)link));
+            std::fprintf(out, ",\n      \"phases\": {");
+            const char* phase_separator = "\n";
+            for (size_t phase = 0; phase < PHASE_COUNT; phase++) {
+                if (by_phase[link][phase].empty()) continue;
+                std::fprintf(out, "%s        \"%s\": ", phase_separator, PHASE_NAMES[phase]);
+                write_counters(out, by_phase[link][phase]);
+                phase_separator = ",\n";
+            }
+            std::fprintf(out, "\n      }\n    }");
+            link_separator = ",\n";
+        }
+        std::fprintf(out, "\n  },\n  \"per_query\": [");
+        for (size_t query = 0; query < per_query.size(); query++) {
+            std::fprintf(out, "%s\n    {", query ? "," : "");
+            const char* link_separator = "";
+            for (size_t link = 0; link < LINK_COUNT; link++) {
+                if (per_query[query][link].empty()) continue;
+                std::fprintf(out, "%s\"%s\": ", link_separator, LINK_NAMES[link]);
+                write_counters(out, per_query[query][link]);
+                link_separator = ", ";
+            }
+            std::fprintf(out, "}");
+        }
+        std::fprintf(out, "\n  ]\n}\n");
+        return std::fclose(out) == 0;
+    }
+
+private:
+    int find(int handle) const {
+        for (size_t link = 0; link < LINK_COUNT; link++) {
+            if (handles[link] == handle) return (int)link;
+        }
+        return -1;
+    }
+
+    void add(int link, const TrafficCounters& delta) {
+        by_phase[link][(size_t)phase_metrics().current_phase()] += delta;
+        if (phase_metrics().current_phase() != Phase::Setup) query_totals[link] += delta;
+    }
+
+    static void write_counters(FILE* out, const TrafficCounters& c) {
+        std::fprintf(out,
+                     "{\"bytes_sent\": %llu, \"bytes_received\": %llu, \"messages_sent\": %llu, "
+                     "\"messages_received\": %llu, \"rounds\": %llu}",
+                     (unsigned long long)c.bytes_sent, (unsigned long long)c.bytes_received,
+                     (unsigned long long)c.messages_sent, (unsigned long long)c.messages_received,
+                     (unsigned long long)c.rounds);
+    }
+
+    std::array<int, LINK_COUNT> handles{-1, -1, -1};
+    std::array<bool, LINK_COUNT> sending{};
+    std::array<uint64_t, LINK_COUNT> sent_seq{}, received_seq{};  // Message numbers on each link, for the trace.
+    std::array<std::array<TrafficCounters, PHASE_COUNT>, LINK_COUNT> by_phase{};
+    std::array<TrafficCounters, LINK_COUNT> query_totals{};
+    std::vector<std::array<TrafficCounters, LINK_COUNT>> per_query;
+};
+
+inline TrafficMetrics& traffic_metrics() {
+    static TrafficMetrics metrics;
+    return metrics;
+}
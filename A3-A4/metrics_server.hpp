@@ -0,0 +1,246 @@
+#pragma once
+
+// Live metrics for long runs. With MPC_METRICS_PORT set in the environment, each party serves
+// its counters in the Prometheus text format at http://127.0.0.1:<port + party>/metrics (P0
+// on the port itself, P1 on the next, P2 on the one after), from a thread of its own so that
+// scrapes are answered while the protocol computes. MPC_METRICS_ADDR changes the listen
+// address, e.g. to 0.0.0.0 inside a container.
+//
+// The phase and traffic metrics belong to the protocol thread and are not synchronised, so
+// that thread renders the page itself: publish() after every query re-renders it at most once
+// a second, and the server thread only hands out the latest page. A scrape thus sees the run
+// as of a query boundary up to a second old.
+
+#include "log.hpp"
+#include "metrics.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <boost/asio.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#endif
+
+class MetricsServer {
+public:
+    using Clock = std::chrono::steady_clock;
+    using tcp = boost::asio::ip::tcp;
+
+    ~MetricsServer() { stop(); }
+
+    bool on() const { return running; }
+
+    // Starts serving when MPC_METRICS_PORT is set. A port that cannot be bound is logged and
+    // the party runs without the endpoint.
+    void start(int party_id, const char* party_name) {
+        const char* port_env = std::getenv("MPC_METRICS_PORT");
+        if (!port_env || running) return;
+        party = party_name;
+        const char* address_env = std::getenv("MPC_METRICS_ADDR");
+        try {
+            auto address = boost::asio::ip::make_address(address_env ? address_env : "127.0.0.1");
+            auto port = (unsigned short)(std::stoul(port_env) + party_id);
+            acceptor.emplace(io_ctx, tcp::endpoint(address, port));
+        } catch (const std::exception& e) {
+            LOG_WARN("Metrics endpoint not started: %s", e.what());
+            acceptor.reset();
+            return;
+        }
+        running = true;
+        publish(true);
+        boost::asio::co_spawn(io_ctx, accept_loop(), boost::asio::detached);
+        server = std::thread([this] { io_ctx.run(); });
+        tcp::endpoint endpoint = acceptor->local_endpoint();
+        LOG_INFO("Serving metrics at http://%s:%u/metrics", endpoint.address().to_string().c_str(),
+                 (unsigned)endpoint.port());
+    }
+
+    // The number of queries the run will process; throughput is measured from this call.
+    void begin_run(uint64_t queries) {
+        planned = queries;
+        run_start = Clock::now();
+        started = true;
+        publish(true);
+    }
+
+    // Re-renders the page from the current metrics, at most once a second unless forced.
+    // Call on the protocol thread only.
+    void publish(bool force = false) {
+        if (!running) return;
+        Clock::time_point now = Clock::now();
+        if (!force && now - last_publish < std::chrono::seconds(1)) return;
+        last_publish = now;
+        std::string rendered = render(now);
+        std::lock_guard<std::mutex> lock(mutex);
+        page.swap(rendered);
+    }
+
+    void stop() {
+        if (!running) return;
+        io_ctx.stop();
+        server.join();
+        running = false;
+    }
+
+private:
+    boost::asio::awaitable<void> accept_loop() {
+        for (;;) {
+            try {
+                tcp::socket client = co_await acceptor->async_accept(boost::asio::use_awaitable);
+                boost::asio::co_spawn(io_ctx, respond(std::move(client)), boost::asio::detached);
+            } catch (const std::exception& e) {
+                LOG_WARN("Metrics endpoint: %s", e.what());
+            }
+        }
+    }
+
+    boost::asio::awaitable<void> respond(tcp::socket client) {
+        try {
+            std::string request;
+            co_await boost::asio::async_read_until(client, boost::asio::dynamic_buffer(request, 8192), "\r\n\r\n",
+                                                   boost::asio::use_awaitable);
+            bool found = request.rfind("GET /metrics ", 0) == 0 || request.rfind("GET / ", 0) == 0;
+            std::string body = "Not found\n";
+            if (found) {
+                std::lock_guard<std::mutex> lock(mutex);
+                body = page;
+            }
+            std::string response = std::string(found ? "HTTP/1.1 200 OK\r\n" : "HTTP/1.1 404 Not Found\r\n") +
+                                   "Content-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                                   std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+            co_await boost::asio::async_write(client, boost::asio::buffer(response), boost::asio::use_awaitable);
+        } catch (const std::exception&) {
+            // The scraper hung up or sent something else; there is nobody to answer.
+        }
+    }
+
+    static void describe(std::string& out, const char* name, const char* type, const char* help) {
+        out += "# HELP ";
+        out += name;
+        out += ' ';
+        out += help;
+        out += "\n# TYPE ";
+        out += name;
+        out += ' ';
+        out += type;
+        out += '\n';
+    }
+
+    // One sample line; `labels` follows the party label, e.g. ",link=\"p0_p1\"".
+    void sample(std::string& out, const char* name, const std::string& labels, double value) const {
+        char line[256];
+        std::snprintf(line, sizeof(line), "%s{party=\"%s\"%s} %.15g\n", name, party, labels.c_str(), value);
+        out += line;
+    }
+
+    // Bytes waiting in the kernel on the socket of `link`: received and not yet read, or sent
+    // and not yet acknowledged by the other end.
+    static double queued_bytes(Link link, bool receive) {
+#ifdef __linux__
+        int handle = traffic_metrics().handle(link);
+        int bytes = 0;
+        if (handle >= 0 && ioctl(handle, receive ? FIONREAD : TIOCOUTQ, &bytes) == 0) return bytes;
+#endif
+        return 0;
+    }
+
+    std::string render(Clock::time_point now) const {
+        std::string out;
+        const PhaseMetrics& phases = phase_metrics();
+        uint64_t done = phases.histogram(Phase::Query).count();
+
+        describe(out, "mpc_queries_total", "counter", "Queries completed.");
+        sample(out, "mpc_queries_total", "", (double)done);
+        describe(out, "mpc_queries_planned", "gauge", "Queries in this run.");
+        sample(out, "mpc_queries_planned", "", (double)planned);
+        describe(out, "mpc_queries_per_second", "gauge", "Queries completed per second since the run began.");
+        double elapsed = started ? std::chrono::duration<double>(now - run_start).count() : 0.0;
+        sample(out, "mpc_queries_per_second", "", elapsed > 0 ? done / elapsed : 0.0);
+
+        describe(out, "mpc_phase_seconds", "summary", "Time spent in each phase per query.");
+        for (size_t idx = 0; idx < PHASE_COUNT; idx++) {
+            const HdrHistogram& h = phases.histogram((Phase)idx);
+            if (h.count() == 0) continue;
+            std::string phase = std::string(",phase=\"") + PHASE_NAMES[idx] + "\"";
+            for (double percentile : {50.0, 99.0, 99.9}) {
+                char quantile[48];
+                std::snprintf(quantile, sizeof(quantile), ",quantile=\"%g\"", percentile / 100.0);
+                sample(out, "mpc_phase_seconds", phase + quantile, h.value_at_percentile(percentile) / 1e9);
+            }
+            sample(out, "mpc_phase_seconds_sum", phase, h.mean() * h.count() / 1e9);
+            sample(out, "mpc_phase_seconds_count", phase, (double)h.count());
+        }
+
+        // Samples of one metric must be contiguous, so each metric loops over the links.
+        std::array<TrafficCounters, LINK_COUNT> totals;
+        std::array<std::string, LINK_COUNT> links;
+        for (size_t link = 0; link < LINK_COUNT; link++) {
+            totals[link] = traffic_metrics().run_total((Link)link);
+            links[link] = std::string(",link=\"") + LINK_NAMES[link] + "\"";
+        }
+        auto per_link = [&](const char* name, const char* type, const char* help, auto&& write) {
+            describe(out, name, type, help);
+            for (size_t link = 0; link < LINK_COUNT; link++) {
+                if (traffic_metrics().handle((Link)link) >= 0) write(link);
+            }
+        };
+        per_link("mpc_link_bytes_total", "counter", "Bytes moved over each link, setup included.", [&](size_t link) {
+            sample(out, "mpc_link_bytes_total", links[link] + ",direction=\"sent\"", (double)totals[link].bytes_sent);
+            sample(out, "mpc_link_bytes_total", links[link] + ",direction=\"received\"",
+                   (double)totals[link].bytes_received);
+        });
+        per_link("mpc_link_messages_total", "counter", "Messages moved over each link, setup included.",
+                 [&](size_t link) {
+                     sample(out, "mpc_link_messages_total", links[link] + ",direction=\"sent\"",
+                            (double)totals[link].messages_sent);
+                     sample(out, "mpc_link_messages_total", links[link] + ",direction=\"received\"",
+                            (double)totals[link].messages_received);
+                 });
+        per_link("mpc_link_rounds_total", "counter", "Rounds this party sent on each link.", [&](size_t link) {
+            sample(out, "mpc_link_rounds_total", links[link], (double)totals[link].rounds);
+        });
+        per_link("mpc_link_queued_bytes", "gauge",
+                 "Bytes in the kernel's socket queues: received and unread, or sent and unacknowledged.",
+                 [&](size_t link) {
+                     sample(out, "mpc_link_queued_bytes", links[link] + ",direction=\"received\"",
+                            queued_bytes((Link)link, true));
+                     sample(out, "mpc_link_queued_bytes", links[link] + ",direction=\"sent\"",
+                            queued_bytes((Link)link, false));
+                 });
+
+        describe(out, "mpc_resident_bytes", "gauge", "Resident set size of the party.");
+        sample(out, "mpc_resident_bytes", "", (double)current_rss_bytes());
+        return out;
+    }
+
+    const char* party = "";
+    bool running = false;
+    bool started = false;
+    uint64_t planned = 0;
+    Clock::time_point run_start, last_publish;
+
+    boost::asio::io_context io_ctx{1};
+    std::optional<tcp::acceptor> acceptor;
+    std::thread server;
+    std::mutex mutex;
+    std::string page;
+};
+
+inline MetricsServer& metrics_server() {
+    static MetricsServer server;
+    return server;
+}
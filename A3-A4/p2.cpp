@@ -1,5 +1,5 @@
 #include "common.hpp"
-#include "constants.hpp"
+#include "params.hpp"
 
 template <typename... Funcs>
 void spawn_parallel_tasks(boost::asio::io_context& io_ctx, Funcs&&... tasks) {
@@ -19,12 +19,11 @@ awaitable<void> generate_dot_product_material(tcp::socket& socket_p0, tcp::socke
     
     int64_t randomness_term = random_int8();
 
-    co_await send_vector(socket_p0, X0_shares);
-    co_await send_vector(socket_p0, Y0_shares);
+    PhaseScope waiting(Phase::WaitOnParties);
+    co_await send_vectors<2>(socket_p0, {X0_shares, Y0_shares});
     co_await send_value(socket_p0, vec_dot_product(X0_shares, Y1_shares) + randomness_term);
 
-    co_await send_vector(socket_p1, X1_shares);
-    co_await send_vector(socket_p1, Y1_shares);
+    co_await send_vectors<2>(socket_p1, {X1_shares, Y1_shares});
     co_await send_value(socket_p1, vec_dot_product(X1_shares, Y0_shares) - randomness_term);
 }
 
@@ -39,20 +38,69 @@ awaitable<void> generate_scalar_vector_material(tcp::socket& socket_p0, tcp::soc
         randomness_vector[idx] = random_int8();
     }
 
+    PhaseScope waiting(Phase::WaitOnParties);
     co_await send_value(socket_p0, X0_value);
-    co_await send_vector(socket_p0, Y0_shares);
-    co_await send_vector(socket_p0, vec_add(vec_scalar_mul(Y0_shares, X1_value), randomness_vector));
+    co_await send_vectors<2>(socket_p0, {Y0_shares, vec_add(vec_scalar_mul(Y0_shares, X1_value), randomness_vector)});
 
     co_await send_value(socket_p1, X1_value);
-    co_await send_vector(socket_p1, Y1_shares);
-    co_await send_vector(socket_p1, vec_sub(vec_scalar_mul(Y1_shares, X0_value), randomness_vector));
+    co_await send_vectors<2>(socket_p1, {Y1_shares, vec_sub(vec_scalar_mul(Y1_shares, X0_value), randomness_vector)});
 }
 
-boost::asio::awaitable<void> process_query_session(tcp::socket socket_p0, tcp::socket socket_p1, uint32_t num_users, uint32_t num_items, uint32_t feature_dim, uint32_t num_queries) {
-    std::cout << "P2: Starting session for " << num_queries << " queries." << std::endl;
-    
+// Material for compute_secure_outer_product(): masks X (rows) and Y (cols) and shares of
+// their outer product, C0 + C1 = X0 (x) Y1 + X1 (x) Y0, stored row-major.
+awaitable<void> generate_outer_product_material(tcp::socket& socket_p0, tcp::socket& socket_p1, size_t rows, size_t cols) {
+    std::vector<int64_t> X0_shares(rows), X1_shares(rows), Y0_shares(cols), Y1_shares(cols);
+    std::vector<int64_t> C0_shares(rows * cols), C1_shares(rows * cols);
+
+    for (size_t idx = 0; idx < rows; ++idx) {
+        X0_shares[idx] = random_int8();
+        X1_shares[idx] = random_int8();
+    }
+    for (size_t idx = 0; idx < cols; ++idx) {
+        Y0_shares[idx] = random_int8();
+        Y1_shares[idx] = random_int8();
+    }
+    for (size_t r = 0; r < rows; ++r) {
+        for (size_t c = 0; c < cols; ++c) {
+            int64_t randomness_term = random_int8();
+            C0_shares[r * cols + c] = Y0_shares[c] * X1_shares[r] + randomness_term;
+            C1_shares[r * cols + c] = Y1_shares[c] * X0_shares[r] - randomness_term;
+        }
+    }
+
+    PhaseScope waiting(Phase::WaitOnParties);
+    co_await send_vectors<3>(socket_p0, {X0_shares, Y0_shares, C0_shares});
+    co_await send_vectors<3>(socket_p1, {X1_shares, Y1_shares, C1_shares});
+}
+
+boost::asio::awaitable<void> process_query_session(tcp::socket socket_p0, tcp::socket socket_p1) {
+    // The parties may connect in either order; each starts by sending its role.
+    int64_t first_role = co_await recv_value(socket_p0);
+    int64_t second_role = co_await recv_value(socket_p1);
+    if (first_role == second_role || (first_role != 0 && first_role != 1)) {
+        throw std::runtime_error("Expected one connection from P0 and one from P1");
+    }
+    if (first_role == 1) std::swap(socket_p0, socket_p1);
+    traffic_metrics().register_link(socket_p0.native_handle(), Link::P0_P2);
+    traffic_metrics().register_link(socket_p1.native_handle(), Link::P1_P2);
+    // P0 and P1 announce their parameters first; the material sizes depend on them.
+    ProtocolParams params = params_from_vector(co_await recv_vector(socket_p0));
+    if (!(params_from_vector(co_await recv_vector(socket_p1)) == params)) {
+        throw std::runtime_error("P0 and P1 were started with different parameters");
+    }
+    co_await clock_sync_server(socket_p0);
+    co_await clock_sync_server(socket_p1);
+    share_ring_bits() = params.ring_bits;
+    uint32_t num_items = params.n, feature_dim = params.k, num_queries = params.q;
+    LOG_INFO("Starting session for %u queries (m=%u, n=%u, k=%u, ring=Z_2^%u).", num_queries, params.m, num_items,
+             feature_dim, params.ring_bits);
+
+    metrics_server().begin_run(num_queries);
     for (uint32_t query_num = 0; query_num < num_queries; ++query_num) {
-        std::cout << "P2: Sending materials for query " << query_num << std::endl;
+        phase_metrics().begin_query();
+        traffic_metrics().begin_query();
+        LOG_DEBUG("Sending materials for query %u", query_num);
+        std::optional<PhaseScope> rotation_phase(std::in_place, Phase::RotationMaterial);
         int64_t random_index = random_uint32() % num_items;
         std::vector<int64_t> one_hot_vector(num_items, 0);
         one_hot_vector[random_index] = 1;
@@ -64,42 +112,92 @@ boost::asio::awaitable<void> process_query_session(tcp::socket socket_p0, tcp::s
         std::vector<int64_t> r1_shares = vec_sub(one_hot_vector, r0_shares);
         int64_t rotation_offset_share = random_int32();
 
-        co_await send_value(socket_p0, rotation_offset_share);
-        co_await send_vector(socket_p0, r0_shares);
-        co_await send_value(socket_p1, random_index - rotation_offset_share);
-        co_await send_vector(socket_p1, r1_shares);
-
-        for (uint32_t feat_idx = 0; feat_idx < feature_dim; feat_idx++) {
-            co_await generate_dot_product_material(socket_p0, socket_p1, num_items);
+        {
+            PhaseScope waiting(Phase::WaitOnParties);
+            co_await send_value(socket_p0, rotation_offset_share);
+            co_await send_vector(socket_p0, r0_shares);
+            co_await send_value(socket_p1, random_index - rotation_offset_share);
+            co_await send_vector(socket_p1, r1_shares);
         }
+        rotation_phase.reset();
 
-        co_await generate_dot_product_material(socket_p0, socket_p1, feature_dim);
-        co_await generate_scalar_vector_material(socket_p0, socket_p1, feature_dim);
-        co_await generate_scalar_vector_material(socket_p0, socket_p1, feature_dim);
+        {
+            PhaseScope dot_phase(Phase::DotProductMaterial);
+            for (uint32_t feat_idx = 0; feat_idx < feature_dim; feat_idx++) {
+                co_await generate_dot_product_material(socket_p0, socket_p1, num_items);
+            }
+            co_await generate_dot_product_material(socket_p0, socket_p1, feature_dim);
+        }
+        {
+            PhaseScope scalar_phase(Phase::ScalarVectorMaterial);
+            co_await generate_scalar_vector_material(socket_p0, socket_p1, feature_dim);
+            co_await generate_scalar_vector_material(socket_p0, socket_p1, feature_dim);
+        }
+        if (params.pack_bits > 0) {
+            PhaseScope outer_phase(Phase::OuterProductMaterial);
+            co_await generate_outer_product_material(socket_p0, socket_p1, feature_dim, size_t(1) << params.pack_bits);
+        }
+        phase_metrics().end_query();
+        traffic_metrics().end_query();
+        log_query_traffic(query_num);
+        log_query_memory(query_num);
+        metrics_server().publish();
     }
     
-    std::cout << "P2: Session finished." << std::endl;
+    LOG_INFO("Session finished.");
+    if (phase_metrics().write_json("/app/data/phases_p2.json", "P2")) {
+        LOG_INFO("Saved phase timings to phases_p2.json");
+    } else {
+        LOG_WARN("Could not write /app/data/phases_p2.json");
+    }
+    if (traffic_metrics().write_json("/app/data/traffic_p2.json", "P2")) {
+        LOG_INFO("Saved traffic counts to traffic_p2.json");
+    } else {
+        LOG_WARN("Could not write /app/data/traffic_p2.json");
+    }
+    log_run_traffic(num_queries);
+    log_run_memory(num_queries);
+    if (trace_recorder().on()) {
+        if (trace_recorder().write_json("/app/data/trace_p2.json")) {
+            LOG_INFO("Saved trace to trace_p2.json");
+        } else {
+            LOG_WARN("Could not write /app/data/trace_p2.json");
+        }
+    }
 }
 
-int main(int argc, char* argv[]) {
-    uint32_t num_users = M, num_items = N, feature_dim = K, num_queries = Q;
-
+int main() {
+    logger().set_prefix("P2");
+    trace_recorder().set_party(2, "P2");
+    perf_counters().register_thread();
+    log_perf_counters_status();
+    metrics_server().start(2, "P2");
+    bool failed = false;
     try {
         boost::asio::io_context io_ctx;
         tcp::acceptor server_acceptor(io_ctx, tcp::endpoint(tcp::v4(), 9002));
         
-        std::cout << "P2: Waiting for P0 on port 9002..." << std::endl;
+        LOG_INFO("Waiting for P0 and P1 on port 9002...");
         tcp::socket socket_p0 = server_acceptor.accept();
-        std::cout << "P2: P0 connected." << std::endl;
-        
-        std::cout << "P2: Waiting for P1 on port 9002..." << std::endl;
         tcp::socket socket_p1 = server_acceptor.accept();
-        std::cout << "P2: P1 connected." << std::endl;
+        LOG_INFO("P0 and P1 connected.");
         
-        co_spawn(io_ctx, process_query_session(std::move(socket_p0), std::move(socket_p1), num_users, num_items, feature_dim, num_queries), detached);
+        co_spawn(io_ctx, process_query_session(std::move(socket_p0), std::move(socket_p1)),
+            [&failed](std::exception_ptr exc) {
+                if (exc) {
+                    failed = true;
+                    try {
+                        std::rethrow_exception(exc);
+                    } catch (std::exception& e) {
+                        LOG_ERROR("Session error: %s", e.what());
+                    }
+                }
+            });
         io_ctx.run();
     } catch (std::exception& e) {
-        std::cerr << "Exception in P2: " << e.what() << "\n";
+        LOG_ERROR("Exception: %s", e.what());
+        failed = true;
     }
-    return 0;
+    metrics_server().stop();
+    return failed ? 1 : 0;
 }
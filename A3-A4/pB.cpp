@@ -1,7 +1,6 @@
 #include "common.hpp"
-#include "constants.hpp"
+#include "params.hpp"
 #include <fstream> 
-#include <iomanip>
 
 #if !defined(ROLE_p0) && !defined(ROLE_p1)
 #error "ROLE must be defined as ROLE_p0 or ROLE_p1"
@@ -26,96 +25,151 @@ awaitable<tcp::socket> establish_peer_link(boost::asio::io_context& io_ctx, tcp:
     tcp::socket peer_socket(io_ctx);
 #ifdef ROLE_p0
     auto peer_endpoints = resolver.resolve("p1", "9001");
-    std::cout << ROLE_STR << ": Connecting to P1 at p1:9001..." << std::endl;
+    LOG_INFO("Connecting to P1 at p1:9001...");
     co_await boost::asio::async_connect(peer_socket, peer_endpoints, use_awaitable);
 #else
     tcp::acceptor listener(io_ctx, tcp::endpoint(tcp::v4(), 9001));
-    std::cout << ROLE_STR << ": Waiting for P0 on port 9001..." << std::endl;
+    LOG_INFO("Waiting for P0 on port 9001...");
     peer_socket = co_await listener.async_accept(use_awaitable);
 #endif
     co_return peer_socket;
 }
 
-awaitable<int64_t> compute_secure_inner_product(const std::vector<int64_t>& my_x_share, 
-                                                 const std::vector<int64_t>& my_y_share,
+// Buffers of the multiplication protocols, drawn from the query arena. The parties run one
+// multiplication at a time, so every multiplication of a query reuses the same set.
+struct MultiplyScratch {
+    explicit MultiplyScratch(std::pmr::memory_resource* arena)
+        : beaver_x(arena), beaver_y(arena), masked_x(arena), masked_y(arena),
+          peer_masked_x(arena), peer_masked_y(arena) {}
+
+    ArenaVec beaver_x, beaver_y;
+    ArenaVec masked_x, masked_y, peer_masked_x, peer_masked_y;
+};
+
+awaitable<int64_t> compute_secure_inner_product(std::span<const int64_t> my_x_share,
+                                                 std::span<const int64_t> my_y_share,
+                                                 MultiplyScratch& scratch,
                                                  tcp::socket& peer_link, 
                                                  tcp::socket& helper_link) {
-    std::vector<int64_t> beaver_x_share = co_await recv_vector(helper_link);
-    std::vector<int64_t> beaver_y_share = co_await recv_vector(helper_link);
-    int64_t beaver_c_share = co_await recv_value(helper_link);
-
-    std::vector<int64_t> masked_x = vec_add(my_x_share, beaver_x_share);
-    std::vector<int64_t> masked_y = vec_add(my_y_share, beaver_y_share);
-
-    std::vector<int64_t> peer_masked_x, peer_masked_y;
-    if (ROLE == 1) {
-        peer_masked_x = co_await recv_vector(peer_link);
-        peer_masked_y = co_await recv_vector(peer_link);
-        co_await send_vector(peer_link, masked_x);
-        co_await send_vector(peer_link, masked_y);
+    int64_t beaver_c_share;
+    {
+        PhaseScope waiting(Phase::WaitOnHelper);
+        co_await recv_vectors(helper_link, std::array{&scratch.beaver_x, &scratch.beaver_y});
+        beaver_c_share = co_await recv_value(helper_link);
+    }
+
+    eval_into(scratch.masked_x, share(my_x_share) + share(scratch.beaver_x));
+    eval_into(scratch.masked_y, share(my_y_share) + share(scratch.beaver_y));
+
+    if (PhaseScope waiting(Phase::WaitOnPeer); ROLE == 1) {
+        co_await recv_vectors(peer_link, std::array{&scratch.peer_masked_x, &scratch.peer_masked_y});
+        co_await send_vectors<2>(peer_link, {scratch.masked_x, scratch.masked_y});
     } else {
-        co_await send_vector(peer_link, masked_x);
-        co_await send_vector(peer_link, masked_y);
-        peer_masked_x = co_await recv_vector(peer_link);
-        peer_masked_y = co_await recv_vector(peer_link);
+        co_await send_vectors<2>(peer_link, {scratch.masked_x, scratch.masked_y});
+        co_await recv_vectors(peer_link, std::array{&scratch.peer_masked_x, &scratch.peer_masked_y});
     }
 
-    int64_t my_result = vec_dot_product(my_x_share, vec_add(my_y_share, peer_masked_y)) 
-                       - vec_dot_product(beaver_y_share, peer_masked_x) + beaver_c_share;
+    // x . (y + peer_masked_y) - beaver_y . peer_masked_x + c, without the sum vector.
+    Z2_64 my_result = Z2_64(vec_dot_product(my_x_share, my_y_share))
+                      + Z2_64(vec_dot_product(my_x_share, scratch.peer_masked_y))
+                      - Z2_64(vec_dot_product(scratch.beaver_y, scratch.peer_masked_x))
+                      + Z2_64(beaver_c_share);
 
-    co_return my_result;
+    co_return my_result.to_signed();
 }
 
-awaitable<std::vector<int64_t>> compute_secure_scalar_vector_product(int64_t scalar_share,
-                                                                      const std::vector<int64_t>& vector_share,
-                                                                      tcp::socket& peer_link,
-                                                                      tcp::socket& helper_link) {
-    int64_t beaver_scalar_share = co_await recv_value(helper_link);
-    std::vector<int64_t> beaver_vector_share = co_await recv_vector(helper_link);
-    std::vector<int64_t> beaver_result_share = co_await recv_vector(helper_link);
+// Writes the shares of scalar * vector into `result`.
+awaitable<void> compute_secure_scalar_vector_product(int64_t scalar_share,
+                                                     std::span<const int64_t> vector_share,
+                                                     ArenaVec& result,
+                                                     MultiplyScratch& scratch,
+                                                     tcp::socket& peer_link,
+                                                     tcp::socket& helper_link) {
+    int64_t beaver_scalar_share;
+    {
+        PhaseScope waiting(Phase::WaitOnHelper);
+        beaver_scalar_share = co_await recv_value(helper_link);
+        co_await recv_vectors(helper_link, std::array{&scratch.beaver_y, &result});
+    }
 
-    int64_t masked_scalar = scalar_share + beaver_scalar_share;
-    std::vector<int64_t> masked_vector = vec_add(vector_share, beaver_vector_share);
+    int64_t masked_scalar = (Z2_64(scalar_share) + Z2_64(beaver_scalar_share)).to_signed();
+    eval_into(scratch.masked_y, share(vector_share) + share(scratch.beaver_y));
 
     int64_t peer_masked_scalar;
-    std::vector<int64_t> peer_masked_vector;
-    if (ROLE == 0) {
+    if (PhaseScope waiting(Phase::WaitOnPeer); ROLE == 0) {
         peer_masked_scalar = co_await recv_value(peer_link);
-        peer_masked_vector = co_await recv_vector(peer_link);
+        co_await recv_vector(peer_link, scratch.peer_masked_y);
         co_await send_value(peer_link, masked_scalar);
-        co_await send_vector(peer_link, masked_vector);
+        co_await send_vector(peer_link, scratch.masked_y);
     } else {
         co_await send_value(peer_link, masked_scalar);
-        co_await send_vector(peer_link, masked_vector);
+        co_await send_vector(peer_link, scratch.masked_y);
         peer_masked_scalar = co_await recv_value(peer_link);
-        peer_masked_vector = co_await recv_vector(peer_link);
+        co_await recv_vector(peer_link, scratch.peer_masked_y);
     }
     
-    std::vector<int64_t> result = vec_add(
-        vec_sub(
-            vec_scalar_mul(vec_add(vector_share, peer_masked_vector), scalar_share),
-            vec_scalar_mul(beaver_vector_share, peer_masked_scalar)
-        ),
-        beaver_result_share
-    );
-    
-    co_return result;
+    // result = beaver_result + (vector + peer_masked_vector) * scalar - beaver_vector * peer_masked_scalar
+    eval_into(result, share(result) + (share(vector_share) + share(scratch.peer_masked_y)) * scalar_share
+                          - share(scratch.beaver_y) * peer_masked_scalar);
+}
+
+// Shares of x (x) y, row-major (entry r * cols + c is x[r] * y[c]), in one round: a batch
+// of scalar-vector products that share the mask of y.
+awaitable<void> compute_secure_outer_product(std::span<const int64_t> x_share,
+                                             std::span<const int64_t> y_share,
+                                             ArenaVec& result,
+                                             MultiplyScratch& scratch,
+                                             tcp::socket& peer_link,
+                                             tcp::socket& helper_link) {
+    {
+        PhaseScope waiting(Phase::WaitOnHelper);
+        co_await recv_vectors(helper_link, std::array{&scratch.beaver_x, &scratch.beaver_y, &result});
+    }
+
+    eval_into(scratch.masked_x, share(x_share) + share(scratch.beaver_x));
+    eval_into(scratch.masked_y, share(y_share) + share(scratch.beaver_y));
+
+    if (PhaseScope waiting(Phase::WaitOnPeer); ROLE == 0) {
+        co_await recv_vectors(peer_link, std::array{&scratch.peer_masked_x, &scratch.peer_masked_y});
+        co_await send_vectors<2>(peer_link, {scratch.masked_x, scratch.masked_y});
+    } else {
+        co_await send_vectors<2>(peer_link, {scratch.masked_x, scratch.masked_y});
+        co_await recv_vectors(peer_link, std::array{&scratch.peer_masked_x, &scratch.peer_masked_y});
+    }
+
+    size_t rows = x_share.size(), cols = y_share.size();
+    for (size_t r = 0; r < rows; ++r) {
+        std::span<int64_t> row(result.data() + r * cols, cols);
+        eval_into(row, share(row) + (share(y_share) + share(scratch.peer_masked_y)) * x_share[r]
+                           - share(scratch.beaver_y) * scratch.peer_masked_x[r]);
+    }
 }
 
-awaitable<std::vector<int64_t>> retrieve_item_profile_shares(int64_t item_share,
-                                                             const std::vector<std::vector<int64_t>>& item_matrix,
-                                                             tcp::socket& peer_link,
-                                                             tcp::socket& helper_link) {
+// Writes shares of row item_share of item_matrix into `item_profile`. The rotated selector
+// and the matrix column are taken from the same arena as the scratch buffers.
+awaitable<void> retrieve_item_profile_shares(int64_t item_share,
+                                             const std::vector<std::vector<int64_t>>& item_matrix,
+                                             ArenaVec& item_profile,
+                                             MultiplyScratch& scratch,
+                                             std::pmr::memory_resource* arena,
+                                             tcp::socket& peer_link,
+                                             tcp::socket& helper_link) {
     uint32_t num_items = item_matrix.size();
     uint32_t feature_dim = item_matrix[0].size();
-    
-    int64_t rotation_base = co_await recv_value(helper_link);
-    std::vector<int64_t> rotation_vector = co_await recv_vector(helper_link);
+    ArenaVec rotation_vector(arena), selector_vector(arena), item_matrix_column(arena);
+    std::optional<PhaseScope> lookup_phase(std::in_place, Phase::LookupRotation);
+
+    int64_t rotation_base;
+    {
+        PhaseScope waiting(Phase::WaitOnHelper);
+        rotation_base = co_await recv_value(helper_link);
+        co_await recv_vector(helper_link, rotation_vector);
+    }
 
-    int64_t rotation_offset = item_share - rotation_base;
+    int64_t rotation_offset = (Z2_64(item_share) - Z2_64(rotation_base)).to_signed();
     int64_t peer_rotation_offset;
     
-    if (ROLE == 1) {
+    if (PhaseScope waiting(Phase::WaitOnPeer); ROLE == 1) {
         peer_rotation_offset = co_await recv_value(peer_link);
         co_await send_value(peer_link, rotation_offset);
     } else {
@@ -123,46 +177,64 @@ awaitable<std::vector<int64_t>> retrieve_item_profile_shares(int64_t item_share,
         peer_rotation_offset = co_await recv_value(peer_link);
     }
 
+    // The offsets reconstruct j - a, which is in (-n, n), so its signed representative in the
+    // share ring is the integer itself.
     uint32_t total_rotation;
-    int64_t combined_offset = rotation_offset + peer_rotation_offset;
+    int64_t combined_offset = ring_reduce((Z2_64(rotation_offset) + Z2_64(peer_rotation_offset)).to_signed(),
+                                          share_ring_bits());
     if (combined_offset >= 0) {
         total_rotation = combined_offset % num_items;
     } else {
         total_rotation = (num_items + (combined_offset % (int64_t)num_items)) % num_items;
     }
 
-    std::vector<int64_t> selector_vector = rotation_vector;
-    std::rotate(selector_vector.begin(), 
-                selector_vector.begin() + (selector_vector.size() - total_rotation) % selector_vector.size(),
-                selector_vector.end());
+    selector_vector.resize(rotation_vector.size());
+    std::rotate_copy(rotation_vector.begin(),
+                     rotation_vector.begin() + (rotation_vector.size() - total_rotation) % rotation_vector.size(),
+                     rotation_vector.end(), selector_vector.begin());
+    lookup_phase.reset();
 
-    std::vector<int64_t> item_profile(feature_dim);
+    PhaseScope column_phase(Phase::ColumnInnerProducts);
+    item_profile.resize(feature_dim);
+    item_matrix_column.resize(num_items);
     for (uint32_t feat_idx = 0; feat_idx < feature_dim; feat_idx++) {
-        std::vector<int64_t> item_matrix_column(num_items);
         for (uint32_t item_idx = 0; item_idx < num_items; ++item_idx) {
             item_matrix_column[item_idx] = item_matrix[item_idx][feat_idx];
         }
-        item_profile[feat_idx] = co_await compute_secure_inner_product(item_matrix_column, selector_vector, peer_link, helper_link);
+        item_profile[feat_idx] = co_await compute_secure_inner_product(item_matrix_column, selector_vector, scratch,
+                                                                       peer_link, helper_link);
     }
-    
-    co_return item_profile;
 }
 
-awaitable<void> execute_protocol(boost::asio::io_context& io_ctx, uint32_t num_users, uint32_t num_items, uint32_t feature_dim, uint32_t num_queries) {
+awaitable<void> execute_protocol(boost::asio::io_context& io_ctx, ProtocolParams params) {
+    uint32_t num_users = params.m, num_items = params.n, feature_dim = params.k, num_queries = params.q;
     tcp::resolver resolver(io_ctx);
 
     tcp::socket helper_connection = co_await connect_to_helper(io_ctx, resolver);
-    std::cout << ROLE_STR << ": Connected to P2." << std::endl;
+    co_await send_value(helper_connection, ROLE);
+    traffic_metrics().register_link(helper_connection.native_handle(), ROLE == 0 ? Link::P0_P2 : Link::P1_P2);
+    co_await send_vector(helper_connection, params_to_vector(params));
+    share_ring_bits() = params.ring_bits;
+    LOG_INFO("Connected to P2.");
 
     tcp::socket peer_connection = co_await establish_peer_link(io_ctx, resolver);
-    std::cout << ROLE_STR << ": Peer connection established." << std::endl;
+    traffic_metrics().register_link(peer_connection.native_handle(), Link::P0_P1);
+    // Clock pings for the trace. They wait until both links are up: P2 answers P0's pings
+    // first, and P0 must not reach P1 before P1 is listening.
+    co_await clock_sync_client(helper_connection, ROLE == 0 ? Link::P0_P2 : Link::P1_P2, "P2");
+    if (ROLE == 0) {
+        co_await clock_sync_client(peer_connection, Link::P0_P1, "P1");
+    } else {
+        co_await clock_sync_server(peer_connection);
+    }
+    LOG_INFO("Peer connection established.");
 
     ShareMat user_matrix = load_matrix_shares(std::string("/app/data/U") + std::to_string(ROLE) + ".txt", num_users, feature_dim);
     ShareMat item_matrix = load_matrix_shares(std::string("/app/data/V") + std::to_string(ROLE) + ".txt", num_items, feature_dim);
-    std::cout << ROLE_STR << ": Loaded U and V matrix shares from files." << std::endl;
+    LOG_INFO("Loaded U and V matrix shares from files.");
 
-    std::vector<Query> query_list = read_queries(std::string("/app/data/queries_p") + std::to_string(ROLE) + ".bin");
-    std::cout << ROLE_STR << ": Loaded " << query_list.size() << " queries." << std::endl;
+    std::vector<Query> query_list = read_queries(std::string("/app/data/queries_p") + std::to_string(ROLE) + ".bin", params.pack_bits);
+    LOG_INFO("Loaded %zu queries.", query_list.size());
 
     std::vector<double> user_update_timings(query_list.size());
     std::vector<double> item_update_timings(query_list.size());
@@ -170,21 +242,42 @@ awaitable<void> execute_protocol(boost::asio::io_context& io_ctx, uint32_t num_u
     double cumulative_user_time = 0.0;
     double cumulative_item_time = 0.0;
 
+    // Every temporary of a query lives in this arena, which is reset between queries.
+    QueryArena arena;
+
+    metrics_server().begin_run(query_list.size());
     for (size_t query_idx = 0; query_idx < query_list.size(); ++query_idx) {
+        arena.reset();
+        phase_metrics().begin_query();
+        traffic_metrics().begin_query();
+        std::pmr::memory_resource* query_memory = arena.resource();
+        MultiplyScratch scratch(query_memory);
+
         const auto& current_query = query_list[query_idx];
         uint32_t user_id = current_query.user_index;
         int64_t item_share_value = current_query.item_share;
-        DPFKey dpf_key_share = current_query.dpf_key;
-        std::cout << ROLE_STR << ": Starting query " << query_idx << " (user=" << user_id << ", item_share=" << item_share_value << ")" << std::endl;
+        const DPFKey& dpf_key_share = current_query.dpf_key;
+        LOG_DEBUG("Starting query %zu (user=%u, item_share=%lld)", query_idx, user_id, (long long)item_share_value);
 
-        ShareVec user_profile = user_matrix[user_id];
+        ArenaVec user_profile(user_matrix[user_id].begin(), user_matrix[user_id].end(), query_memory);
 
         auto user_timer_start = std::chrono::high_resolution_clock::now();
 
-        ShareVec item_profile = co_await retrieve_item_profile_shares(item_share_value, item_matrix, peer_connection, helper_connection);
-        int64_t inner_product_share = co_await compute_secure_inner_product(user_profile, item_profile, peer_connection, helper_connection);
-        ShareVec scaled_item_profile = co_await compute_secure_scalar_vector_product(inner_product_share, item_profile, peer_connection, helper_connection);
-        user_matrix[user_id] = vec_sub(vec_add(user_matrix[user_id], item_profile), scaled_item_profile);
+        ArenaVec item_profile(query_memory), scaled_item_profile(query_memory);
+        co_await retrieve_item_profile_shares(item_share_value, item_matrix, item_profile, scratch, query_memory,
+                                              peer_connection, helper_connection);
+        int64_t inner_product_share;
+        {
+            PhaseScope dot_phase(Phase::UserDot);
+            inner_product_share = co_await compute_secure_inner_product(user_profile, item_profile, scratch, peer_connection, helper_connection);
+        }
+        {
+            PhaseScope scalar_phase(Phase::ScalarVector);
+            co_await compute_secure_scalar_vector_product(inner_product_share, item_profile, scaled_item_profile, scratch,
+                                                          peer_connection, helper_connection);
+        }
+        ShareVec& user_row = user_matrix[user_id];
+        eval_into(user_row, share(user_row) + share(item_profile) - share(scaled_item_profile));
 
         auto user_timer_end = std::chrono::high_resolution_clock::now();
         user_update_timings[query_idx] = std::chrono::duration_cast<std::chrono::nanoseconds>(user_timer_end - user_timer_start).count();
@@ -192,41 +285,94 @@ awaitable<void> execute_protocol(boost::asio::io_context& io_ctx, uint32_t num_u
 
         auto item_timer_start = std::chrono::high_resolution_clock::now();
         
-        int64_t complement_share = ROLE - inner_product_share;
-        ShareVec update_vector = co_await compute_secure_scalar_vector_product(complement_share, user_profile, peer_connection, helper_connection);
+        int64_t complement_share = (Z2_64(ROLE) - Z2_64(inner_product_share)).to_signed();
+        ArenaVec update_vector(query_memory);
+        {
+            PhaseScope scalar_phase(Phase::ScalarVector);
+            co_await compute_secure_scalar_vector_product(complement_share, user_profile, update_vector, scratch,
+                                                          peer_connection, helper_connection);
+        }
         
-        for (uint32_t feat_idx = 0; feat_idx < feature_dim; ++feat_idx) {
-            int64_t update_component = update_vector[feat_idx];
-            int64_t original_fcw = dpf_key_share.FCW;
-            int64_t masked_update = update_component - original_fcw;
-            
-            int64_t peer_masked_update;
-            if (ROLE == 0) {
-                peer_masked_update = co_await recv_value(peer_connection);
-                co_await send_value(peer_connection, masked_update);
+        // All K features share the DPF key and differ only in the FCW, so their masked FCWs
+        // go in one exchange and the tree is walked once for all of them.
+        ArenaVec placed_update(query_memory), fcw_shares(query_memory);
+        if (params.pack_bits > 0) {
+            // Packed keys need the update placed in the target's slot of its leaf block:
+            // shares of update_vector (x) e_slot, one FCW per feature and slot.
+            const PackedDPFKey& packed_key = current_query.packed_key;
+            size_t block_width = packed_key.FCW.size();
+            PhaseScope outer_phase(Phase::OuterProduct);
+            co_await compute_secure_outer_product(update_vector, packed_key.slot_share, placed_update, scratch,
+                                                  peer_connection, helper_connection);
+            fcw_shares.resize(placed_update.size());
+            for (size_t idx = 0; idx < placed_update.size(); ++idx) fcw_shares[idx] = packed_key.FCW[idx % block_width];
+        } else {
+            placed_update = update_vector;
+            fcw_shares.assign(feature_dim, dpf_key_share.FCW);
+        }
+
+        // The FCW shares are full 64-bit words; mask them mod 2^64.
+        ArenaVec masked_update(query_memory), peer_masked_update(query_memory), adjusted_fcw(query_memory);
+        {
+            PhaseScope fcw_phase(Phase::FcwExchange);
+            eval_into(masked_update, share(placed_update) - share(fcw_shares));
+
+            if (PhaseScope waiting(Phase::WaitOnPeer); ROLE == 0) {
+                co_await recv_vector(peer_connection, peer_masked_update);
+                co_await send_vector(peer_connection, masked_update);
             } else {
-                co_await send_value(peer_connection, masked_update);
-                peer_masked_update = co_await recv_value(peer_connection);
+                co_await send_vector(peer_connection, masked_update);
+                co_await recv_vector(peer_connection, peer_masked_update);
             }
-            
-            int64_t adjusted_fcw = masked_update + peer_masked_update;
-            DPFKey modified_key = dpf_key_share;
-            modified_key.FCW = adjusted_fcw;
-            
-            std::vector<int64_t> dpf_evaluation_result = EvalFull(modified_key, num_items);
-            
-            for (uint32_t item_idx = 0; item_idx < num_items; ++item_idx) {
-                item_matrix[item_idx][feat_idx] += dpf_evaluation_result[item_idx];
+
+            eval_into(adjusted_fcw, share(masked_update) + share(peer_masked_update));
+        }
+
+        {
+            PhaseScope eval_phase(Phase::EvalFullAccumulate);
+            if (params.pack_bits > 0) {
+                EvalPackedFullAccumulateProfile(current_query.packed_key, adjusted_fcw, num_items, item_matrix,
+                                                dpf_thread_pool(), query_memory);
+            } else {
+                EvalFullAccumulateProfile(dpf_key_share, adjusted_fcw, num_items, item_matrix, dpf_thread_pool(), query_memory);
             }
         }
-        std::cout << ROLE_STR << ": Finished query " << query_idx << std::endl;
+        LOG_DEBUG("Finished query %zu", query_idx);
 
         auto item_timer_end = std::chrono::high_resolution_clock::now();
         item_update_timings[query_idx] = std::chrono::duration_cast<std::chrono::nanoseconds>(item_timer_end - item_timer_start).count();
         cumulative_item_time += item_update_timings[query_idx];
+        phase_metrics().end_query();
+        traffic_metrics().end_query();
+        log_query_traffic(query_idx);
+        log_query_memory(query_idx);
+        metrics_server().publish();
     }
 
-    std::cout << ROLE_STR << ": All queries processed." << std::endl;
+    LOG_INFO("All queries processed.");
+
+    std::string phase_file = std::string("/app/data/phases_p") + std::to_string(ROLE) + ".json";
+    if (phase_metrics().write_json(phase_file, ROLE_STR)) {
+        LOG_INFO("Saved phase timings to phases_p%d.json", ROLE);
+    } else {
+        LOG_WARN("Could not write %s", phase_file.c_str());
+    }
+    std::string traffic_file = std::string("/app/data/traffic_p") + std::to_string(ROLE) + ".json";
+    if (traffic_metrics().write_json(traffic_file, ROLE_STR)) {
+        LOG_INFO("Saved traffic counts to traffic_p%d.json", ROLE);
+    } else {
+        LOG_WARN("Could not write %s", traffic_file.c_str());
+    }
+    log_run_traffic(query_list.size());
+    log_run_memory(query_list.size());
+    if (trace_recorder().on()) {
+        std::string trace_file = std::string("/app/data/trace_p") + std::to_string(ROLE) + ".json";
+        if (trace_recorder().write_json(trace_file)) {
+            LOG_INFO("Saved trace to trace_p%d.json", ROLE);
+        } else {
+            LOG_WARN("Could not write %s", trace_file.c_str());
+        }
+    }
 
     std::ofstream updated_user_file(std::string("/app/data/U") + std::to_string(ROLE) + "_updated.txt");
     std::ofstream updated_item_file(std::string("/app/data/V") + std::to_string(ROLE) + "_updated.txt");
@@ -234,45 +380,44 @@ awaitable<void> execute_protocol(boost::asio::io_context& io_ctx, uint32_t num_u
     if (updated_user_file.is_open()) {
         for (uint32_t user_idx = 0; user_idx < num_users; ++user_idx) {
             for (uint32_t feat_idx = 0; feat_idx < feature_dim; ++feat_idx) {
-                uint32_t output_val = static_cast<uint32_t>(static_cast<int32_t>(user_matrix[user_idx][feat_idx]));
+                uint32_t output_val = Z2_32(user_matrix[user_idx][feat_idx]).value;
                 updated_user_file << output_val;
                 if (feat_idx < feature_dim - 1) updated_user_file << " ";
             }
             updated_user_file << "\n";
         }
         updated_user_file.close();
-        std::cout << ROLE_STR << ": Saved updated U shares to U" << ROLE << "_updated.txt" << std::endl;
+        LOG_INFO("Saved updated U shares to U%d_updated.txt", ROLE);
     }
     
     if (updated_item_file.is_open()) {
         for (uint32_t item_idx = 0; item_idx < num_items; ++item_idx) {
             for (uint32_t feat_idx = 0; feat_idx < feature_dim; ++feat_idx) {
-                uint32_t output_val = static_cast<uint32_t>(static_cast<int32_t>(item_matrix[item_idx][feat_idx]));
+                uint32_t output_val = Z2_32(item_matrix[item_idx][feat_idx]).value;
                 updated_item_file << output_val;
                 if (feat_idx < feature_dim - 1) updated_item_file << " ";
             }
             updated_item_file << "\n";
         }
         updated_item_file.close();
-        std::cout << ROLE_STR << ": Saved updated V shares to V" << ROLE << "_updated.txt" << std::endl;
+        LOG_INFO("Saved updated V shares to V%d_updated.txt", ROLE);
     }
 
     if (ROLE == 0) {
         double avg_user_time_seconds = (cumulative_user_time / query_list.size()) * 1e-9;
         double avg_item_time_seconds = (cumulative_item_time / query_list.size()) * 1e-9;
         
-        std::cout << "\n--- Performance Metrics ---" << std::endl;
-        std::cout << "Parameters: m=" << num_users << ", n=" << num_items << ", k=" << feature_dim << ", q=" << num_queries << std::endl;
-        std::cout << "Average user profile update time: " << avg_user_time_seconds << " seconds" << std::endl;
-        std::cout << "Average item profile update time: " << avg_item_time_seconds << " seconds" << std::endl;
-        std::cout << "user_update_time: " << avg_user_time_seconds << std::endl;
-        std::cout << "item_update_time: " << avg_item_time_seconds << std::endl;
+        LOG_INFO("--- Performance Metrics ---");
+        LOG_INFO("Parameters: m=%u, n=%u, k=%u, q=%u", num_users, num_items, feature_dim, num_queries);
+        LOG_INFO("Average user profile update time: %g seconds", avg_user_time_seconds);
+        LOG_INFO("Average item profile update time: %g seconds", avg_item_time_seconds);
+        LOG_INFO("user_update_time: %g", avg_user_time_seconds);
+        LOG_INFO("item_update_time: %g", avg_item_time_seconds);
         
-        std::cout << std::fixed << std::setprecision(9);
         for (size_t idx = 0; idx < user_update_timings.size(); ++idx) {
             double user_time_sec = user_update_timings[idx] * 1e-9;
             double item_time_sec = item_update_timings[idx] * 1e-9;
-            std::cout << "Query " << idx << ": user=" << user_time_sec << "s, item=" << item_time_sec << "s" << std::endl;
+            LOG_INFO("Query %zu: user=%.9fs, item=%.9fs", idx, user_time_sec, item_time_sec);
         }
     }
     
@@ -280,20 +425,33 @@ awaitable<void> execute_protocol(boost::asio::io_context& io_ctx, uint32_t num_u
 }
 
 int main(int argc, char* argv[]) {
-    uint32_t num_users = M, num_items = N, feature_dim = K, num_queries = Q;
+    logger().set_prefix(ROLE_STR);
+    trace_recorder().set_party(ROLE, ROLE_STR);
+    perf_counters().register_thread();
+    log_perf_counters_status();
+    metrics_server().start(ROLE, ROLE_STR);
+    ProtocolParams params;
+    try {
+        params = load_params(argc, argv, "/app/data");
+    } catch (const std::exception& e) {
+        LOG_ERROR("%s", e.what());
+        return 1;
+    }
 
-    std::cout.setf(std::ios::unitbuf);
     boost::asio::io_context io_ctx(1);
-    co_spawn(io_ctx, execute_protocol(io_ctx, num_users, num_items, feature_dim, num_queries), 
+    bool failed = false;
+    co_spawn(io_ctx, execute_protocol(io_ctx, params), 
         [&](std::exception_ptr exc) {
             if (exc) {
+                failed = true;
                 try {
                     std::rethrow_exception(exc);
                 } catch (std::exception& e) {
-                    std::cerr << ROLE_STR << " Coroutine error: " << e.what() << std::endl;
+                    LOG_ERROR("Coroutine error: %s", e.what());
                 }
             }
         });
     io_ctx.run();
-    return 0;
+    metrics_server().stop();
+    return failed ? 1 : 0;
 }
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "constants.hpp"
+#include "ring.hpp"
+
+// Runtime protocol dimensions. Each field comes from the first source that sets it:
+//   1. a --<name>=<value> command-line option (e.g. --n=1000, --pack_bits=2)
+//   2. an MPC_<NAME> environment variable (e.g. MPC_N=1000)
+//   3. the params.txt header that gen_queries writes next to the data files
+//   4. the defaults in constants.hpp
+// P2 has no data directory; P0 and P1 send it their parameters when they connect.
+struct ProtocolParams {
+    uint32_t m = M;
+    uint32_t n = N;
+    uint32_t k = K;
+    uint32_t q = Q;
+    uint32_t pack_bits = DPF_PACK_BITS;
+    uint32_t ring_bits = SHARE_RING_BITS;
+};
+
+struct ParamField {
+    const char* name;
+    const char* env;
+    uint32_t ProtocolParams::*field;
+};
+
+inline const std::vector<ParamField>& param_fields() {
+    static const std::vector<ParamField> fields = {
+        {"m", "MPC_M", &ProtocolParams::m},
+        {"n", "MPC_N", &ProtocolParams::n},
+        {"k", "MPC_K", &ProtocolParams::k},
+        {"q", "MPC_Q", &ProtocolParams::q},
+        {"pack_bits", "MPC_PACK_BITS", &ProtocolParams::pack_bits},
+        {"ring_bits", "MPC_RING_BITS", &ProtocolParams::ring_bits},
+    };
+    return fields;
+}
+
+inline uint32_t parse_param_value(const std::string& name, const std::string& text) {
+    size_t used = 0;
+    unsigned long value = 0;
+    try {
+        value = std::stoul(text, &used);
+    } catch (const std::exception&) {
+        used = 0;
+    }
+    if (used == 0 || used != text.size() || value > UINT32_MAX) {
+        throw std::invalid_argument("Invalid value for " + name + ": " + text);
+    }
+    return (uint32_t)value;
+}
+
+// params.txt holds one "<name> <value>" pair per line.
+inline void write_params_file(const std::string& path, const ProtocolParams& params) {
+    std::ofstream out(path);
+    if (!out) throw std::runtime_error("Cannot open " + path + " for writing");
+    for (const auto& f : param_fields()) out << f.name << " " << params.*f.field << "\n";
+}
+
+inline void read_params_file(const std::string& path, ProtocolParams& params) {
+    std::ifstream in(path);
+    if (!in) return;
+    std::string name, value;
+    while (in >> name >> value) {
+        for (const auto& f : param_fields()) {
+            if (name == f.name) params.*f.field = parse_param_value(name, value);
+        }
+    }
+}
+
+// Rejects values the protocol cannot run with, before any file is written or any material
+// is sized from them.
+inline void validate_params(const ProtocolParams& params) {
+    if (params.m == 0 || params.n == 0 || params.k == 0) {
+        throw std::invalid_argument("m, n and k must be positive");
+    }
+    if (params.pack_bits > DPF_MAX_PACK_BITS) {
+        throw std::invalid_argument("pack_bits must be at most " + std::to_string(DPF_MAX_PACK_BITS));
+    }
+    if (!valid_ring_bits(params.ring_bits)) {
+        throw std::invalid_argument("ring_bits must be 32 or 64");
+    }
+}
+
+// Resolves the parameters for a binary. Arguments that are not --options are returned in
+// `positional` (argv[0] excluded). An empty data_dir skips the params.txt source.
+inline ProtocolParams load_params(int argc, char* argv[], const std::string& data_dir,
+                                  std::vector<std::string>* positional = nullptr) {
+    ProtocolParams params;
+    if (!data_dir.empty()) read_params_file(data_dir + "/params.txt", params);
+
+    for (const auto& f : param_fields()) {
+        if (const char* env = std::getenv(f.env)) params.*f.field = parse_param_value(f.env, env);
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            if (positional) positional->push_back(arg);
+            continue;
+        }
+        size_t eq = arg.find('=');
+        std::string name = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+        bool known = false;
+        for (const auto& f : param_fields()) {
+            if (name != f.name) continue;
+            if (eq == std::string::npos) throw std::invalid_argument("Missing value for --" + name);
+            params.*f.field = parse_param_value(name, arg.substr(eq + 1));
+            known = true;
+        }
+        if (!known) throw std::invalid_argument("Unknown option: " + arg);
+    }
+
+    validate_params(params);
+    return params;
+}
+
+// Wire form of the parameters for the P0/P1 -> P2 handshake.
+inline std::vector<int64_t> params_to_vector(const ProtocolParams& params) {
+    std::vector<int64_t> values;
+    for (const auto& f : param_fields()) values.push_back(params.*f.field);
+    return values;
+}
+
+inline ProtocolParams params_from_vector(const std::vector<int64_t>& values) {
+    const auto& fields = param_fields();
+    if (values.size() != fields.size()) throw std::runtime_error("Malformed parameter handshake");
+    ProtocolParams params;
+    for (size_t i = 0; i < fields.size(); ++i) {
+        if (values[i] < 0 || values[i] > UINT32_MAX) throw std::runtime_error("Malformed parameter handshake");
+        params.*fields[i].field = (uint32_t)values[i];
+    }
+    validate_params(params);
+    return params;
+}
+
+inline bool operator==(const ProtocolParams& a, const ProtocolParams& b) {
+    return params_to_vector(a) == params_to_vector(b);
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+// Hardware performance counters for the phase breakdown, read with perf_event_open(2).
+// Off unless MPC_PERF is set in the environment. Each thread that does protocol work (the
+// main thread and the DPF pool's workers) opens its own counters with register_thread(),
+// and read() sums them over all those threads, so a phase run on the pool is counted in full.
+//
+// Counters the kernel or the machine does not offer (e.g. hardware events in most VMs and
+// containers, or perf_event_paranoid > 2) are left out and reported as unavailable;
+// task_clock, a software event, works wherever perf_event_open does and gives the CPU time
+// next to the wall-clock time of the phase.
+
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum class PerfEvent : int { Cycles, Instructions, LlcMisses, BranchMisses, TaskClock, Count };
+
+constexpr size_t PERF_EVENT_COUNT = (size_t)PerfEvent::Count;
+
+constexpr std::array<const char*, PERF_EVENT_COUNT> PERF_EVENT_NAMES = {
+    "cycles", "instructions", "llc_misses", "branch_misses", "task_clock_ns",
+};
+
+using PerfValues = std::array<uint64_t, PERF_EVENT_COUNT>;
+
+class PerfCounters {
+public:
+    PerfCounters() : enabled(std::getenv("MPC_PERF") != nullptr) {}
+
+    bool on() const { return enabled; }
+
+    // Whether event e could be opened on the first registered thread.
+    bool available(PerfEvent e) const { return supported[(size_t)e]; }
+
+    // Opens the counters for the calling thread. Call once per thread, before it does work
+    // that should be counted.
+    void register_thread() {
+#ifdef __linux__
+        if (!enabled) return;
+        std::array<int, PERF_EVENT_COUNT> fds;
+        for (size_t e = 0; e < PERF_EVENT_COUNT; e++) fds[e] = open_event((PerfEvent)e);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (threads.empty()) {
+            for (size_t e = 0; e < PERF_EVENT_COUNT; e++) supported[e] = fds[e] >= 0;
+        }
+        threads.push_back(fds);
+#endif
+    }
+
+    // Counts so far, summed over the registered threads; zero for unavailable events. When
+    // the kernel multiplexes counters, the values are scaled up to the full running time.
+    PerfValues read() {
+        PerfValues total{};
+#ifdef __linux__
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& fds : threads) {
+            for (size_t e = 0; e < PERF_EVENT_COUNT; e++) {
+                if (fds[e] < 0) continue;
+                uint64_t value[3];  // value, time enabled, time running
+                if (::read(fds[e], value, sizeof(value)) != (ssize_t)sizeof(value)) continue;
+                if (value[2] > 0 && value[2] < value[1]) {
+                    value[0] = (uint64_t)((double)value[0] * value[1] / value[2]);
+                }
+                total[e] += value[0];
+            }
+        }
+#endif
+        return total;
+    }
+
+private:
+#ifdef __linux__
+    static int open_event(PerfEvent e) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        switch (e) {
+            case PerfEvent::Cycles: attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+            case PerfEvent::Instructions: attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+            case PerfEvent::LlcMisses: attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+            case PerfEvent::BranchMisses: attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+            default:
+                attr.type = PERF_TYPE_SOFTWARE;
+                attr.config = PERF_COUNT_SW_TASK_CLOCK;
+                break;
+        }
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // pid 0, cpu -1: the calling thread, on whichever CPU it runs.
+        return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+
+    bool enabled;
+    std::array<bool, PERF_EVENT_COUNT> supported{};
+    std::mutex mutex;
+    std::vector<std::array<int, PERF_EVENT_COUNT>> threads;
+};
+
+inline PerfCounters& perf_counters() {
+    static PerfCounters counters;
+    return counters;
+}
@@ -0,0 +1,420 @@
+#pragma once
+
+// Fixed-key AES PRG shared by the DPF code in dpf.hpp and common.hpp.
+//
+// A node seed s is expanded into its two children by encrypting the blocks
+// B_left = (s, 0) and B_right = (s, 1) under a public fixed key and feeding the result
+// forward, X = AES(B) ^ B. The child seed is the low 64 bits of X and the child control
+// bit is bit 64. prg_expand_batch() expands many nodes at once and picks the fastest
+// implementation the CPU supports the first time it is called:
+//   - "vaes":     AVX-512 VAES, 8 nodes (16 blocks) per step
+//   - "aesni":    AES-NI with 8 blocks in flight to hide the instruction latency
+//   - "portable": byte-oriented software AES, for CPUs or compilers without AES support
+// All three compute the same function, so parties built on different machines agree.
+// Set PRG_IMPL to one of the names above to force a specific implementation.
+//
+// prg_hash_batch() is the correlation-robust hash used by the half-tree DPF:
+// H(x) = low64(AES(B) ^ B) with B = (sigma(x), 2), where sigma is the linear
+// orthomorphism (a || b) -> (a ^ b || a) on the 32-bit halves of x. It costs one AES
+// block per node instead of two.
+//
+// prg_convert_batch() turns a leaf seed into `words` 64-bit output words for the
+// early-termination DPF, two words per block: (AES(B_i) ^ B_i) with B_i = (s, 3 + i).
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define PRG_HAVE_X86_AES 1
+#include <immintrin.h>
+#endif
+
+namespace prg_detail {
+
+constexpr uint8_t SBOX[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+// Public key of the fixed-key PRG. Any constant works; both parties only need to agree.
+constexpr uint8_t FIXED_KEY[16] = {
+    0x43, 0x53, 0x36, 0x37, 0x30, 0x2d, 0x44, 0x50, 0x46, 0x2d, 0x50, 0x52, 0x47, 0x2d, 0x76, 0x31,
+};
+
+struct RoundKeys {
+    alignas(16) uint8_t bytes[11][16];
+};
+
+inline RoundKeys expand_key(const uint8_t key[16]) {
+    RoundKeys rk;
+    std::memcpy(rk.bytes[0], key, 16);
+    uint8_t rcon = 1;
+    for (int r = 1; r <= 10; r++) {
+        const uint8_t* prev = rk.bytes[r - 1];
+        uint8_t* cur = rk.bytes[r];
+        uint8_t t[4] = {SBOX[prev[13]], SBOX[prev[14]], SBOX[prev[15]], SBOX[prev[12]]};
+        t[0] ^= rcon;
+        rcon = (rcon << 1) ^ ((rcon & 0x80) ? 0x1b : 0);
+        for (int i = 0; i < 16; i++) {
+            cur[i] = prev[i] ^ (i < 4 ? t[i] : cur[i - 4]);
+        }
+    }
+    return rk;
+}
+
+inline const RoundKeys& round_keys() {
+    static const RoundKeys rk = expand_key(FIXED_KEY);
+    return rk;
+}
+
+inline uint8_t xtime(uint8_t x) {
+    return (uint8_t)((x << 1) ^ ((x & 0x80) ? 0x1b : 0));
+}
+
+inline void aes_encrypt_portable(const RoundKeys& rk, uint8_t block[16]) {
+    for (int i = 0; i < 16; i++) block[i] ^= rk.bytes[0][i];
+    for (int r = 1; r <= 10; r++) {
+        uint8_t s[16];
+        // SubBytes and ShiftRows; the state is column-major, byte i is row i % 4.
+        for (int i = 0; i < 16; i++) s[i] = SBOX[block[(i + 4 * (i % 4)) % 16]];
+        if (r < 10) {
+            for (int c = 0; c < 4; c++) {
+                uint8_t* col = s + 4 * c;
+                uint8_t all = col[0] ^ col[1] ^ col[2] ^ col[3];
+                uint8_t c0 = col[0];
+                col[0] ^= all ^ xtime(col[0] ^ col[1]);
+                col[1] ^= all ^ xtime(col[1] ^ col[2]);
+                col[2] ^= all ^ xtime(col[2] ^ col[3]);
+                col[3] ^= all ^ xtime(col[3] ^ c0);
+            }
+        }
+        for (int i = 0; i < 16; i++) block[i] = s[i] ^ rk.bytes[r][i];
+    }
+}
+
+inline void load_block(uint8_t block[16], uint64_t seed, uint64_t tweak) {
+    for (int i = 0; i < 8; i++) {
+        block[i] = (uint8_t)(seed >> (8 * i));
+        block[8 + i] = (uint8_t)(tweak >> (8 * i));
+    }
+}
+
+inline uint64_t block_low(const uint8_t block[16]) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = (v << 8) | block[i];
+    return v;
+}
+
+// Signatures shared by all implementations. ExpandFn expands seeds[0..count) into
+// left/right child seeds and control bits; HashFn computes H(in[n]) into out[n].
+using ExpandFn = void (*)(const uint64_t* seeds, size_t count,
+                          uint64_t* left, uint64_t* right, uint8_t* f_left, uint8_t* f_right);
+using HashFn = void (*)(const uint64_t* in, size_t count, uint64_t* out);
+using ConvertFn = void (*)(const uint64_t* seeds, size_t count, size_t words, uint64_t* out);
+
+constexpr uint64_t HASH_TWEAK = 2;
+constexpr uint64_t CONVERT_TWEAK = 3;
+
+inline uint64_t sigma(uint64_t x) {
+    return ((x ^ (x >> 32)) << 32) | (x >> 32);
+}
+
+inline void expand_portable(const uint64_t* seeds, size_t count,
+                            uint64_t* left, uint64_t* right, uint8_t* f_left, uint8_t* f_right) {
+    const RoundKeys& rk = round_keys();
+    for (size_t n = 0; n < count; n++) {
+        uint8_t in[2][16], out[2][16];
+        load_block(in[0], seeds[n], 0);
+        load_block(in[1], seeds[n], 1);
+        std::memcpy(out, in, sizeof(in));
+        aes_encrypt_portable(rk, out[0]);
+        aes_encrypt_portable(rk, out[1]);
+        for (int i = 0; i < 16; i++) {
+            out[0][i] ^= in[0][i];
+            out[1][i] ^= in[1][i];
+        }
+        left[n] = block_low(out[0]);
+        right[n] = block_low(out[1]);
+        f_left[n] = out[0][8] & 1;
+        f_right[n] = out[1][8] & 1;
+    }
+}
+
+inline void hash_portable(const uint64_t* in, size_t count, uint64_t* out) {
+    const RoundKeys& rk = round_keys();
+    for (size_t n = 0; n < count; n++) {
+        uint8_t b[16], x[16];
+        load_block(b, sigma(in[n]), HASH_TWEAK);
+        std::memcpy(x, b, 16);
+        aes_encrypt_portable(rk, x);
+        for (int i = 0; i < 16; i++) x[i] ^= b[i];
+        out[n] = block_low(x);
+    }
+}
+
+inline void convert_portable(const uint64_t* seeds, size_t count, size_t words, uint64_t* out) {
+    const RoundKeys& rk = round_keys();
+    for (size_t n = 0; n < count; n++) {
+        for (size_t i = 0; i < words / 2; i++) {
+            uint8_t b[16], x[16];
+            load_block(b, seeds[n], CONVERT_TWEAK + i);
+            std::memcpy(x, b, 16);
+            aes_encrypt_portable(rk, x);
+            for (int j = 0; j < 16; j++) x[j] ^= b[j];
+            out[n * words + 2 * i] = block_low(x);
+            out[n * words + 2 * i + 1] = block_low(x + 8);
+        }
+    }
+}
+
+#ifdef PRG_HAVE_X86_AES
+
+__attribute__((target("aes,sse4.1")))
+inline void convert_aesni(const uint64_t* seeds, size_t count, size_t words, uint64_t* out) {
+    const RoundKeys& rk = round_keys();
+    __m128i k[11];
+    for (int r = 0; r <= 10; r++) k[r] = _mm_load_si128(reinterpret_cast<const __m128i*>(rk.bytes[r]));
+
+    // The blocks of all seeds are flattened so that eight are always in flight, whatever
+    // the number of words per seed.
+    constexpr size_t W = 8;
+    size_t per_seed = words / 2, total = count * per_seed;
+    for (size_t base = 0; base < total; base += W) {
+        size_t width = total - base < W ? total - base : W;
+        __m128i b[W], x[W];
+        for (size_t j = 0; j < width; j++) {
+            size_t n = (base + j) / per_seed, i = (base + j) % per_seed;
+            b[j] = _mm_set_epi64x((long long)(CONVERT_TWEAK + i), (long long)seeds[n]);
+            x[j] = _mm_xor_si128(b[j], k[0]);
+        }
+        for (int r = 1; r < 10; r++) {
+            for (size_t j = 0; j < width; j++) x[j] = _mm_aesenc_si128(x[j], k[r]);
+        }
+        for (size_t j = 0; j < width; j++) {
+            x[j] = _mm_xor_si128(_mm_aesenclast_si128(x[j], k[10]), b[j]);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * (base + j)), x[j]);
+        }
+    }
+}
+
+__attribute__((target("aes,sse4.1")))
+inline void hash_aesni(const uint64_t* in, size_t count, uint64_t* out) {
+    const RoundKeys& rk = round_keys();
+    __m128i k[11];
+    for (int r = 0; r <= 10; r++) k[r] = _mm_load_si128(reinterpret_cast<const __m128i*>(rk.bytes[r]));
+
+    constexpr size_t W = 8;
+    size_t n = 0;
+    for (; n < count; n += W) {
+        size_t width = count - n < W ? count - n : W;
+        __m128i b[W], x[W];
+        for (size_t j = 0; j < width; j++) {
+            b[j] = _mm_set_epi64x((long long)HASH_TWEAK, (long long)sigma(in[n + j]));
+            x[j] = _mm_xor_si128(b[j], k[0]);
+        }
+        for (int r = 1; r < 10; r++) {
+            for (size_t j = 0; j < width; j++) x[j] = _mm_aesenc_si128(x[j], k[r]);
+        }
+        for (size_t j = 0; j < width; j++) {
+            out[n + j] = (uint64_t)_mm_cvtsi128_si64(_mm_xor_si128(_mm_aesenclast_si128(x[j], k[10]), b[j]));
+        }
+    }
+}
+
+// A round key in all four 128-bit lanes. The zero-masked intrinsics here and below stand in
+// for the plain ones, which GCC 12 builds from an undefined register and reports under -Wall.
+__attribute__((target("avx512f")))
+inline __m512i broadcast_round_key(const uint8_t* bytes) {
+    return _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_load_si128(reinterpret_cast<const __m128i*>(bytes)));
+}
+
+__attribute__((target("avx512f,vaes,aes,sse4.1")))
+inline void hash_vaes(const uint64_t* in, size_t count, uint64_t* out) {
+    const RoundKeys& rk = round_keys();
+    __m512i k[11];
+    for (int r = 0; r <= 10; r++) k[r] = broadcast_round_key(rk.bytes[r]);
+    // Four blocks (sigma(x), 2) per register: the inputs go to the even 64-bit words.
+    const __m512i spread = _mm512_set_epi64(0, 3, 0, 2, 0, 1, 0, 0);
+    const __m512i tweak = _mm512_set_epi64(HASH_TWEAK, 0, HASH_TWEAK, 0, HASH_TWEAK, 0, HASH_TWEAK, 0);
+    const __m512i gather_low = _mm512_set_epi64(0, 0, 0, 0, 6, 4, 2, 0);
+
+    constexpr size_t W = 16;
+    size_t n = 0;
+    for (; n + W <= count; n += W) {
+        __m512i b[W / 4], x[W / 4];
+        for (size_t j = 0; j < W / 4; j++) {
+            __m256i quad = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + n + 4 * j));
+            // sigma on four lanes at once.
+            __m256i mixed = _mm256_xor_si256(quad, _mm256_srli_epi64(quad, 32));
+            quad = _mm256_or_si256(_mm256_slli_epi64(mixed, 32), _mm256_srli_epi64(quad, 32));
+            b[j] = _mm512_or_si512(_mm512_maskz_permutexvar_epi64(0x55, spread, _mm512_castsi256_si512(quad)), tweak);
+            x[j] = _mm512_xor_si512(b[j], k[0]);
+        }
+        for (int r = 1; r < 10; r++) {
+            for (size_t j = 0; j < W / 4; j++) x[j] = _mm512_aesenc_epi128(x[j], k[r]);
+        }
+        for (size_t j = 0; j < W / 4; j++) {
+            x[j] = _mm512_xor_si512(_mm512_aesenclast_epi128(x[j], k[10]), b[j]);
+            __m512i low = _mm512_maskz_permutexvar_epi64(0x0F, gather_low, x[j]);
+            _mm512_mask_storeu_epi64(out + n + 4 * j, 0x0F, low);
+        }
+    }
+    if (n < count) hash_aesni(in + n, count - n, out + n);
+}
+
+__attribute__((target("aes,sse4.1")))
+inline void expand_aesni(const uint64_t* seeds, size_t count,
+                         uint64_t* left, uint64_t* right, uint8_t* f_left, uint8_t* f_right) {
+    const RoundKeys& rk = round_keys();
+    __m128i k[11];
+    for (int r = 0; r <= 10; r++) k[r] = _mm_load_si128(reinterpret_cast<const __m128i*>(rk.bytes[r]));
+
+    // Four nodes (eight blocks) per step keep enough independent AES rounds in flight
+    // to cover the latency of aesenc.
+    constexpr size_t W = 4;
+    size_t n = 0;
+    for (; n + W <= count; n += W) {
+        __m128i in[2 * W], x[2 * W];
+        for (size_t j = 0; j < W; j++) {
+            in[2*j] = _mm_set_epi64x(0, (long long)seeds[n + j]);
+            in[2*j+1] = _mm_set_epi64x(1, (long long)seeds[n + j]);
+        }
+        for (size_t j = 0; j < 2 * W; j++) x[j] = _mm_xor_si128(in[j], k[0]);
+        for (int r = 1; r < 10; r++) {
+            for (size_t j = 0; j < 2 * W; j++) x[j] = _mm_aesenc_si128(x[j], k[r]);
+        }
+        for (size_t j = 0; j < 2 * W; j++) x[j] = _mm_xor_si128(_mm_aesenclast_si128(x[j], k[10]), in[j]);
+        for (size_t j = 0; j < W; j++) {
+            left[n + j] = (uint64_t)_mm_cvtsi128_si64(x[2*j]);
+            right[n + j] = (uint64_t)_mm_cvtsi128_si64(x[2*j+1]);
+            f_left[n + j] = (uint8_t)(_mm_extract_epi64(x[2*j], 1) & 1);
+            f_right[n + j] = (uint8_t)(_mm_extract_epi64(x[2*j+1], 1) & 1);
+        }
+    }
+    for (; n < count; n++) {
+        __m128i in0 = _mm_set_epi64x(0, (long long)seeds[n]);
+        __m128i in1 = _mm_set_epi64x(1, (long long)seeds[n]);
+        __m128i x0 = _mm_xor_si128(in0, k[0]), x1 = _mm_xor_si128(in1, k[0]);
+        for (int r = 1; r < 10; r++) {
+            x0 = _mm_aesenc_si128(x0, k[r]);
+            x1 = _mm_aesenc_si128(x1, k[r]);
+        }
+        x0 = _mm_xor_si128(_mm_aesenclast_si128(x0, k[10]), in0);
+        x1 = _mm_xor_si128(_mm_aesenclast_si128(x1, k[10]), in1);
+        left[n] = (uint64_t)_mm_cvtsi128_si64(x0);
+        right[n] = (uint64_t)_mm_cvtsi128_si64(x1);
+        f_left[n] = (uint8_t)(_mm_extract_epi64(x0, 1) & 1);
+        f_right[n] = (uint8_t)(_mm_extract_epi64(x1, 1) & 1);
+    }
+}
+
+__attribute__((target("avx512f,vaes,aes,sse4.1")))
+inline void expand_vaes(const uint64_t* seeds, size_t count,
+                        uint64_t* left, uint64_t* right, uint8_t* f_left, uint8_t* f_right) {
+    const RoundKeys& rk = round_keys();
+    __m512i k[11];
+    for (int r = 0; r <= 10; r++) k[r] = broadcast_round_key(rk.bytes[r]);
+    // Each register holds the blocks (a, 0), (a, 1), (b, 0), (b, 1) for two nodes a, b:
+    // the seeds go to the even 64-bit words and the tweaks to the odd ones.
+    const __m512i spread = _mm512_set_epi64(0, 1, 0, 1, 0, 0, 0, 0);
+    const __m512i tweak = _mm512_set_epi64(1, 0, 0, 0, 1, 0, 0, 0);
+
+    // Eight nodes (sixteen blocks) per step, two nodes per register.
+    constexpr size_t W = 8;
+    size_t n = 0;
+    for (; n + W <= count; n += W) {
+        __m512i in[W / 2], x[W / 2];
+        for (size_t j = 0; j < W / 2; j++) {
+            __m512i pair = _mm512_castsi128_si512(_mm_loadu_si128(reinterpret_cast<const __m128i*>(seeds + n + 2 * j)));
+            in[j] = _mm512_or_si512(_mm512_maskz_permutexvar_epi64(0x55, spread, pair), tweak);
+            x[j] = _mm512_xor_si512(in[j], k[0]);
+        }
+        for (int r = 1; r < 10; r++) {
+            for (size_t j = 0; j < W / 2; j++) x[j] = _mm512_aesenc_epi128(x[j], k[r]);
+        }
+        for (size_t j = 0; j < W / 2; j++) {
+            x[j] = _mm512_xor_si512(_mm512_aesenclast_epi128(x[j], k[10]), in[j]);
+            alignas(64) uint64_t words[8];
+            _mm512_store_si512(reinterpret_cast<__m512i*>(words), x[j]);
+            left[n + 2*j] = words[0];      f_left[n + 2*j] = (uint8_t)(words[1] & 1);
+            right[n + 2*j] = words[2];     f_right[n + 2*j] = (uint8_t)(words[3] & 1);
+            left[n + 2*j + 1] = words[4];  f_left[n + 2*j + 1] = (uint8_t)(words[5] & 1);
+            right[n + 2*j + 1] = words[6]; f_right[n + 2*j + 1] = (uint8_t)(words[7] & 1);
+        }
+    }
+    if (n < count) expand_aesni(seeds + n, count - n, left + n, right + n, f_left + n, f_right + n);
+}
+
+#endif
+
+struct Impl {
+    const char* name;
+    ExpandFn expand;
+    HashFn hash;
+    ConvertFn convert;
+};
+
+inline Impl select_impl() {
+    const Impl portable = {"portable", expand_portable, hash_portable, convert_portable};
+    const char* forced = std::getenv("PRG_IMPL");
+    std::string want = forced ? forced : "";
+    if (want == "portable") return portable;
+#ifdef PRG_HAVE_X86_AES
+    const Impl aesni = {"aesni", expand_aesni, hash_aesni, convert_aesni};
+    // Leaf conversion is a small share of the work, so VAES reuses the AES-NI version.
+    const Impl vaes = {"vaes", expand_vaes, hash_vaes, convert_aesni};
+    __builtin_cpu_init();
+    bool has_aes = __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse4.1");
+    bool has_vaes = has_aes && __builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx512f");
+    if (want == "aesni" && has_aes) return aesni;
+    if ((want.empty() || want == "vaes") && has_vaes) return vaes;
+    if (has_aes) return aesni;
+#endif
+    return portable;
+}
+
+inline const Impl& impl() {
+    static const Impl selected = select_impl();
+    return selected;
+}
+
+} // namespace prg_detail
+
+// Expands `count` seeds at once. Children of seeds[n] are (left[n], f_left[n]) and
+// (right[n], f_right[n]).
+inline void prg_expand_batch(const uint64_t* seeds, size_t count,
+                             uint64_t* left, uint64_t* right, uint8_t* f_left, uint8_t* f_right) {
+    prg_detail::impl().expand(seeds, count, left, right, f_left, f_right);
+}
+
+// out[n] = H(in[n]) for the half-tree DPF.
+inline void prg_hash_batch(const uint64_t* in, size_t count, uint64_t* out) {
+    prg_detail::impl().hash(in, count, out);
+}
+
+// Converts each seed into `words` (even) output words: out[n * words + i] is word i of
+// seeds[n].
+inline void prg_convert_batch(const uint64_t* seeds, size_t count, size_t words, uint64_t* out) {
+    prg_detail::impl().convert(seeds, count, words, out);
+}
+
+// Name of the implementation the batch functions dispatch to, for logs and benchmarks.
+inline const char* prg_impl_name() {
+    return prg_detail::impl().name;
+}
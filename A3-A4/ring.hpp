@@ -0,0 +1,65 @@
+#pragma once
+
+// Elements of the share ring Z_2^w, for w = 32 or 64. Arithmetic is done on unsigned words,
+// so wraparound is well defined (signed overflow on int64_t is not).
+//
+// Shares are kept in int64_t words in memory, because the DPF evaluators and the vector
+// kernels work on 64-bit lanes. A share of Z_2^32 is held as its signed representative,
+// the sign extension of its low 32 bits. Only the low w bits of a word carry the share,
+// so any mix of additions and multiplications done mod 2^64 is also correct mod 2^32.
+// ring_encode()/ring_decode() convert between the in-memory words and w-bit words on the
+// wire and in files.
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+template <class T>
+struct Ring {
+    static_assert(std::is_unsigned_v<T>, "Ring<T> needs an unsigned word type");
+    static constexpr unsigned bits = sizeof(T) * 8;
+
+    T value = 0;
+
+    constexpr Ring() = default;
+    constexpr explicit Ring(int64_t x) : value((T)(uint64_t)x) {}
+
+    static constexpr Ring from_word(T w) {
+        Ring r;
+        r.value = w;
+        return r;
+    }
+
+    // The representative in [-2^(w-1), 2^(w-1)).
+    constexpr int64_t to_signed() const { return (int64_t)(std::make_signed_t<T>)value; }
+
+    friend constexpr Ring operator+(Ring a, Ring b) { return from_word((T)(a.value + b.value)); }
+    friend constexpr Ring operator-(Ring a, Ring b) { return from_word((T)(a.value - b.value)); }
+    friend constexpr Ring operator*(Ring a, Ring b) { return from_word((T)(a.value * b.value)); }
+    friend constexpr Ring operator-(Ring a) { return from_word((T)(T(0) - a.value)); }
+    friend constexpr bool operator==(Ring a, Ring b) { return a.value == b.value; }
+
+    constexpr Ring& operator+=(Ring b) { return *this = *this + b; }
+    constexpr Ring& operator-=(Ring b) { return *this = *this - b; }
+    constexpr Ring& operator*=(Ring b) { return *this = *this * b; }
+};
+
+using Z2_32 = Ring<uint32_t>;
+using Z2_64 = Ring<uint64_t>;
+
+constexpr bool valid_ring_bits(uint32_t bits) { return bits == 32 || bits == 64; }
+
+// Reduces a word to the signed representative of its class mod 2^bits.
+constexpr int64_t ring_reduce(int64_t x, uint32_t bits) {
+    return bits == 32 ? Z2_32(x).to_signed() : x;
+}
+
+template <class T>
+void ring_encode(const int64_t* in, size_t n, T* out) {
+    for (size_t i = 0; i < n; i++) out[i] = Ring<T>(in[i]).value;
+}
+
+template <class T>
+void ring_decode(const T* in, size_t n, int64_t* out) {
+    for (size_t i = 0; i < n; i++) out[i] = Ring<T>::from_word(in[i]).to_signed();
+}
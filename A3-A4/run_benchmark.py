@@ -4,8 +4,9 @@ Assignment 4: Benchmark Script
 Runs MPC protocol with varying parameters and plots results directly (no CSV files).
 
 This script:
-1. Modifies constants.hpp with different parameter values
-2. Runs the full workflow (gen_queries -> docker -> extract results)
+1. Builds gen_queries and the Docker images once
+2. Runs the full workflow for each parameter set (gen_queries --m/--n/--k/--q -> docker -> extract results);
+   the parties read the parameters from data/params.txt, so nothing is rebuilt between runs
 3. Parses timing data from Docker console output
 4. Plots results directly in memory without saving CSVs
 """
@@ -22,19 +23,15 @@ import sys
 import os
 import time
 
-def update_constants(m, n, k, q):
-    """Update constants.hpp with new parameter values"""
-    constants_file = Path("constants.hpp")
-    content = constants_file.read_text()
-    
-    # Replace the constant values
-    content = re.sub(r'constexpr uint32_t M = \d+;', f'constexpr uint32_t M = {m};', content)
-    content = re.sub(r'constexpr uint32_t N = \d+;', f'constexpr uint32_t N = {n};', content)
-    content = re.sub(r'constexpr uint32_t K = \d+;', f'constexpr uint32_t K = {k};', content)
-    content = re.sub(r'constexpr uint32_t Q = \d+;', f'constexpr uint32_t Q = {q};', content)
-    
-    constants_file.write_text(content)
-    print(f"Updated constants.hpp: m={m}, n={n}, k={k}, q={q}")
+def gen_queries_exe():
+    exe_suffix = ".exe" if sys.platform == "win32" else ""
+    return f"gen_queries{exe_suffix}"
+
+def build_once(work_dir):
+    """Build gen_queries and the party images; later runs only restart the containers"""
+    print("\nBuilding gen_queries and Docker images...")
+    run_command(["g++", "-std=c++20", "-O2", "gen_queries.cpp", "-o", gen_queries_exe()], cwd=work_dir)
+    run_command(["docker-compose", "build"], cwd=work_dir, shell=sys.platform == "win32")
 
 def run_command(cmd, cwd=None, shell=False):
     """Run a command and return stdout"""
@@ -92,21 +89,13 @@ def run_single_benchmark(m, n, k, q, work_dir):
     print(f"Running benchmark: m={m}, n={n}, k={k}, q={q}")
     print(f"{'='*60}")
     
-    # Update constants
-    update_constants(m, n, k, q)
-    
-    # Step 1: Generate data and queries
+    # Step 1: Generate data and queries (this also writes data/params.txt for the parties)
     print("\n[1/3] Generating initial data and queries...")
-    exe_suffix = ".exe" if sys.platform == "win32" else ""
-    
-    gen_queries_exe = f"gen_queries{exe_suffix}"
-    
-    run_command(["g++", "-std=c++20", "gen_queries.cpp", "-o", gen_queries_exe], cwd=work_dir)
-    
     data_dir = work_dir / "data"
     data_dir.mkdir(exist_ok=True)
     
-    run_command([gen_queries_exe, str(data_dir)], cwd=work_dir)
+    exe = str(work_dir / gen_queries_exe())
+    run_command([exe, str(data_dir), f"--m={m}", f"--n={n}", f"--k={k}", f"--q={q}"], cwd=work_dir)
     
     # Step 2: Run Docker
     print("\n[2/3] Running MPC protocol in Docker...")
@@ -120,7 +109,7 @@ def run_single_benchmark(m, n, k, q, work_dir):
     # Use shell=True on Windows for better compatibility
     use_shell = sys.platform == "win32"
     result = subprocess.run(
-        ["docker-compose", "up", "--build", "--force-recreate"],
+        ["docker-compose", "up", "--force-recreate"],
         cwd=work_dir,
         capture_output=True,
         text=True,
@@ -317,6 +306,9 @@ def main():
     else:
         print("\nProceeding automatically (--yes flag provided)...")
 
+    if not dry_run:
+        build_once(work_dir)
+
     # Helper to run a sweep and return arrays
     def run_sweep(param_name, values):
         user_times = []
@@ -0,0 +1,119 @@
+#pragma once
+
+// Lazy arithmetic on share vectors. share(v) wraps a vector without copying it. Then +, - and
+// multiplication by a scalar build an expression tree instead of a result, and eval_into()
+// runs the whole tree in a single loop over the elements:
+//
+//   eval_into(out, share(c) + (share(v) + share(pv)) * s - share(b) * ps);
+//
+// This makes one pass over memory and allocates nothing, where the equivalent chain of
+// vec_* calls makes one pass and one temporary per operator. The arithmetic wraps mod 2^64.
+// Trees that are a single kernel (a + b, a - b, a * s, and a + b * s written back into a)
+// go to the simd.hpp kernels; larger trees run as one scalar loop.
+// Element i of the result reads only element i of each operand, so `out` may be one of
+// the operands. Expressions hold references to their operands and must not outlive them.
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+#include "simd.hpp"
+
+namespace share_expr {
+
+template <class E>
+struct Expr {
+    const E& self() const { return static_cast<const E&>(*this); }
+};
+
+// A share vector (or a slice of one).
+struct Leaf : Expr<Leaf> {
+    const int64_t* data;
+    size_t n;
+    uint64_t at(size_t i) const { return (uint64_t)data[i]; }
+    size_t size() const { return n; }
+};
+
+template <class L, class R, bool Subtract>
+struct Sum : Expr<Sum<L, R, Subtract>> {
+    L lhs;
+    R rhs;
+    Sum(const L& l, const R& r) : lhs(l), rhs(r) { assert(l.size() == r.size()); }
+    uint64_t at(size_t i) const { return Subtract ? lhs.at(i) - rhs.at(i) : lhs.at(i) + rhs.at(i); }
+    size_t size() const { return lhs.size(); }
+};
+
+template <class E>
+struct Scaled : Expr<Scaled<E>> {
+    E inner;
+    uint64_t scalar;
+    Scaled(const E& e, int64_t s) : inner(e), scalar((uint64_t)s) {}
+    uint64_t at(size_t i) const { return inner.at(i) * scalar; }
+    size_t size() const { return inner.size(); }
+};
+
+// Nodes are small and hold their children by value, so a tree lives in registers.
+template <class L, class R>
+Sum<L, R, false> operator+(const Expr<L>& l, const Expr<R>& r) { return {l.self(), r.self()}; }
+
+template <class L, class R>
+Sum<L, R, true> operator-(const Expr<L>& l, const Expr<R>& r) { return {l.self(), r.self()}; }
+
+template <class E>
+Scaled<E> operator*(const Expr<E>& e, int64_t s) { return {e.self(), s}; }
+
+template <class E>
+Scaled<E> operator*(int64_t s, const Expr<E>& e) { return {e.self(), s}; }
+
+template <class E>
+Scaled<E> operator-(const Expr<E>& e) { return {e.self(), -1}; }
+
+// dst[i] = e.at(i) for i < e.size(). The overloads below pick out the trees that match a
+// simd.hpp kernel; partial ordering prefers them over this general loop.
+template <class E>
+void eval_fused(int64_t* dst, const E& e) {
+    size_t n = e.size();
+    for (size_t i = 0; i < n; i++) dst[i] = (int64_t)e.at(i);
+}
+
+template <class E>
+void eval(int64_t* dst, const E& e) { eval_fused(dst, e); }
+
+template <bool Subtract>
+void eval(int64_t* dst, const Sum<Leaf, Leaf, Subtract>& e) {
+    if constexpr (Subtract) share_sub(dst, e.lhs.data, e.rhs.data, e.size());
+    else share_add(dst, e.lhs.data, e.rhs.data, e.size());
+}
+
+inline void eval(int64_t* dst, const Scaled<Leaf>& e) {
+    share_scalar_mul(dst, e.inner.data, (int64_t)e.scalar, e.size());
+}
+
+// The kernel accumulates in place, so it only applies when dst is the left operand.
+inline void eval(int64_t* dst, const Sum<Leaf, Scaled<Leaf>, false>& e) {
+    if (dst == e.lhs.data) share_scalar_mul_add(dst, e.rhs.inner.data, (int64_t)e.rhs.scalar, e.size());
+    else eval_fused(dst, e);
+}
+
+} // namespace share_expr
+
+template <class Alloc>
+share_expr::Leaf share(const std::vector<int64_t, Alloc>& v) { return {{}, v.data(), v.size()}; }
+inline share_expr::Leaf share(std::span<const int64_t> v) { return {{}, v.data(), v.size()}; }
+
+// out = e, in one pass. `out` is resized to the expression's length.
+template <class Alloc, class E>
+void eval_into(std::vector<int64_t, Alloc>& out, const share_expr::Expr<E>& e) {
+    out.resize(e.self().size());
+    share_expr::eval(out.data(), e.self());
+}
+
+// out[0, e.size()) = e, for writing into a slice such as a matrix row.
+template <class E>
+void eval_into(std::span<int64_t> out, const share_expr::Expr<E>& e) {
+    assert(out.size() >= e.self().size());
+    share_expr::eval(out.data(), e.self());
+}
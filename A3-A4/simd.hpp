@@ -0,0 +1,249 @@
+#pragma once
+
+// Vector kernels for share arithmetic over Z_2^64. Every operation wraps mod 2^64, and
+// outputs may alias inputs, so the same kernels serve in-place updates.
+//
+// AVX-512 (with DQ's native 64-bit multiply) and AVX2 versions are selected at runtime;
+// AVX2 has no 64-bit multiply, so it is built from three 32x32->64 products:
+//   a * b mod 2^64 = lo(a) * lo(b) + ((hi(a) * lo(b) + lo(a) * hi(b)) << 32).
+// A portable loop covers everything else, and SIMD_IMPL=avx512|avx2|portable forces one
+// for comparison.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SIMD_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+namespace simd_detail {
+
+using BinaryFn = void (*)(int64_t* out, const int64_t* a, const int64_t* b, size_t n);
+using ScalarFn = void (*)(int64_t* out, const int64_t* a, int64_t s, size_t n);
+using DotFn = int64_t (*)(const int64_t* a, const int64_t* b, size_t n);
+
+inline void add_portable(int64_t* out, const int64_t* a, const int64_t* b, size_t n) {
+    for (size_t i = 0; i < n; i++) out[i] = (int64_t)((uint64_t)a[i] + (uint64_t)b[i]);
+}
+
+inline void sub_portable(int64_t* out, const int64_t* a, const int64_t* b, size_t n) {
+    for (size_t i = 0; i < n; i++) out[i] = (int64_t)((uint64_t)a[i] - (uint64_t)b[i]);
+}
+
+inline void scalar_mul_portable(int64_t* out, const int64_t* a, int64_t s, size_t n) {
+    for (size_t i = 0; i < n; i++) out[i] = (int64_t)((uint64_t)a[i] * (uint64_t)s);
+}
+
+inline void scalar_mul_add_portable(int64_t* out, const int64_t* a, int64_t s, size_t n) {
+    for (size_t i = 0; i < n; i++) out[i] = (int64_t)((uint64_t)out[i] + (uint64_t)a[i] * (uint64_t)s);
+}
+
+inline int64_t dot_portable(const int64_t* a, const int64_t* b, size_t n) {
+    uint64_t acc = 0;
+    for (size_t i = 0; i < n; i++) acc += (uint64_t)a[i] * (uint64_t)b[i];
+    return (int64_t)acc;
+}
+
+#ifdef SIMD_HAVE_X86
+
+__attribute__((target("avx2")))
+inline __m256i mul64_avx2(__m256i a, __m256i b) {
+    __m256i lo = _mm256_mul_epu32(a, b);
+    __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                                     _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+__attribute__((target("avx2")))
+inline void add_avx2(int64_t* out, const int64_t* a, const int64_t* b, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_add_epi64(x, y));
+    }
+    add_portable(out + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void sub_avx2(int64_t* out, const int64_t* a, const int64_t* b, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_sub_epi64(x, y));
+    }
+    sub_portable(out + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void scalar_mul_avx2(int64_t* out, const int64_t* a, int64_t s, size_t n) {
+    __m256i sv = _mm256_set1_epi64x(s);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), mul64_avx2(x, sv));
+    }
+    scalar_mul_portable(out + i, a + i, s, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void scalar_mul_add_avx2(int64_t* out, const int64_t* a, int64_t s, size_t n) {
+    __m256i sv = _mm256_set1_epi64x(s);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i acc = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(out + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_add_epi64(acc, mul64_avx2(x, sv)));
+    }
+    scalar_mul_add_portable(out + i, a + i, s, n - i);
+}
+
+__attribute__((target("avx2")))
+inline int64_t dot_avx2(const int64_t* a, const int64_t* b, size_t n) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        acc = _mm256_add_epi64(acc, mul64_avx2(x, y));
+    }
+    alignas(32) uint64_t lanes[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), acc);
+    uint64_t total = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    return (int64_t)(total + (uint64_t)dot_portable(a + i, b + i, n - i));
+}
+
+// The AVX-512 kernels handle the tail with masked loads and stores instead of a scalar loop.
+__attribute__((target("avx512f")))
+inline __mmask8 tail_mask(size_t remaining) {
+    return remaining >= 8 ? (__mmask8)0xFF : (__mmask8)((1u << remaining) - 1);
+}
+
+__attribute__((target("avx512f")))
+inline void add_avx512(int64_t* out, const int64_t* a, const int64_t* b, size_t n) {
+    for (size_t i = 0; i < n; i += 8) {
+        __mmask8 m = tail_mask(n - i);
+        __m512i x = _mm512_maskz_loadu_epi64(m, a + i);
+        __m512i y = _mm512_maskz_loadu_epi64(m, b + i);
+        _mm512_mask_storeu_epi64(out + i, m, _mm512_add_epi64(x, y));
+    }
+}
+
+__attribute__((target("avx512f")))
+inline void sub_avx512(int64_t* out, const int64_t* a, const int64_t* b, size_t n) {
+    for (size_t i = 0; i < n; i += 8) {
+        __mmask8 m = tail_mask(n - i);
+        __m512i x = _mm512_maskz_loadu_epi64(m, a + i);
+        __m512i y = _mm512_maskz_loadu_epi64(m, b + i);
+        _mm512_mask_storeu_epi64(out + i, m, _mm512_sub_epi64(x, y));
+    }
+}
+
+__attribute__((target("avx512f,avx512dq")))
+inline void scalar_mul_avx512(int64_t* out, const int64_t* a, int64_t s, size_t n) {
+    __m512i sv = _mm512_set1_epi64(s);
+    for (size_t i = 0; i < n; i += 8) {
+        __mmask8 m = tail_mask(n - i);
+        __m512i x = _mm512_maskz_loadu_epi64(m, a + i);
+        _mm512_mask_storeu_epi64(out + i, m, _mm512_mullo_epi64(x, sv));
+    }
+}
+
+__attribute__((target("avx512f,avx512dq")))
+inline void scalar_mul_add_avx512(int64_t* out, const int64_t* a, int64_t s, size_t n) {
+    __m512i sv = _mm512_set1_epi64(s);
+    for (size_t i = 0; i < n; i += 8) {
+        __mmask8 m = tail_mask(n - i);
+        __m512i x = _mm512_maskz_loadu_epi64(m, a + i);
+        __m512i acc = _mm512_maskz_loadu_epi64(m, out + i);
+        _mm512_mask_storeu_epi64(out + i, m, _mm512_add_epi64(acc, _mm512_mullo_epi64(x, sv)));
+    }
+}
+
+__attribute__((target("avx512f,avx512dq")))
+inline int64_t dot_avx512(const int64_t* a, const int64_t* b, size_t n) {
+    __m512i acc = _mm512_setzero_si512();
+    for (size_t i = 0; i < n; i += 8) {
+        __mmask8 m = tail_mask(n - i);
+        __m512i x = _mm512_maskz_loadu_epi64(m, a + i);
+        __m512i y = _mm512_maskz_loadu_epi64(m, b + i);
+        acc = _mm512_add_epi64(acc, _mm512_mullo_epi64(x, y));
+    }
+    // Summed through memory: _mm512_reduce_add_epi64 trips GCC 12's -Wuninitialized.
+    alignas(64) uint64_t lanes[8];
+    _mm512_store_si512(lanes, acc);
+    uint64_t sum = 0;
+    for (uint64_t lane : lanes) sum += lane;
+    return (int64_t)sum;
+}
+
+#endif
+
+struct Kernels {
+    const char* name;
+    BinaryFn add;
+    BinaryFn sub;
+    ScalarFn scalar_mul;
+    ScalarFn scalar_mul_add;
+    DotFn dot;
+};
+
+inline Kernels select_kernels() {
+    const Kernels portable = {"portable", add_portable, sub_portable, scalar_mul_portable,
+                              scalar_mul_add_portable, dot_portable};
+    const char* forced = std::getenv("SIMD_IMPL");
+    std::string want = forced ? forced : "";
+    if (want == "portable") return portable;
+#ifdef SIMD_HAVE_X86
+    const Kernels avx2 = {"avx2", add_avx2, sub_avx2, scalar_mul_avx2, scalar_mul_add_avx2, dot_avx2};
+    const Kernels avx512 = {"avx512", add_avx512, sub_avx512, scalar_mul_avx512, scalar_mul_add_avx512, dot_avx512};
+    __builtin_cpu_init();
+    bool has_avx2 = __builtin_cpu_supports("avx2");
+    bool has_avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq");
+    if (want == "avx2" && has_avx2) return avx2;
+    if ((want.empty() || want == "avx512") && has_avx512) return avx512;
+    if (has_avx2) return avx2;
+#endif
+    return portable;
+}
+
+inline const Kernels& kernels() {
+    static const Kernels selected = select_kernels();
+    return selected;
+}
+
+} // namespace simd_detail
+
+// out[i] = a[i] + b[i]
+inline void share_add(int64_t* out, const int64_t* a, const int64_t* b, size_t n) {
+    simd_detail::kernels().add(out, a, b, n);
+}
+
+// out[i] = a[i] - b[i]
+inline void share_sub(int64_t* out, const int64_t* a, const int64_t* b, size_t n) {
+    simd_detail::kernels().sub(out, a, b, n);
+}
+
+// out[i] = a[i] * s
+inline void share_scalar_mul(int64_t* out, const int64_t* a, int64_t s, size_t n) {
+    simd_detail::kernels().scalar_mul(out, a, s, n);
+}
+
+// out[i] += a[i] * s
+inline void share_scalar_mul_add(int64_t* out, const int64_t* a, int64_t s, size_t n) {
+    simd_detail::kernels().scalar_mul_add(out, a, s, n);
+}
+
+// sum_i a[i] * b[i]
+inline int64_t share_dot(const int64_t* a, const int64_t* b, size_t n) {
+    return simd_detail::kernels().dot(a, b, n);
+}
+
+// Name of the kernel set in use, for logs and benchmarks.
+inline const char* simd_impl_name() {
+    return simd_detail::kernels().name;
+}
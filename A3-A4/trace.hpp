@@ -0,0 +1,131 @@
+#pragma once
+
+// Trace of one party in Chrome trace-event format, for merging with the other parties'
+// traces by merge_traces.py and viewing in Perfetto (ui.perfetto.dev) or chrome://tracing.
+// Tracing is off unless MPC_TRACE is set in the environment; then every phase becomes a span
+// and every transfer an instant event with its link, size and sequence number on the link,
+// and the trace is written when the run ends. Events are kept in memory until then.
+//
+// Each party's timestamps come from its own steady clock. At connection time the parties
+// exchange clock pings (clock_sync_client()/clock_sync_server() in common.hpp), and the
+// client side of each link stores its best sample in the trace. merge_traces.py turns the
+// samples into clock offsets.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// One ping on a link, seen from the client: it sent at client_send, the server read its
+// clock at server_time, and the reply arrived at client_recv (all in nanoseconds).
+struct ClockSample {
+    const char* link = nullptr;
+    const char* server = nullptr;
+    int64_t client_send = 0, server_time = 0, client_recv = 0;
+
+    int64_t round_trip() const { return client_recv - client_send; }
+};
+
+class TraceRecorder {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    TraceRecorder() : enabled(std::getenv("MPC_TRACE") != nullptr), origin(Clock::now()) {}
+
+    bool on() const { return enabled; }
+
+    // Names this party in the trace; pid orders the parties in the viewer.
+    void set_party(int id, const char* name) {
+        pid = id;
+        party = name;
+    }
+
+    static int64_t nanos(Clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+    }
+
+    // Events between these carry the query's index, the others -1.
+    void begin_query() {
+        query++;
+        in_query = true;
+    }
+    void end_query() { in_query = false; }
+
+    void span(const char* name, Clock::time_point start, Clock::time_point end) {
+        if (!enabled) return;
+        events.push_back({'X', name, nullptr, nanos(start), nanos(end) - nanos(start), current_query(), 0, 0});
+    }
+
+    void transfer(bool sent, const char* link, uint64_t bytes, uint64_t seq, Clock::time_point at) {
+        if (!enabled) return;
+        events.push_back({sent ? 's' : 'r', sent ? "send" : "recv", link, nanos(at), 0, current_query(), bytes, seq});
+    }
+
+    void add_clock_sample(const ClockSample& sample) { samples.push_back(sample); }
+
+    // Writes the trace; timestamps are microseconds from this recorder's origin, which is
+    // stored (in nanoseconds of the party's clock) with the clock samples.
+    bool write_json(const std::string& path) const {
+        FILE* out = std::fopen(path.c_str(), "w");
+        if (!out) return false;
+        int64_t base = nanos(origin);
+        std::fprintf(out, "{\"traceEvents\": [\n");
+        std::fprintf(out, "{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": %d, \"tid\": 0, \"args\": {\"name\": \"%s\"}}",
+                     pid, party);
+        std::fprintf(out, ",\n{\"ph\": \"M\", \"name\": \"process_sort_index\", \"pid\": %d, \"tid\": 0, "
+                          "\"args\": {\"sort_index\": %d}}", pid, pid);
+        for (const Event& e : events) {
+            double ts = (e.start - base) / 1000.0;
+            if (e.type == 'X') {
+                std::fprintf(out, ",\n{\"ph\": \"X\", \"cat\": \"phase\", \"name\": \"%s\", \"pid\": %d, \"tid\": 0, "
+                                  "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"query\": %lld}}",
+                             e.name, pid, ts, e.duration / 1000.0, (long long)e.query);
+            } else {
+                std::fprintf(out, ",\n{\"ph\": \"i\", \"s\": \"t\", \"cat\": \"transfer\", \"name\": \"%s %s\", "
+                                  "\"pid\": %d, \"tid\": 0, \"ts\": %.3f, \"args\": {\"query\": %lld, \"link\": \"%s\", "
+                                  "\"bytes\": %llu, \"seq\": %llu}}",
+                             e.name, e.link, pid, ts, (long long)e.query, e.link, (unsigned long long)e.bytes,
+                             (unsigned long long)e.seq);
+            }
+        }
+        std::fprintf(out, "\n],\n\"otherData\": {\"party\": \"%s\", \"pid\": %d, \"origin_ns\": %lld, \"clock_sync\": [",
+                     party, pid, (long long)base);
+        for (size_t idx = 0; idx < samples.size(); idx++) {
+            const ClockSample& s = samples[idx];
+            std::fprintf(out, "%s\n  {\"link\": \"%s\", \"server\": \"%s\", \"client_send\": %lld, "
+                              "\"server_time\": %lld, \"client_recv\": %lld}",
+                         idx ? "," : "", s.link, s.server, (long long)s.client_send, (long long)s.server_time,
+                         (long long)s.client_recv);
+        }
+        std::fprintf(out, "\n]}}\n");
+        return std::fclose(out) == 0;
+    }
+
+private:
+    struct Event {
+        char type;  // 'X' span, 's' send, 'r' receive.
+        const char* name;
+        const char* link;
+        int64_t start, duration;
+        int64_t query;
+        uint64_t bytes, seq;
+    };
+
+    int64_t current_query() const { return in_query ? query : -1; }
+
+    bool enabled;
+    Clock::time_point origin;
+    int pid = 0;
+    const char* party = "";
+    int64_t query = -1;
+    bool in_query = false;
+    std::vector<Event> events;
+    std::vector<ClockSample> samples;
+};
+
+inline TraceRecorder& trace_recorder() {
+    static TraceRecorder recorder;
+    return recorder;
+}
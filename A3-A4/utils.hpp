@@ -1,5 +1,9 @@
 #pragma once
 
+#include "dpf.hpp"
+#include "prg.hpp"
+#include "ring.hpp"
+
 #include <utility>
 #include <iostream>
 #include <vector>
@@ -8,149 +12,7 @@
 #include <string>
 #include <fstream>
 #include <cstdint>
-
-using u64 = uint64_t;
-using ShareVec = std::vector<int64_t>;
-using ShareMat = std::vector<ShareVec>;
-
-struct ChildSeed {
-    u64 s_left, s_right;
-    bool f_left, f_right;
-};
-
-struct CorrectionWord {
-    u64 scw;
-    bool fcw_0;
-    bool fcw_1;
-};
-
-struct DPFKey {
-    u64 s_root;
-    bool f_root;
-    std::vector<CorrectionWord> cws;
-    int64_t FCW;
-    int sign;
-};
-
-inline int8_t random_int8() {
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    static std::uniform_int_distribution<int16_t> dis(-128, 127);
-    return (int8_t)dis(gen);
-}
-
-inline uint8_t random_uint8() {
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    static std::uniform_int_distribution<uint8_t> dis;
-    return dis(gen);
-}
-
-inline ChildSeed PRG(u64 seed) {
-    std::mt19937 engine(seed);
-    ChildSeed child;
-    child.s_left = (uint8_t)engine();
-    child.s_right = (uint8_t)engine();
-    child.f_left = (engine() % 2 == 1);
-    child.f_right = (engine() % 2 == 1);
-    return child;
-}
-
-inline std::mt19937& get_prg_engine() {
-    static std::random_device rd;
-    static std::mt19937 engine(rd());
-    return engine;
-}
-
-inline std::pair<DPFKey, DPFKey> generateDPF(u64 index, int64_t value, u64 domain_size) {
-    int depth = (domain_size == 0) ? 0 : ceil(log2(domain_size));
-    if (depth == 0) { depth = 1; domain_size = 2; }
-
-    DPFKey k0, k1;
-
-    u64 s0_curr = random_uint8();
-    u64 s1_curr = random_uint8();
-    bool f0_curr = 0;
-    bool f1_curr = 1;
-
-    k0.s_root = s0_curr;
-    k1.s_root = s1_curr;
-    k0.f_root = f0_curr;
-    k1.f_root = f1_curr;
-
-    for(int i=0;i<depth;i++) {
-        ChildSeed c0 = PRG(s0_curr);
-        ChildSeed c1 = PRG(s1_curr);
-        bool path_bit = (index >> (depth - 1 - i)) & 1;
-        bool f0_next, f1_next;
-        CorrectionWord cw;
-
-        if (path_bit == 0) {
-            cw.scw = c0.s_right ^ c1.s_right;
-            cw.fcw_1 = c0.f_right ^ c1.f_right;
-            cw.fcw_0 = c0.f_left ^ c1.f_left ^ 1;
-            s0_curr = c0.s_left; s1_curr = c1.s_left;
-            f0_next = c0.f_left; f1_next = c1.f_left;
-        } else {
-            cw.scw = c0.s_left ^ c1.s_left;
-            cw.fcw_0 = c0.f_left ^ c1.f_left;
-            cw.fcw_1 = c0.f_right ^ c1.f_right ^ 1;
-            s0_curr = c0.s_right; s1_curr = c1.s_right;
-            f0_next = c0.f_right; f1_next = c1.f_right;
-        }
-        if (f0_curr) {
-            s0_curr ^= cw.scw;
-            f0_next ^= (path_bit == 0) ? cw.fcw_0 : cw.fcw_1;
-        }
-        if (f1_curr) {
-            s1_curr ^= cw.scw;
-            f1_next ^= (path_bit == 0) ? cw.fcw_0 : cw.fcw_1;
-        }
-        f0_curr = f0_next; f1_curr = f1_next;
-        k0.cws.push_back(cw); k1.cws.push_back(cw);
-    }
-
-    int64_t s0_final = (int64_t)s0_curr;
-    int64_t s1_final = (int64_t)s1_curr;
-    int64_t R = random_int8();
-
-    k0.sign = f0_curr * 1 + (1-f0_curr) * (-1);
-    k1.sign = f1_curr * 1 + (1-f1_curr) * (-1);
-
-    k0.FCW = R + k0.sign * s0_final;
-    k1.FCW = (value - R) + k1.sign * s1_final;
-
-    return {k0, k1};
-}
-
-inline int64_t evalDPF(const DPFKey& key, u64 index, u64 domain_size) {
-    int depth = (domain_size == 0) ? 0 : ceil(log2(domain_size));
-    if (depth == 0) { depth = 1; domain_size = 2; }
-
-    u64 s_curr = key.s_root;
-    bool f_curr = key.f_root;
-
-    for(int i=0; i<depth; i++) {
-        ChildSeed ch = PRG(s_curr);
-        bool path_bit = (index >> (depth - 1 - i)) & 1;
-        bool f_next;
-        if(path_bit == 0){ s_curr = ch.s_left; f_next = ch.f_left; }
-        else { s_curr = ch.s_right; f_next = ch.f_right; }
-        if(f_curr){
-            s_curr ^= key.cws[i].scw;
-            f_next ^= (path_bit == 0) ? key.cws[i].fcw_0 : key.cws[i].fcw_1;
-        }
-        f_curr = f_next;
-    }
-
-    int64_t value = (int64_t)s_curr;
-
-    if(f_curr) {
-        value += key.FCW;
-    }
-
-    return value * key.sign;
-}
+#include <stdexcept>
 
 inline std::vector<int64_t> EvalFull(const DPFKey& k, u64 domain_size) {
     std::vector<int64_t> result(domain_size);
@@ -160,35 +22,6 @@ inline std::vector<int64_t> EvalFull(const DPFKey& k, u64 domain_size) {
     return result;
 }
 
-inline void write_key(std::ostream& out, const DPFKey& key) {
-    out.write(reinterpret_cast<const char*>(&key.s_root), sizeof(key.s_root));
-    out.write(reinterpret_cast<const char*>(&key.f_root), sizeof(key.f_root));
-    out.write(reinterpret_cast<const char*>(&key.FCW), sizeof(key.FCW));
-    out.write(reinterpret_cast<const char*>(&key.sign), sizeof(key.sign));
-    
-    size_t cw_size = key.cws.size();
-    out.write(reinterpret_cast<const char*>(&cw_size), sizeof(cw_size));
-    if (cw_size > 0) {
-        out.write(reinterpret_cast<const char*>(key.cws.data()), cw_size * sizeof(CorrectionWord));
-    }
-}
-
-inline DPFKey read_key(std::istream& in) {
-    DPFKey key;
-    in.read(reinterpret_cast<char*>(&key.s_root), sizeof(key.s_root));
-    in.read(reinterpret_cast<char*>(&key.f_root), sizeof(key.f_root));
-    in.read(reinterpret_cast<char*>(&key.FCW), sizeof(key.FCW));
-    in.read(reinterpret_cast<char*>(&key.sign), sizeof(key.sign));
-    
-    size_t cw_size;
-    in.read(reinterpret_cast<char*>(&cw_size), sizeof(cw_size));
-    key.cws.resize(cw_size);
-    if (cw_size > 0) {
-        in.read(reinterpret_cast<char*>(key.cws.data()), cw_size * sizeof(CorrectionWord));
-    }
-    return key;
-}
-
 inline ShareMat load_matrix_shares(const std::string& filename, uint32_t rows, uint32_t cols) {
     std::ifstream in(filename);
     if (!in) {